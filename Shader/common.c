@@ -4,100 +4,136 @@
 
 #include "common.h"
 
-/************* Distance measures *************/
-
-miScalar dist_linear_squared(miVector2d *v1, miVector2d *v2) {
-  // 3D:
-  // miVector s; mi_vector_sub(&s,&v1,&v2)
-  // return mi_vector_dot(r,r);
-  miScalar d1 = v1->u - v2->u;
-  miScalar d2 = v1->v - v2->v;
-  return d1 * d1 + d2 * d2;
-}
+#include <stdlib.h>
+#include <string.h>
+
+/************* Noise *************/
 
-miScalar dist_linear(miVector2d *v1, miVector2d *v2) {
-  return sqrt( dist_linear_squared(v1,v2) );
+static float mr_unoise2(float u, float v) {
+  return mi_unoise_2d(u, v);
 }
 
-miScalar dist_manhattan(miVector2d *v1, miVector2d *v2) {
-  // 3D:
-  // miVector s; mi_vector_sub(&s,&v1,&v2)
-  // return s.x + s.y + s.z;
-  miScalar d1 = v1->u - v2->u;
-  miScalar d2 = v1->v - v2->v;
-  return fabs(d1) + fabs(d2);
+static float mr_noise2(float u, float v) {
+  return mi_noise_2d(u, v);
 }
 
-miScalar dist_linear_squared3(miVector *v1, miVector *v2) {
-  miVector s; mi_vector_sub(&s,v1,v2);
-  return mi_vector_dot(&s,&s);
+static float mr_unoise3(const worley_vec3 *p) {
+  miVector v;
+  v.x = p->x; v.y = p->y; v.z = p->z;
+  return mi_unoise_3d(&v);
 }
 
-miScalar dist_linear3(miVector *v1, miVector *v2) {
-  return sqrt( dist_linear_squared3(v1,v2) );
+const worley_noise mr_noise = {
+  mr_unoise2,
+  mr_noise2,
+  mr_unoise3,
+  "mental ray"
+};
+
+
+/************* Shader *************/
+
+miBoolean mr_threads_init(mr_threads *threads, int dims) {
+  threads->count = mi_par_nthreads();
+  threads->contexts = worley_context_pool_create(threads->count, dims, WORLEY_MAX_OCTAVES, MR_CELL_CACHE_SIZE, mr_cell_format());
+  threads->tiles = mi_mem_allocate( threads->count * sizeof(worley_tile_cache *) );
+  for(int i = 0; i < threads->count; i++)
+    threads->tiles[i] = mr_tile_cache_open();
+  return threads->contexts != NULL;
 }
 
-miScalar dist_manhattan3(miVector *v1, miVector *v2) {
-  // 3D:
-  miVector s; mi_vector_sub(&s,v1,v2);
-  return fabs(s.x) + fabs(s.y) + fabs(s.z);
+void mr_threads_exit(mr_threads *threads) {
+  worley_context_pool_destroy(threads->contexts);
+  for(int i = 0; i < threads->count; i++)
+    worley_tile_cache_close(threads->tiles[i]);
+  mi_mem_release(threads->tiles);
 }
 
-// // note: Behavior might get weird for p <= 0.
-//          Usually, use integer values for p.
-// miScalar dist_minkowski(miScalar p, miVector2d v1, miVector2d v2) {
-//   // 3D:
-//   // miVector s; mi_vector_sub(&r,&v1,&v2);
-//   // mi_vector_abs(&s,&s);
-//   // mi_vector_pow(&s,p);
-//   // return powf(s.x + s.y + s.z,(1/p));
-//   miScalar d1 = powf(fabs(v1.u - v2.u),p);
-//   miScalar d2 = powf(fabs(v1.v - v2.v),p);
-//   return powf(d1 + d2, 1/p);
-// }
-
-miScalar dist_scale(dist_measure m) {
-  switch(m) {
-    case DIST_LINEAR: return 0.04;
-    case DIST_LINEAR_SQUARED: return 0.01;
-    case DIST_MANHATTAN: return 0.07;
-    // case DIST_MINKOWSKI: return 30; // actually, this should be based on the parameter p. This is for 2, since that is the same as linear/euclidean distance
-    default: return -1;
+#ifdef WORLEY_PROFILE
+void mr_report_profile(const char *shader, const mr_threads *threads) {
+  worley_cache_stats stats;
+  worley_context_pool_stats(threads->contexts, &stats);
+  double samples = stats.samples ? (double)stats.samples : 1;
+  mi_info("%s: %llu samples on %d threads, %llu searches (%llu for the jagged gap), %.1f cubes and %.1f points visited per search",
+          shader, stats.samples, threads->count, stats.searches, stats.jagged_searches,
+          stats.searches ? (double)stats.cells_visited / stats.searches : 0, stats.searches ? (double)stats.points_visited / stats.searches : 0);
+  mi_info("%s: cubes %llu generated, %llu reused from the window, %llu from the cell cache (hit rate %.1f%%)",
+          shader, stats.cells_generated, stats.cells_reused, stats.cells_cached, 100 * worley_cell_cache_hit_rate(&stats));
+  mi_info("%s: %.0f %s per sample searching, %.0f generating cubes",
+          shader, stats.search_cycles / samples, worley_profiled(), stats.generate_cycles / samples);
+}
+#endif
+
+unsigned int mr_varying_params(miState *state, void *param, const size_t *offsets, int count) {
+  // mental ray keeps a tag for every parameter at ghost_offs bytes behind it, set if the parameter is connected to
+  // a shader (or to a phenomenon's interface). Without a ghost area, or with a null tag, mi_eval returns the parameter
+  // itself, so reading such a parameter once at init gives what every sample would get: resolving it early is safe.
+  // The tags tell the connected parameters apart without running their shaders at init, where the state has no point
+  // to shade. Interface parameters count as varying even if the phenomenon's value is constant, which only costs
+  // their evaluation per sample.
+  int ghost_offs = state->shader->ghost_offs;
+  unsigned int varying = 0;
+  if(!ghost_offs)
+    return 0;
+  for(int i = 0; i < count; i++) {
+    const miTag *ghost = (const miTag *)((const char *)param + offsets[i] + ghost_offs);
+    if(*ghost)
+      varying |= 1u << i;
   }
+  return varying;
 }
 
-miScalar distance(dist_measure distance_measure, miVector2d *v1, miVector2d *v2) {
-  switch(distance_measure) {
-    case DIST_LINEAR: return dist_linear(v1,v2);
-    case DIST_LINEAR_SQUARED: return dist_linear_squared(v1,v2);
-    case DIST_MANHATTAN: return dist_manhattan(v1,v2);
-    // case DIST_MINKOWSKI: return 30; // actually, this should be based on the parameter p. This is for 2, since that is the same as linear/euclidean distance
-    default: return -1;
+void mr_report_varying(const char *shader, unsigned int varying, const char *const *names, int count) {
+  char list[512] = "";
+  for(int i = 0; i < count; i++) {
+    if(varying & (1u << i)) {
+      strncat(list, " ", sizeof(list) - strlen(list) - 1);
+      strncat(list, names[i], sizeof(list) - strlen(list) - 1);
+    }
   }
+  mi_info("%s: %s%s", shader, varying ? "evaluated per sample:" : "all parameters constant", list);
 }
 
-miScalar distance3(dist_measure distance_measure, miVector *v1, miVector *v2) {
-  switch(distance_measure) {
-    case DIST_LINEAR: return dist_linear3(v1,v2);
-    case DIST_LINEAR_SQUARED: return dist_linear_squared3(v1,v2);
-    case DIST_MANHATTAN: return dist_manhattan3(v1,v2);
-    // case DIST_MINKOWSKI: return 30; // actually, this should be based on the parameter p. This is for 2, since that is the same as linear/euclidean distance
-    default: return -1;
-  }
+void mr_fractal(worley_fractal *fractal, miInteger octaves, miScalar lacunarity, miScalar gain, miInteger mode, miInteger octave_mode) {
+  worley_fractal_default(fractal, (dist_mode)(octave_mode < 0 ? mode : octave_mode));
+  fractal->modes[0] = (dist_mode)mode;
+  fractal->octaves = octaves;
+  fractal->lacunarity = lacunarity;
+  fractal->gain = gain;
 }
 
+void mr_grey_to_color(miScalar val, miColor *color1, miColor *color2, miColor *result) {
+  worley_color c1 = { color1->r, color1->g, color1->b, color1->a };
+  worley_color c2 = { color2->r, color2->g, color2->b, color2->a };
+  worley_color r;
+  grey_to_color(val, &c1, &c2, &r);
+  result->r = r.r; result->g = r.g; result->b = r.b; result->a = r.a;
+}
 
-/************* Shader *************/
+void mr_filtered_to_color(miScalar val, miScalar gap_coverage, miColor *inner, miColor *outer, miColor *gap, miColor *result) {
+  worley_colors colors = {
+    { inner->r, inner->g, inner->b, inner->a },
+    { outer->r, outer->g, outer->b, outer->a },
+    { gap->r, gap->g, gap->b, gap->a }
+  };
+  worley_color r;
+  worley_filtered_color(val, gap_coverage, &colors, &r);
+  result->r = r.r; result->g = r.g; result->b = r.b; result->a = r.a;
+}
 
-void grey_to_color(miScalar val, miColor *color1, miColor *color2, miColor *result) {
-  result->r = (color1)->r * (1 - val) + (color2)->r * val;
-  result->g = (color1)->g * (1 - val) + (color2)->g * val;
-  result->b = (color1)->b * (1 - val) + (color2)->b * val;
-  result->a = (color1)->a * (1 - val) + (color2)->a * val;
+worley_tile_cache *mr_tile_cache_open(void) {
+  const char *dir = getenv("WORLEY_TILE_CACHE");
+  const char *write = getenv("WORLEY_TILE_CACHE_WRITE");
+  return worley_tile_cache_open(dir, MR_TILE_CACHE_SIZE, write && atoi(write) != 0);
 }
 
-// scales its positive input (which should already be approximately between 0 and 1) to the interval [0, 1)
-// it is a tuned logistic sigmoid function
-miScalar scaling_function(miScalar x) {
-  return 2 * (1 / (1 + expf((-1) * (3*x))) - 0.5);
+worley_cell_format mr_cell_format(void) {
+  const char *format = getenv("WORLEY_CELL_FORMAT");
+  if(!format || !*format)
+    return MR_CELL_FORMAT;
+  if(!strcmp(format, "float")) return WORLEY_CELLS_FLOAT;
+  if(!strcmp(format, "16")) return WORLEY_CELLS_16;
+  if(!strcmp(format, "8")) return WORLEY_CELLS_8;
+  mi_warning("WORLEY_CELL_FORMAT=%s is not float, 16 or 8", format);
+  return MR_CELL_FORMAT;
 }
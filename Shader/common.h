@@ -6,6 +6,10 @@
 #include <math.h>
 #include <shader.h>
 #include <float.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "worley.h"
 
 
 /************* Helpers *************/
@@ -21,61 +25,67 @@
                             (r)->z = powf((r)->z,p))
 
 
-/************* Distance measures *************/
-
-miScalar dist_linear_squared(miVector2d *v1, miVector2d *v2);
-
-miScalar dist_linear(miVector2d *v1, miVector2d *v2);
-
-miScalar dist_manhattan(miVector2d *v1, miVector2d *v2);
-
-miScalar dist_linear_squared3(miVector *v1, miVector *v2);
-
-miScalar dist_linear3(miVector *v1, miVector *v2);
-
-miScalar dist_manhattan3(miVector *v1, miVector *v2);
+/************* Noise *************/
 
-// // note: Behavior might get weird for p <= 0.
-//          Usually, use integer values for p.
-// miScalar dist_minkowski(miScalar p, miVector2d v1, miVector2d v2) {
-//   // 3D:
-//   // miVector s; mi_vector_sub(&r,&v1,&v2);
-//   // mi_vector_abs(&s,&s);
-//   // mi_vector_pow(&s,p);
-//   // return powf(s.x + s.y + s.z,(1/p));
-//   miScalar d1 = powf(fabs(v1.u - v2.u),p);
-//   miScalar d2 = powf(fabs(v1.v - v2.v),p);
-//   return powf(d1 + d2, 1/p);
-// }
+// mi_unoise_2d/mi_noise_2d/mi_unoise_3d for the core (see worley.h),
+// so shaders rendered through mental ray keep the look of existing scenes.
+extern const worley_noise mr_noise;
 
-typedef enum dist_measure {
-  DIST_LINEAR = 0
-, DIST_LINEAR_SQUARED = 1
-, DIST_MANHATTAN = 2
-// , DIST_MINKOWSKI = 3
-} dist_measure;
-
-typedef enum dist_mode {
-  DIST_F1 = 0 // f1
-, DIST_F2_M_F1 = 1 // f2 - f1, 
-, DIST_F1_P_F2 = 2 // (2 * f1 + f2) / 3, 
-, DIST_F3_M_F2_M_F1 = 3 // (2 * f3 - f2 - f1) / 2, 
-, DIST_F1_P_F2_P_F3 = 4 // (0.5 * f1 + 0.33 * f2 + (1 - 0.5 - 0.33) * f3)
-} dist_mode;
-
-miScalar dist_scale(dist_measure m);
-
-miScalar distance(dist_measure distance_measure, miVector2d *v1, miVector2d *v2);
-
-miScalar distance3(dist_measure distance_measure, miVector *v1, miVector *v2);
 
 /************* Shader *************/
 
-#define PTS_PER_CUBE 4
-#define CUBE_DIST 0.05
-
-void grey_to_color(miScalar val, miColor *color1, miColor *color2, miColor *result);
-
-// scales its positive input (which should already be approximately between 0 and 1) to the interval [0, 1)
-// it is a tuned logistic sigmoid function
-miScalar scaling_function(miScalar x);
+// number of cubes each render thread remembers per shader instance (see worley_cell_cache_create)
+#define MR_CELL_CACHE_SIZE 512
+// and how it stores them, unless the environment variable WORLEY_CELL_FORMAT is float, 16 or 8 (see mr_cell_format).
+#define MR_CELL_FORMAT WORLEY_CELLS_FLOAT
+
+// number of tiles each render thread keeps mapped per shader instance (see worley_tile_cache_open)
+#define MR_TILE_CACHE_SIZE 64
+
+// a render thread's tile cache if the environment variable WORLEY_TILE_CACHE names a directory, NULL otherwise.
+// WORLEY_TILE_CACHE_WRITE=1 also bakes and writes the missing tiles.
+worley_tile_cache *mr_tile_cache_open(void);
+
+// the format of the render threads' cell caches: WORLEY_CELL_FORMAT=16 or 8 stores the cubes in 36 or 28 bytes
+// instead of 60, with the values off by a little (see worley_cell_format); MR_CELL_FORMAT otherwise
+worley_cell_format mr_cell_format(void);
+
+// the per render thread state of a shader instance, allocated at instance init for all of mental ray's threads
+// and indexed by state->thread, instead of looked up and allocated through miQ_FUNC_TLS_GET per sample.
+// Every thread has WORLEY_MAX_OCTAVES contexts (one per octave, see worleynoise_fractal) sharing one cell cache.
+// A thread numbered count or above shades with fresh contexts on its stack instead, without cell or tile cache.
+typedef struct {
+  int count;
+  worley_context_pool *contexts;
+  worley_tile_cache **tiles; // NULL entries without WORLEY_TILE_CACHE
+} mr_threads;
+
+miBoolean mr_threads_init(mr_threads *threads, int dims);
+void mr_threads_exit(mr_threads *threads);
+
+// Reports the counters of all threads of an instance with mi_info, at instance exit.
+// Only with WORLEY_PROFILE (make PROFILE=1); otherwise the call compiles to nothing.
+#ifdef WORLEY_PROFILE
+void mr_report_profile(const char *shader, const mr_threads *threads);
+#else
+#define mr_report_profile(shader, threads) ((void)0)
+#endif
+
+// Parameter resolution. mi_eval returns the parameter itself if it isn't connected to another shader;
+// such parameters are constant, so the shaders read them once at instance init and only evaluate the connected
+// (varying) ones per sample. offsets are the offsetof()s of the parameters in the shader's parameter struct.
+// Returns a bit (1 << i) for every connected parameter i. Nothing is evaluated: the connected parameters' shaders
+// only ever run for samples.
+unsigned int mr_varying_params(miState *state, void *param, const size_t *offsets, int count);
+
+// reports the varying parameters of a shader instance with mi_info, so slow instances can be explained
+void mr_report_varying(const char *shader, unsigned int varying, const char *const *names, int count);
+
+// the multi-octave parameters of both shaders (see worley_fractal in worley.h); octave_mode -1 is the distance mode
+void mr_fractal(worley_fractal *fractal, miInteger octaves, miScalar lacunarity, miScalar gain, miInteger mode, miInteger octave_mode);
+
+// like grey_to_color in worley.h, on mental ray colors
+void mr_grey_to_color(miScalar val, miColor *color1, miColor *color2, miColor *result);
+
+// like worley_filtered_color in worley.h, on mental ray colors
+void mr_filtered_to_color(miScalar val, miScalar gap_coverage, miColor *inner, miColor *outer, miColor *gap, miColor *result);
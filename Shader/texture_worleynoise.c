@@ -4,9 +4,6 @@
 
 #include "common.h"
 
-// 3^DIMENSIONS * PTS_PER_CUBE.
-#define CACHE_SIZE 36
-
 // has to fit the .mi file
 typedef struct {
 	miScalar        u;
@@ -21,13 +18,96 @@ typedef struct {
   miInteger distance_mode;
   miScalar scale;
   miScalar gap_size;
+  miInteger point_generator;
+  miScalar filter_size;
+  miInteger period;
+  miInteger atlas_size;
+  miInteger octaves;
+  miScalar lacunarity;
+  miScalar gain;
+  miInteger octave_distance_mode;
+  miScalar density;
+  miInteger points_per_cube;
+  miScalar minkowski_p;
+  miVector axis_weights;
+  miInteger gap_test;
 } texture_worleynoise_t;
 
+// the parameters above, in order (atlas_size is only read at init). Their bits (1 << P_name) mark the varying ones.
+#define TEXTURE_WORLEYNOISE_PARAMS(X) \
+  X(u) X(v) X(jagged_gap) X(inner) X(outer) X(gap) X(distance_measure) X(distance_mode) X(scale) X(gap_size) \
+  X(point_generator) X(filter_size) X(period) X(octaves) X(lacunarity) X(gain) X(octave_distance_mode) \
+  X(density) X(points_per_cube) X(minkowski_p) X(axis_weights) X(gap_test)
+
+#define PARAM_ENUM(name) P_##name,
+#define PARAM_NAME(name) #name,
+#define PARAM_OFFSET(name) offsetof(texture_worleynoise_t, name),
+enum { TEXTURE_WORLEYNOISE_PARAMS(PARAM_ENUM) P_COUNT };
+static const char *const param_names[] = { TEXTURE_WORLEYNOISE_PARAMS(PARAM_NAME) };
+static const size_t param_offsets[] = { TEXTURE_WORLEYNOISE_PARAMS(PARAM_OFFSET) };
+
+// the parameters, resolved. The colors are kept here, but only evaluated when a sample needs them.
+typedef struct {
+  worley_params params;
+  worley_vec2 pt;
+  miColor inner, outer, gap;
+  miScalar filter_size;
+  miInteger octaves;
+  miScalar lacunarity, gain;
+  miInteger octave_distance_mode;
+  worley_fractal fractal;
+} texture_worleynoise_resolved;
+
+// per shader instance state
 typedef struct {
-  miBoolean cache_initialized;
-  miVector2d cacheCube; // the "center" cube of the cache
-  miVector2d cacheVals[CACHE_SIZE]; 
-} worley_context;
+  unsigned int varying; // connected parameters, see TEXTURE_WORLEYNOISE_PARAMS
+  texture_worleynoise_resolved constant; // the unconnected parameters, as resolved at init (defaults for the others)
+  worley_atlas *atlas; // baked at instance init if atlas_size is set, NULL otherwise
+  worley_evaluator *eval; // the constant parameters prepared at instance init, NULL if EVAL_PARAMS are connected
+  mr_threads threads;
+} texture_worleynoise_instance;
+
+// the parameters a baked atlas depends on
+#define ATLAS_PARAMS ((1u << P_jagged_gap) | (1u << P_distance_measure) | (1u << P_scale) | (1u << P_gap_size) \
+  | (1u << P_point_generator) | (1u << P_period) | (1u << P_density) | (1u << P_points_per_cube) \
+  | (1u << P_minkowski_p) | (1u << P_axis_weights) | (1u << P_gap_test))
+
+// the parameters worleynoise_val depends on
+#define EVAL_PARAMS (ATLAS_PARAMS | (1u << P_distance_mode))
+
+#define RESOLVE(name) (mask & (1u << P_##name))
+
+// evaluates the parameters in mask (but the colors) into r; the others keep their values.
+// note: getting current values must always be wrapped in mi_eval... calls!
+static void resolve(miState *state, texture_worleynoise_t *param, unsigned int mask, texture_worleynoise_resolved *r) {
+  if(RESOLVE(u)) r->pt.u = *mi_eval_scalar(&param->u);
+  if(RESOLVE(v)) r->pt.v = *mi_eval_scalar(&param->v);
+  if(RESOLVE(jagged_gap)) r->params.jagged_gap = *mi_eval_boolean(&param->jagged_gap);
+  if(RESOLVE(distance_measure)) r->params.distance_measure = *mi_eval_integer(&param->distance_measure);
+  if(RESOLVE(distance_mode)) r->params.distance_mode = *mi_eval_integer(&param->distance_mode);
+  if(RESOLVE(scale)) r->params.scale = *mi_eval_scalar(&param->scale);
+  if(RESOLVE(gap_size)) r->params.gap_size = *mi_eval_scalar(&param->gap_size);
+  if(RESOLVE(point_generator)) r->params.point_gen = *mi_eval_integer(&param->point_generator);
+  if(RESOLVE(filter_size)) r->filter_size = *mi_eval_scalar(&param->filter_size);
+  if(RESOLVE(period)) r->params.period = *mi_eval_integer(&param->period);
+  if(RESOLVE(octaves)) r->octaves = *mi_eval_integer(&param->octaves);
+  if(RESOLVE(lacunarity)) r->lacunarity = *mi_eval_scalar(&param->lacunarity);
+  if(RESOLVE(gain)) r->gain = *mi_eval_scalar(&param->gain);
+  if(RESOLVE(octave_distance_mode)) r->octave_distance_mode = *mi_eval_integer(&param->octave_distance_mode);
+  if(RESOLVE(density)) r->params.density = *mi_eval_scalar(&param->density);
+  if(RESOLVE(points_per_cube)) r->params.points_per_cube = *mi_eval_integer(&param->points_per_cube);
+  if(RESOLVE(minkowski_p)) r->params.minkowski_p = *mi_eval_scalar(&param->minkowski_p);
+  if(RESOLVE(axis_weights)) {
+    miVector *w = mi_eval_vector(&param->axis_weights);
+    r->params.axis_weights[0] = w->x; r->params.axis_weights[1] = w->y; r->params.axis_weights[2] = w->z;
+  }
+  if(RESOLVE(gap_test)) r->params.gap_test = *mi_eval_integer(&param->gap_test);
+  if(mask & ((1u << P_distance_mode) | (1u << P_octaves) | (1u << P_lacunarity) | (1u << P_gain) | (1u << P_octave_distance_mode)))
+    mr_fractal(&r->fractal, r->octaves, r->lacunarity, r->gain, r->params.distance_mode, r->octave_distance_mode);
+}
+
+// a color parameter: the resolved one if constant
+#define RESOLVED_COLOR(name) (((*instance)->varying & (1u << P_##name)) ? mi_eval_color(&param->name) : &r->name)
 
 DLLEXPORT int texture_worleynoise_version(void) {return(2);}
 
@@ -36,7 +116,53 @@ DLLEXPORT miBoolean texture_worleynoise_init(
     texture_worleynoise_t *param,
     miBoolean *init_req)
 {
-  *init_req = miTRUE;
+  if (!param) { /* shader init */
+    *init_req = miTRUE;
+  } else { /* shader instance init */
+    // resolve the unconnected parameters once; samples evaluate the connected ones. Those aren't evaluated here:
+    // the init state has no point to shade, so they keep the defaults.
+    texture_worleynoise_instance *instance = mi_mem_allocate( sizeof(texture_worleynoise_instance) );
+    texture_worleynoise_resolved *r = &instance->constant;
+    memset(r, 0, sizeof(*r));
+    worley_params_default(&r->params);
+    r->params.noise = &mr_noise;
+    r->octaves = 1;
+    r->lacunarity = 2;
+    r->gain = 0.5;
+    r->octave_distance_mode = -1;
+    instance->varying = mr_varying_params(state, param, param_offsets, P_COUNT);
+    mr_report_varying("texture_worleynoise", instance->varying, param_names, P_COUNT);
+    resolve(state, param, ~instance->varying, r);
+    if(!(instance->varying & (1u << P_inner))) r->inner = *mi_eval_color(&param->inner);
+    if(!(instance->varying & (1u << P_outer))) r->outer = *mi_eval_color(&param->outer);
+    if(!(instance->varying & (1u << P_gap))) r->gap = *mi_eval_color(&param->gap);
+    
+    // bake the pattern once, so samples only interpolate. Needs a period to be tileable,
+    // and the parameters the atlas depends on (see worley_atlas_matches) unconnected.
+    instance->atlas = NULL;
+    const size_t atlas_offset = offsetof(texture_worleynoise_t, atlas_size);
+    miInteger atlas_size = mr_varying_params(state, param, &atlas_offset, 1) ? 0 : *mi_eval_integer(&param->atlas_size);
+    if(atlas_size > 0 && (instance->varying & ATLAS_PARAMS))
+      mi_warning("texture_worleynoise: no atlas, as parameters that shape the pattern are connected");
+    else if(atlas_size > 0) {
+      if(r->params.period > 0)
+        instance->atlas = worley_atlas_bake(&r->params, atlas_size);
+      if(!instance->atlas)
+        mi_warning("texture_worleynoise: could not bake a %d atlas (atlas_size has to be a power of two, period > 0 and the u and v axis_weights equal)", atlas_size);
+    }
+    
+    // prepare the parameters once, so samples only search
+    instance->eval = NULL;
+    if(!(instance->varying & EVAL_PARAMS) && !(instance->eval = worley_evaluator_create(&r->params, 2)))
+      mi_fatal("texture_worleynoise: out of memory for the evaluator");
+    
+    if(!mr_threads_init(&instance->threads, 2))
+      mi_fatal("texture_worleynoise: out of memory for the render threads' contexts");
+    
+    void **user;
+    mi_query(miQ_FUNC_USERPTR, state, miNULLTAG, &user);
+    *user = instance;
+  }
   return(miTRUE);
 }
 
@@ -45,13 +171,16 @@ DLLEXPORT miBoolean texture_worleynoise_exit(
     texture_worleynoise_t *param)
 {
   if (param) { /* shader instance exit */
-    // note: is is indeed correct to release the contexts during shader instance exit!!!
-    // (TODO: explain why)
-    int num;
-    worley_context **contexts;
-    mi_query(miQ_FUNC_TLS_GETALL, state, miNULLTAG, &contexts, &num);
-    for(int i=0; i < num; i++) {
-      mi_mem_release(contexts[i]);
+    // the contexts are released with the instance, as no render thread uses it anymore
+    void **user;
+    mi_query(miQ_FUNC_USERPTR, state, miNULLTAG, &user);
+    if (*user) {
+      mr_report_profile("texture_worleynoise", &((texture_worleynoise_instance *)*user)->threads);
+      mr_threads_exit(&((texture_worleynoise_instance *)*user)->threads);
+      worley_atlas_destroy(((texture_worleynoise_instance *)*user)->atlas);
+      worley_evaluator_destroy(((texture_worleynoise_instance *)*user)->eval);
+      mi_mem_release(*user);
+      *user = NULL;
     }
   } else {
     /* shader exit */
@@ -59,50 +188,36 @@ DLLEXPORT miBoolean texture_worleynoise_exit(
   return(miTRUE);
 }
 
-miScalar worleynoise_val(miState *state,texture_worleynoise_t *param);
 DLLEXPORT miBoolean texture_worleynoise(
     miColor *result,
     miState *state,
     texture_worleynoise_t *param)
 {
-  worley_context *context;
-  mi_query(miQ_FUNC_TLS_GET, state, miNULLTAG, &context);
-  if (!context) {
-    context = mi_mem_allocate( sizeof(worley_context) );
-    mi_query(miQ_FUNC_TLS_SET, state, miNULLTAG, &context);
-    context->cache_initialized = 0;
+  texture_worleynoise_instance **instance;
+  mi_query(miQ_FUNC_USERPTR, state, miNULLTAG, &instance);
+  // the parameters: as resolved at init, with the connected ones evaluated again
+  texture_worleynoise_resolved *r = &(*instance)->constant;
+  texture_worleynoise_resolved varying;
+  if ((*instance)->varying) {
+    varying = *r;
+    resolve(state, param, (*instance)->varying, &varying);
+    r = &varying;
   }
+  const worley_params *params = &r->params;
   
-  
-  miScalar val = worleynoise_val(state,param);
-  
-  if(val < 0) {
-    miColor gap = *mi_eval_color(&param->gap);
-    result->r = gap.r;
-    result->g = gap.g;
-    result->b = gap.b;
-    result->a = gap.a;
-  }
-  else {
-    miColor *inner = mi_eval_color(&param->inner);
-    miColor *outer = mi_eval_color(&param->outer);
-    
-    grey_to_color(val, inner, outer, result);
+  // this thread's contexts, fetched once and passed down explicitly
+  worley_context2 *contexts = worley_context_pool_get2((*instance)->threads.contexts, state->thread);
+  worley_tile_cache *tiles = NULL;
+  worley_context2 spare[WORLEY_MAX_OCTAVES];
+  if (contexts) {
+    tiles = (*instance)->threads.tiles[state->thread];
+  } else {
+    // a thread mental ray did not count at init: fresh contexts without cell cache, for the octaves this sample uses
+    for(int o = 0; o < WORLEY_MAX_OCTAVES && (o == 0 || o < r->octaves); o++)
+      worley_context2_init(&spare[o]);
+    contexts = spare;
   }
-  	
-  
-  return(miTRUE);
-}
-
-void point_distances(miState *state,texture_worleynoise_t *param, 
-                     miVector2d *pt,
-                     miScalar *f1, miVector2d *p1,
-                     miScalar *f2, miVector2d *p2,
-                     miScalar *f3, miVector2d *p3);
-
-miScalar worleynoise_val(miState *state,texture_worleynoise_t *param) {
-  miScalar f1, f2, f3;
-  miVector2d p1, p2, p3;
+  worley_context2 *context = &contexts[0];
   
   // ways to get the current point:
   // state->tex_list[0]; // yields good results only in the x and y coordinate
@@ -110,160 +225,48 @@ miScalar worleynoise_val(miState *state,texture_worleynoise_t *param) {
   // state->tex // does not yield usable results / seems to be constant
 	// 
 	// instead, we just take an u and v value explicitly; they would usually be provided by a 2D placement node.
-	
-	// note: getting current values must always be wrapped in mi_eval... calls!
-	miVector2d pt;
-	pt.u = *mi_eval_scalar(&param->u); pt.v = *mi_eval_scalar(&param->v); 
-	
-  point_distances(state,param,&pt,&f1,&p1,&f2,&p2,&f3,&p3);
-  
-  miInteger dist_measure = *mi_eval_integer(&param->distance_measure);
-  
-  miScalar scale = dist_scale(dist_measure) * (*mi_eval_scalar(&param->scale));
-	miBoolean jagged = *mi_eval_boolean(&param->jagged_gap);
+	const worley_vec2 pt = r->pt;
   
-  miScalar s = 1.0;
-  {
-    miScalar gap_size = *mi_eval_scalar(&param->gap_size);
-    
-    miVector2d ptX = pt;
-		
-		// jagged edges. useful for broken earth crusts
-		if(jagged) {
-			ptX.u += mi_noise_2d(pt.u*1000,pt.v*1000) * 0.15 * scale;
-			ptX.v += mi_noise_2d(pt.u*1000 + 100,pt.v*1000+100) * 0.15 * scale;
-		}
-		
-    miScalar f1X, f2X, f3X;
-    miVector2d p1X, p2X, p3X;
-    
-    point_distances(state,param,&ptX,&f1X,&p1X,&f2X,&p2X,&f3X,&p3X);
-     
-    // based on code from "Advanced Renderman"
-    // this leads to gaps of equal width, in contrast to just simple thresholding of f2 - f1.
-    miScalar scaleFactor = (distance(dist_measure, &p1X, &p2X) * scale) / (f1X + f2X);
-    
-    // FIXME: there may be some adjustment needed for distance measures that are not just dist_linear
-    if(gap_size * scaleFactor > f2X - f1X) //  on left side
-      s = -1.0;
+  miScalar filter_size = r->filter_size;
+  miScalar val;
+  if(r->octaves > 1) {
+    // all octaves in one evaluation. filter_size only fades out the octaves finer than it.
+    val = worleynoise_fractal(contexts, params, &r->fractal, &pt, filter_size);
   }
-  
-  {
-    f1 /= scale;
-    f2 /= scale;
-    f3 /= scale;
+  else if((*instance)->atlas && worley_atlas_matches((*instance)->atlas, params)) {
+    // baked at instance init: interpolate instead of searching. The mip chain does the filtering.
+    val = worley_atlas_val((*instance)->atlas, params->distance_mode, &pt, filter_size);
   }
-  
-  miScalar dist = 0.0;
-  {
-    miInteger dist_mode = *mi_eval_integer(&param->distance_mode);
-    switch(dist_mode) {
-      case DIST_F1: dist = f1; break;
-      case DIST_F2_M_F1: dist = f2 - f1; break;
-      case DIST_F1_P_F2: dist = (2 * f1 + f2) / 3; break;
-      case DIST_F3_M_F2_M_F1: dist = (2 * f3 - f2 - f1) / 2; break;
-      case DIST_F1_P_F2_P_F3: dist = (0.5 * f1 + 0.33 * f2 + (1 - 0.5 - 0.33) * f3); break;
-      default: ;
-    }
+  else if(filter_size > 0) {
+    // antialiased: the gap is faded in over a footprint of filter_size in u and v
+    worley_footprint2 footprint = { { filter_size, 0 }, { 0, filter_size } };
+    worley_filtered2 filtered;
+    worleynoise_filtered(context, params, &pt, &footprint, &filtered);
+    mr_filtered_to_color(filtered.value, filtered.gap_coverage,
+                         RESOLVED_COLOR(inner), RESOLVED_COLOR(outer), RESOLVED_COLOR(gap), result);
+    return(miTRUE);
   }
-  
-  return s * scaling_function(dist);
-}
-
-miVector2d point_cube(miVector2d *pt, miScalar cube_dist) {
-  miVector2d cube;
-  cube.u = floorf((pt->u) / cube_dist) * cube_dist;
-  cube.v = floorf((pt->v) / cube_dist) * cube_dist;
-  return cube;
-}
-
-void update_cache(worley_context *context, miVector2d *cube, miScalar cube_dist) {
-  // in 3d, use mi_vector_dist instead of dist_linear_squared
-  if(context->cache_initialized && dist_linear_squared(&(context->cacheCube), cube) <= FLT_EPSILON * 2) {
-    return;
+  else if(tiles && worley_tile_val(tiles, context, params, &pt, &val)) {
+    // read from a tile baked by this or another render process
+  }
+  else if((*instance)->eval) {
+    val = worley_evaluator_val((*instance)->eval, context, &pt);
+  }
+  else {
+    val = worleynoise_val(context,params,&pt);
   }
-  // note: in theory, we could reuse parts of the old cache if the new cube is adjacent to the cache cube
-  context->cacheCube = *cube;
-  
-  {
-    miVector2d currentCube;
-    currentCube.u = cube->u - cube_dist;
-    currentCube.v = cube->v - cube_dist;
-    
-		miVector2d *cache = context->cacheVals;
-
-		// for the 3*3 cubes around the current cube,
-		// calculate the random points in that cube
-		for(int u=0; u<3; ++u) {
-			currentCube.v = cube->v - cube_dist;
-			for(int v=0; v<3; ++v) {
-				miScalar uSeed = currentCube.u;
-				miScalar vSeed = currentCube.v;
-				miScalar uvIncrement = cube_dist / (PTS_PER_CUBE + 1);
-				for(int k = 0; k < PTS_PER_CUBE; ++k) {
-					miVector2d pt = currentCube;
-	  
-					// FIXME: this can be made better
-					// also, multiplication of seed by 1000 is somewhat arbitrary.
-					// the main point is that we need multiple random values in [0,1] 
-					// which are somehow seeded from the current cube with reproducible results
-					pt.u += mi_unoise_2d(uSeed*1000, vSeed*1000) * cube_dist;
-					uSeed += uvIncrement;
-					pt.v += mi_unoise_2d(uSeed*1000, vSeed*1000) * cube_dist;
-					vSeed += uvIncrement;
-					// assert(pt.u >= currentCube.u && pt.u <= currentCube.u + cube_dist);
-					// assert(pt.v >= currentCube.v && pt.v <= currentCube.v + cube_dist);
-
-					cache[(v * 3 + u) * PTS_PER_CUBE + k] = pt;
-				}
-
-				currentCube.v += cube_dist;
-			}
-			currentCube.u += cube_dist;
-		}
-	}
-
-	context->cache_initialized = 1;
-}
-
-void point_distances(miState *state,texture_worleynoise_t *param, 
-                     miVector2d *pt,
-                     miScalar *f1, miVector2d *p1,
-                     miScalar *f2, miVector2d *p2,
-                     miScalar *f3, miVector2d *p3) {  
-  miScalar cube_dist = CUBE_DIST * (*mi_eval_scalar(&param->scale));
-  miVector2d cube = point_cube(pt,cube_dist);
-  
-  worley_context *context;
-  mi_query(miQ_FUNC_TLS_GET, state, miNULLTAG, &context);
-  
-  miInteger dist_measure = *mi_eval_integer(&param->distance_measure);
-  *f3 = FLT_MAX;
-  *f2 = *f3 - 1;
-  *f1 = *f2 - 1;
-
-  update_cache(context, &cube, cube_dist);
-  
-  miVector2d *cache = context->cacheVals;
   
-  for(int i=0; i < CACHE_SIZE; ++i) {
-    miVector2d p = cache[i];
-    miScalar d = distance(dist_measure, pt, &p);
-    if(d < *f3) {
-      if(d < *f2) {
-        *f3 = *f2; *p3 = *p2;
-        if(d < *f1) {
-          *f2 = *f1; *p2 = *p1;
-          *f1 = d; *p1 = p;
-        }
-        else {
-          *f2 = d; *p2 = p;
-        }
-      }
-      else {
-        *f3 = d; *p3 = p;
-      }
-    }
+  if(val < 0) {
+    miColor gap = *RESOLVED_COLOR(gap);
+    result->r = gap.r;
+    result->g = gap.g;
+    result->b = gap.b;
+    result->a = gap.a;
+  }
+  else {
+    mr_grey_to_color(val, RESOLVED_COLOR(inner), RESOLVED_COLOR(outer), result);
   }
+  	
+  
+  return(miTRUE);
 }
-
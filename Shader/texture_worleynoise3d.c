@@ -4,9 +4,6 @@
 
 #include "common.h"
 
-// 3^DIMENSIONS * PTS_PER_CUBE.
-#define CACHE_SIZE 108
-
 // has to fit the .mi file
 typedef struct {	
 	miBoolean jagged_gap;
@@ -21,13 +18,89 @@ typedef struct {
   miScalar gap_size;
 	
 	miMatrix        matrix;
+  miInteger point_generator;
+  miScalar filter_size;
+  miInteger octaves;
+  miScalar lacunarity;
+  miScalar gain;
+  miInteger octave_distance_mode;
+  miScalar density;
+  miInteger points_per_cube;
+  miScalar minkowski_p;
+  miVector axis_weights;
+  miInteger gap_test;
 } texture_worleynoise3d_t;
 
+// the parameters above, in order. Their bits (1 << P_name) mark the varying ones.
+#define TEXTURE_WORLEYNOISE3D_PARAMS(X) \
+  X(jagged_gap) X(inner) X(outer) X(gap) X(distance_measure) X(distance_mode) X(scale) X(scaleX) X(gap_size) \
+  X(matrix) X(point_generator) X(filter_size) X(octaves) X(lacunarity) X(gain) X(octave_distance_mode) \
+  X(density) X(points_per_cube) X(minkowski_p) X(axis_weights) X(gap_test)
+
+#define PARAM_ENUM(name) P_##name,
+#define PARAM_NAME(name) #name,
+#define PARAM_OFFSET(name) offsetof(texture_worleynoise3d_t, name),
+enum { TEXTURE_WORLEYNOISE3D_PARAMS(PARAM_ENUM) P_COUNT };
+static const char *const param_names[] = { TEXTURE_WORLEYNOISE3D_PARAMS(PARAM_NAME) };
+static const size_t param_offsets[] = { TEXTURE_WORLEYNOISE3D_PARAMS(PARAM_OFFSET) };
+
+// the parameters, resolved. The colors are kept here, but only evaluated when a sample needs them.
+typedef struct {
+  worley_params params;
+  miColor inner, outer, gap;
+  miMatrix matrix;
+  miScalar filter_size;
+  miInteger octaves;
+  miScalar lacunarity, gain;
+  miInteger octave_distance_mode;
+  worley_fractal fractal;
+} texture_worleynoise3d_resolved;
+
+// per shader instance state
 typedef struct {
-  miBoolean cache_initialized;
-  miVector cacheCube; // the "center" cube of the cache
-  miVector cacheVals[CACHE_SIZE]; 
-} worley_context3;
+  unsigned int varying; // connected parameters, see TEXTURE_WORLEYNOISE3D_PARAMS
+  texture_worleynoise3d_resolved constant; // the unconnected parameters, as resolved at init (defaults for the others)
+  worley_evaluator *eval; // the constant parameters prepared at instance init, NULL if EVAL_PARAMS are connected
+  mr_threads threads;
+} texture_worleynoise3d_instance;
+
+// the parameters worleynoise3d_val depends on
+#define EVAL_PARAMS ((1u << P_jagged_gap) | (1u << P_distance_measure) | (1u << P_distance_mode) | (1u << P_scale) \
+  | (1u << P_scaleX) | (1u << P_gap_size) | (1u << P_point_generator) | (1u << P_density) | (1u << P_points_per_cube) \
+  | (1u << P_minkowski_p) | (1u << P_axis_weights) | (1u << P_gap_test))
+
+#define RESOLVE(name) (mask & (1u << P_##name))
+
+// evaluates the parameters in mask (but the colors) into r; the others keep their values.
+// note: getting current values must always be wrapped in mi_eval... calls!
+static void resolve(miState *state, texture_worleynoise3d_t *param, unsigned int mask, texture_worleynoise3d_resolved *r) {
+  if(RESOLVE(jagged_gap)) r->params.jagged_gap = *mi_eval_boolean(&param->jagged_gap);
+  if(RESOLVE(distance_measure)) r->params.distance_measure = *mi_eval_integer(&param->distance_measure);
+  if(RESOLVE(distance_mode)) r->params.distance_mode = *mi_eval_integer(&param->distance_mode);
+  if(RESOLVE(scale)) r->params.scale = *mi_eval_scalar(&param->scale);
+  if(RESOLVE(scaleX)) r->params.scaleX = *mi_eval_scalar(&param->scaleX);
+  if(RESOLVE(gap_size)) r->params.gap_size = *mi_eval_scalar(&param->gap_size);
+  if(RESOLVE(matrix)) mi_matrix_copy(r->matrix, mi_eval_transform(&param->matrix));
+  if(RESOLVE(point_generator)) r->params.point_gen = *mi_eval_integer(&param->point_generator);
+  if(RESOLVE(filter_size)) r->filter_size = *mi_eval_scalar(&param->filter_size);
+  if(RESOLVE(octaves)) r->octaves = *mi_eval_integer(&param->octaves);
+  if(RESOLVE(lacunarity)) r->lacunarity = *mi_eval_scalar(&param->lacunarity);
+  if(RESOLVE(gain)) r->gain = *mi_eval_scalar(&param->gain);
+  if(RESOLVE(octave_distance_mode)) r->octave_distance_mode = *mi_eval_integer(&param->octave_distance_mode);
+  if(RESOLVE(density)) r->params.density = *mi_eval_scalar(&param->density);
+  if(RESOLVE(points_per_cube)) r->params.points_per_cube = *mi_eval_integer(&param->points_per_cube);
+  if(RESOLVE(minkowski_p)) r->params.minkowski_p = *mi_eval_scalar(&param->minkowski_p);
+  if(RESOLVE(axis_weights)) {
+    miVector *w = mi_eval_vector(&param->axis_weights);
+    r->params.axis_weights[0] = w->x; r->params.axis_weights[1] = w->y; r->params.axis_weights[2] = w->z;
+  }
+  if(RESOLVE(gap_test)) r->params.gap_test = *mi_eval_integer(&param->gap_test);
+  if(mask & ((1u << P_distance_mode) | (1u << P_octaves) | (1u << P_lacunarity) | (1u << P_gain) | (1u << P_octave_distance_mode)))
+    mr_fractal(&r->fractal, r->octaves, r->lacunarity, r->gain, r->params.distance_mode, r->octave_distance_mode);
+}
+
+// a color parameter: the resolved one if constant
+#define RESOLVED_COLOR(name) (((*instance)->varying & (1u << P_##name)) ? mi_eval_color(&param->name) : &r->name)
 
 DLLEXPORT int texture_worleynoise3d_version(void) {return(2);}
 
@@ -36,7 +109,39 @@ DLLEXPORT miBoolean texture_worleynoise3d_init(
     texture_worleynoise3d_t *param,
     miBoolean *init_req)
 {
-  *init_req = miTRUE;
+  if (!param) { /* shader init */
+    *init_req = miTRUE;
+  } else { /* shader instance init */
+    // resolve the unconnected parameters once; samples evaluate the connected ones. Those aren't evaluated here:
+    // the init state has no point to shade, so they keep the defaults.
+    texture_worleynoise3d_instance *instance = mi_mem_allocate( sizeof(texture_worleynoise3d_instance) );
+    texture_worleynoise3d_resolved *r = &instance->constant;
+    memset(r, 0, sizeof(*r));
+    worley_params_default(&r->params);
+    r->params.noise = &mr_noise;
+    r->octaves = 1;
+    r->lacunarity = 2;
+    r->gain = 0.5;
+    r->octave_distance_mode = -1;
+    instance->varying = mr_varying_params(state, param, param_offsets, P_COUNT);
+    mr_report_varying("texture_worleynoise3d", instance->varying, param_names, P_COUNT);
+    resolve(state, param, ~instance->varying, r);
+    if(!(instance->varying & (1u << P_inner))) r->inner = *mi_eval_color(&param->inner);
+    if(!(instance->varying & (1u << P_outer))) r->outer = *mi_eval_color(&param->outer);
+    if(!(instance->varying & (1u << P_gap))) r->gap = *mi_eval_color(&param->gap);
+    
+    // prepare the parameters once, so samples only search
+    instance->eval = NULL;
+    if(!(instance->varying & EVAL_PARAMS) && !(instance->eval = worley_evaluator_create(&r->params, 3)))
+      mi_fatal("texture_worleynoise3d: out of memory for the evaluator");
+    
+    if(!mr_threads_init(&instance->threads, 3))
+      mi_fatal("texture_worleynoise3d: out of memory for the render threads' contexts");
+    
+    void **user;
+    mi_query(miQ_FUNC_USERPTR, state, miNULLTAG, &user);
+    *user = instance;
+  }
   return(miTRUE);
 }
 
@@ -45,13 +150,15 @@ DLLEXPORT miBoolean texture_worleynoise3d_exit(
     texture_worleynoise3d_t *param)
 {
   if (param) { /* shader instance exit */
-    // note: is is indeed correct to release the contexts during shader instance exit!!!
-    // (TODO: explain why)
-    int num;
-    worley_context3 **contexts;
-    mi_query(miQ_FUNC_TLS_GETALL, state, miNULLTAG, &contexts, &num);
-    for(int i=0; i < num; i++) {
-      mi_mem_release(contexts[i]);
+    // the contexts are released with the instance, as no render thread uses it anymore
+    void **user;
+    mi_query(miQ_FUNC_USERPTR, state, miNULLTAG, &user);
+    if (*user) {
+      mr_report_profile("texture_worleynoise3d", &((texture_worleynoise3d_instance *)*user)->threads);
+      mr_threads_exit(&((texture_worleynoise3d_instance *)*user)->threads);
+      worley_evaluator_destroy(((texture_worleynoise3d_instance *)*user)->eval);
+      mi_mem_release(*user);
+      *user = NULL;
     }
   } else {
     /* shader exit */
@@ -59,221 +166,87 @@ DLLEXPORT miBoolean texture_worleynoise3d_exit(
   return(miTRUE);
 }
 
-miScalar worleynoise3d_val(miState *state,texture_worleynoise3d_t *param);
 DLLEXPORT miBoolean texture_worleynoise3d(
     miColor *result,
     miState *state,
     texture_worleynoise3d_t *param)
 {
-  worley_context3 *context;
-  mi_query(miQ_FUNC_TLS_GET, state, miNULLTAG, &context);
-  if (!context) {
-    context = mi_mem_allocate( sizeof(worley_context3) );
-    mi_query(miQ_FUNC_TLS_SET, state, miNULLTAG, &context);
-    context->cache_initialized = 0;
+  texture_worleynoise3d_instance **instance;
+  mi_query(miQ_FUNC_USERPTR, state, miNULLTAG, &instance);
+  // the parameters: as resolved at init, with the connected ones evaluated again
+  texture_worleynoise3d_resolved *r = &(*instance)->constant;
+  texture_worleynoise3d_resolved varying;
+  if ((*instance)->varying) {
+    varying = *r;
+    resolve(state, param, (*instance)->varying, &varying);
+    r = &varying;
+  }
+  const worley_params *params = &r->params;
+  
+  // this thread's contexts, fetched once and passed down explicitly
+  worley_context3 *contexts = worley_context_pool_get3((*instance)->threads.contexts, state->thread);
+  worley_tile_cache *tiles = NULL;
+  worley_context3 spare[WORLEY_MAX_OCTAVES];
+  if (contexts) {
+    tiles = (*instance)->threads.tiles[state->thread];
+  } else {
+    // a thread mental ray did not count at init: fresh contexts without cell cache, for the octaves this sample uses
+    for(int o = 0; o < WORLEY_MAX_OCTAVES && (o == 0 || o < r->octaves); o++)
+      worley_context3_init(&spare[o]);
+    contexts = spare;
+  }
+  worley_context3 *context = &contexts[0];
+  
+	miVector p;
+	miScalar *m = r->matrix;
+	mi_point_transform(&p,&state->point,m);
+	worley_vec3 pt;
+	pt.x = p.x; pt.y = p.y; pt.z = p.z;
+  
+  miScalar filter_size = r->filter_size;
+  miScalar val;
+  if(r->octaves > 1) {
+    // all octaves in one evaluation. Octaves finer than the pixel (through the matrix) fade out;
+    // filter_size only changes that pixel size here.
+    miVector rx, ry, dx, dy;
+    mi_raster_unit(state, &rx, &ry);
+    mi_vector_transform(&dx, &rx, m);
+    mi_vector_transform(&dy, &ry, m);
+    miScalar lx = mi_vector_norm(&dx), ly = mi_vector_norm(&dy);
+    miScalar footprint = (lx > ly ? lx : ly) * (filter_size > 0 ? filter_size : 1);
+    val = worleynoise3d_fractal(contexts, params, &r->fractal, &pt, footprint);
+  }
+  else if(filter_size > 0) {
+    // antialiased: the gap is faded in over filter_size pixels.
+    // the footprint of a pixel at the current point, through the same matrix as the point.
+    miVector rx, ry, dx, dy;
+    mi_raster_unit(state, &rx, &ry);
+    mi_vector_transform(&dx, &rx, m);
+    mi_vector_transform(&dy, &ry, m);
+    worley_footprint3 footprint = {
+      { dx.x * filter_size, dx.y * filter_size, dx.z * filter_size },
+      { dy.x * filter_size, dy.y * filter_size, dy.z * filter_size }
+    };
+    worley_filtered3 filtered;
+    worleynoise3d_filtered(context, params, &pt, &footprint, &filtered);
+    mr_filtered_to_color(filtered.value, filtered.gap_coverage,
+                         RESOLVED_COLOR(inner), RESOLVED_COLOR(outer), RESOLVED_COLOR(gap), result);
+    return(miTRUE);
+  }
+  else if(!tiles || !worley_tile_val3(tiles, context, params, &pt, &val)) {
+    val = (*instance)->eval ? worley_evaluator_val3((*instance)->eval, context, &pt) : worleynoise3d_val(context,params,&pt);
   }
-  
-  
-  miScalar val = worleynoise3d_val(state,param);
   
   if(val < 0) {
-    miColor gap = *mi_eval_color(&param->gap);
+    miColor gap = *RESOLVED_COLOR(gap);
     result->r = gap.r;
     result->g = gap.g;
     result->b = gap.b;
     result->a = gap.a;
   }
   else {
-    miColor *inner = mi_eval_color(&param->inner);
-    miColor *outer = mi_eval_color(&param->outer);
-    
-    grey_to_color(val, inner, outer, result);
+    mr_grey_to_color(val, RESOLVED_COLOR(inner), RESOLVED_COLOR(outer), result);
   }
   
   return(miTRUE);
 }
-
-void point_distances3(miState *state,texture_worleynoise3d_t *param, 
-                      miVector *pt,
-                      miScalar *f1, miVector *p1,
-                      miScalar *f2, miVector *p2,
-                      miScalar *f3, miVector *p3);
-
-miScalar worleynoise3d_val(miState *state,texture_worleynoise3d_t *param) {
-  miScalar f1, f2, f3;
-  miVector p1, p2, p3;
-  
-  // ways to get the current point:
-  // state->tex_list[0]; // yields good results only in the x and y coordinate
-  // state->point // usable for 3D, but problematic for getting a smooth 2D texture as x,y and z all have to be somehow incorporated in the 2D vector to use
-  // state->tex // does not yield usable results / seems to be constant
-	// 
-	// instead, we just take an u and v value explicitly; they would usually be provided by a 2D placement node.
-	
-	// note: getting current values must always be wrapped in mi_eval... calls!
-	miVector pt;
-	miScalar *m = mi_eval_transform(&param->matrix);
-	mi_point_transform(&pt,&state->point,m);
-	
-  point_distances3(state,param,&pt,&f1,&p1,&f2,&p2,&f3,&p3);
-  
-  miInteger dist_measure = *mi_eval_integer(&param->distance_measure);
-  
-  miScalar scale = dist_scale(dist_measure) * (*mi_eval_scalar(&param->scale)) * (*mi_eval_scalar(&param->scaleX));
-	miBoolean jagged = *mi_eval_boolean(&param->jagged_gap);
-  
-  miScalar s = 1.0;
-  {
-    miScalar gap_size = *mi_eval_scalar(&param->gap_size);
-    
-    miVector ptX = pt;
-		
-		// jagged edges. useful for broken earth crusts
-		if(jagged) {
-			miVector seed = pt;	 mi_vector_mul(&seed,3 / scale);
-			miScalar jaggingX = (mi_unoise_3d(&seed) - 0.5) * scale * 0.2;
-			ptX.x += jaggingX; seed.x += 1000;
-			miScalar jaggingY = (mi_unoise_3d(&seed) - 0.5) * scale * 0.2;
-			ptX.y += jaggingY; seed.y += 1000;
-			miScalar jaggingZ = (mi_unoise_3d(&seed) - 0.5) * scale * 0.2;
-			ptX.z += jaggingZ;
-		}
-		
-    miScalar f1X, f2X, f3X;
-    miVector p1X, p2X, p3X;
-    
-    point_distances3(state,param,&ptX,&f1X,&p1X,&f2X,&p2X,&f3X,&p3X);
-     
-    // based on code from "Advanced Renderman"
-    // this leads to gaps of equal width, in contrast to just simple thresholding of f2 - f1.
-    miScalar scaleFactor = (distance3(dist_measure, &p1X, &p2X) * scale) / (f1X + f2X);
-    
-    // FIXME: there may be some adjustment needed for distance measures that are not just dist_linear
-    if(gap_size * scaleFactor > f2X - f1X) //  on left side
-      s = -1.0;
-  }
-  
-  {
-    f1 /= scale;
-    f2 /= scale;
-    f3 /= scale;
-  }
-  
-  miScalar dist = 0.0;
-  {
-    miInteger dist_mode = *mi_eval_integer(&param->distance_mode);
-    switch(dist_mode) {
-      case DIST_F1: dist = f1; break;
-      case DIST_F2_M_F1: dist = f2 - f1; break;
-      case DIST_F1_P_F2: dist = (2 * f1 + f2) / 3; break;
-      case DIST_F3_M_F2_M_F1: dist = (2 * f3 - f2 - f1) / 2; break;
-      case DIST_F1_P_F2_P_F3: dist = (0.5 * f1 + 0.33 * f2 + (1 - 0.5 - 0.33) * f3); break;
-      default: ;
-    }
-  }
-  
-   return s * scaling_function(dist);
-}
-
-miVector point_cube3(miVector *pt, miScalar cube_dist) {
-  miVector cube;
-  cube.x = floorf((pt->x) / cube_dist) * cube_dist;
-  cube.y = floorf((pt->y) / cube_dist) * cube_dist;
-	cube.z = floorf((pt->z) / cube_dist) * cube_dist;
-  return cube;
-}
-
-void update_cache3(worley_context3 *context, miVector *cube, miScalar cube_dist) {
-  // in 3d, use mi_vector_dist instead of dist_linear_squared
-  if(context->cache_initialized && dist_linear_squared3(&(context->cacheCube), cube) <= FLT_EPSILON * 2) {
-    return;
-  }
-  // note: in theory, we could reuse parts of the old cache if the new cube is adjacent to the cache cube
-  context->cacheCube = *cube;
-  
-  {
-    miVector currentCube;
-    currentCube.x = cube->x - cube_dist;
-    currentCube.y = cube->y - cube_dist;
-    currentCube.z = cube->z - cube_dist;
-    
-    miVector *cache = context->cacheVals;
-
-		// for the 3*3 cubes around the current cube,
-		// calculate the random points in that cube
-		for(int x=0; x<3; ++x) {
-			currentCube.y = cube->y - cube_dist;
-			for(int y=0; y<3; ++y) {
-				currentCube.z = cube->z - cube_dist;
-				for(int z=0; z<3; ++z) {
-					miVector seed; 
-					seed.x = currentCube.x * 1000;
-					seed.y = currentCube.y * 1000;
-					seed.z = currentCube.z * 1000;
-					miScalar xyzIncrement = cube_dist / (PTS_PER_CUBE + 1);
-					for(int k = 0; k < PTS_PER_CUBE; ++k) {
-						miVector pt = currentCube;
-						
-						pt.x += mi_unoise_3d(&seed) * cube_dist;
-						seed.x = (seed.x + xyzIncrement) * 1000.0;
-						
-						pt.y += mi_unoise_3d(&seed) * cube_dist;
-						seed.y = (seed.y + xyzIncrement) * 1000.0;
-
-						pt.z += mi_unoise_3d(&seed) * cube_dist;
-						seed.z = (seed.z + xyzIncrement) * 1000.0;
-
-						cache[(z * 3 * 3 + (y * 3 + x)) * PTS_PER_CUBE + k] = pt;
-					}
-					currentCube.z += cube_dist;
-				}
-				currentCube.y += cube_dist;
-			}
-			currentCube.x += cube_dist;
-		}
-	}
-	
-	context->cache_initialized = 1;
-}
-
-void point_distances3(miState *state,texture_worleynoise3d_t *param, 
-                      miVector *pt,
-                      miScalar *f1, miVector *p1,
-                      miScalar *f2, miVector *p2,
-                      miScalar *f3, miVector *p3) {  
-  miScalar cube_dist = CUBE_DIST * (*mi_eval_scalar(&param->scale));
-  miVector cube = point_cube3(pt,cube_dist);
-  
-  worley_context3 *context;
-  mi_query(miQ_FUNC_TLS_GET, state, miNULLTAG, &context);
-  
-  miInteger dist_measure = *mi_eval_integer(&param->distance_measure);
-  *f3 = FLT_MAX;
-  *f2 = *f3 - 1;
-  *f1 = *f2 - 1;
-
-  update_cache3(context, &cube, cube_dist);
-  
-  miVector *cache = context->cacheVals;
-  
-  for(int i=0; i < CACHE_SIZE; ++i) { 
-    miVector p = cache[i];
-    miScalar d = distance3(dist_measure, pt, &p);
-    if(d < *f3) {
-      if(d < *f2) {
-        *f3 = *f2; *p3 = *p2;
-        if(d < *f1) {
-          *f2 = *f1; *p2 = *p1;
-          *f1 = d; *p1 = p;
-        }
-        else {
-          *f2 = d; *p2 = p;
-        }
-      }
-      else {
-        *f3 = d; *p3 = p;
-      }
-    }
-  }
-}
-
@@ -0,0 +1,2361 @@
+/*
+ * Renderer-independent core of the Worley noise shaders.
+ * Code based on Steve Worley's paper "A Cellular Texture Basis Function", and some material from Advanced Renderman.
+ */
+
+#include "worley.h"
+#include "worley_simd.h"
+#include "worley_cells.h"
+#include "worley_profile.h"
+
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************* Distance measures *************/
+
+float dist_linear_squared(const worley_vec2 *v1, const worley_vec2 *v2) {
+  float d1 = v1->u - v2->u;
+  float d2 = v1->v - v2->v;
+  return d1 * d1 + d2 * d2;
+}
+
+float dist_linear(const worley_vec2 *v1, const worley_vec2 *v2) {
+  return sqrtf( dist_linear_squared(v1,v2) );
+}
+
+float dist_manhattan(const worley_vec2 *v1, const worley_vec2 *v2) {
+  float d1 = v1->u - v2->u;
+  float d2 = v1->v - v2->v;
+  return fabsf(d1) + fabsf(d2);
+}
+
+float dist_linear_squared3(const worley_vec3 *v1, const worley_vec3 *v2) {
+  float dx = v1->x - v2->x;
+  float dy = v1->y - v2->y;
+  float dz = v1->z - v2->z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+float dist_linear3(const worley_vec3 *v1, const worley_vec3 *v2) {
+  return sqrtf( dist_linear_squared3(v1,v2) );
+}
+
+float dist_manhattan3(const worley_vec3 *v1, const worley_vec3 *v2) {
+  float dx = v1->x - v2->x;
+  float dy = v1->y - v2->y;
+  float dz = v1->z - v2->z;
+  return fabsf(dx) + fabsf(dy) + fabsf(dz);
+}
+
+float dist_chebyshev(const worley_vec2 *v1, const worley_vec2 *v2) {
+  return fmaxf(fabsf(v1->u - v2->u), fabsf(v1->v - v2->v));
+}
+
+float dist_chebyshev3(const worley_vec3 *v1, const worley_vec3 *v2) {
+  return fmaxf(fmaxf(fabsf(v1->x - v2->x), fabsf(v1->y - v2->y)), fabsf(v1->z - v2->z));
+}
+
+// note: Behavior might get weird for p < 1.
+float dist_minkowski(float p, const worley_vec2 *v1, const worley_vec2 *v2) {
+  float d1 = powf(fabsf(v1->u - v2->u),p);
+  float d2 = powf(fabsf(v1->v - v2->v),p);
+  return powf(d1 + d2, 1/p);
+}
+
+float dist_minkowski3(float p, const worley_vec3 *v1, const worley_vec3 *v2) {
+  float d1 = powf(fabsf(v1->x - v2->x),p);
+  float d2 = powf(fabsf(v1->y - v2->y),p);
+  float d3 = powf(fabsf(v1->z - v2->z),p);
+  return powf(d1 + d2 + d3, 1/p);
+}
+
+float dist_scale(dist_measure m) {
+  switch(m) {
+    case DIST_LINEAR: return 0.04;
+    case DIST_LINEAR_SQUARED: return 0.01;
+    case DIST_MANHATTAN: return 0.07;
+    case DIST_MINKOWSKI: return 0.04;
+    case DIST_CHEBYSHEV: return 0.035; // chebyshev distances are 0.85 to 0.9 times the linear ones on average
+    default: return -1;
+  }
+}
+
+float worley_minkowski_scale(float p) {
+  float manhattan = dist_scale(DIST_MANHATTAN), linear = dist_scale(DIST_LINEAR), chebyshev = dist_scale(DIST_CHEBYSHEV);
+  if(!(p > 1))
+    return manhattan;
+  float q = 1 / p;
+  return q >= 0.5f ? linear + (manhattan - linear) * (2 * q - 1) : chebyshev + (linear - chebyshev) * 2 * q;
+}
+
+float distance(dist_measure distance_measure, const worley_vec2 *v1, const worley_vec2 *v2) {
+  switch(distance_measure) {
+    case DIST_LINEAR: return dist_linear(v1,v2);
+    case DIST_LINEAR_SQUARED: return dist_linear_squared(v1,v2);
+    case DIST_MANHATTAN: return dist_manhattan(v1,v2);
+    case DIST_CHEBYSHEV: return dist_chebyshev(v1,v2);
+    default: return -1;
+  }
+}
+
+float distance3(dist_measure distance_measure, const worley_vec3 *v1, const worley_vec3 *v2) {
+  switch(distance_measure) {
+    case DIST_LINEAR: return dist_linear3(v1,v2);
+    case DIST_LINEAR_SQUARED: return dist_linear_squared3(v1,v2);
+    case DIST_MANHATTAN: return dist_manhattan3(v1,v2);
+    case DIST_CHEBYSHEV: return dist_chebyshev3(v1,v2);
+    default: return -1;
+  }
+}
+
+/************* Noise sources *************/
+
+static uint32_t hash_u32(uint32_t x) {
+  x ^= x >> 16; x *= 0x7feb352dU;
+  x ^= x >> 15; x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+// the seeds used by update_cache3 grow very large, so lattice coordinates are wrapped instead of overflowing
+static uint32_t lattice_coord(float f) {
+  if(fabsf(f) >= 4e18f)
+    f = fmodf(f, 16777216.0f);
+  return (uint32_t)(int64_t)f;
+}
+
+static float lattice2(uint32_t x, uint32_t y) {
+  return hash_u32(x ^ hash_u32(y + 0x9e3779b9U)) * (1.0f / 4294967296.0f);
+}
+
+static float lattice3(uint32_t x, uint32_t y, uint32_t z) {
+  return hash_u32(x ^ hash_u32(y ^ (hash_u32(z + 0x9e3779b9U) + 0x85ebca6bU))) * (1.0f / 4294967296.0f);
+}
+
+static float smooth(float t) {
+  return t * t * (3 - 2 * t);
+}
+
+static float lerp(float a, float b, float t) {
+  return a + (b - a) * t;
+}
+
+float worley_value_noise2(float u, float v) {
+  float fu = floorf(u), fv = floorf(v);
+  float tu = smooth(u - fu), tv = smooth(v - fv);
+  uint32_t iu = lattice_coord(fu), iv = lattice_coord(fv);
+  return lerp(lerp(lattice2(iu, iv),     lattice2(iu + 1, iv),     tu),
+              lerp(lattice2(iu, iv + 1), lattice2(iu + 1, iv + 1), tu), tv);
+}
+
+float worley_value_noise3(const worley_vec3 *p) {
+  float fx = floorf(p->x), fy = floorf(p->y), fz = floorf(p->z);
+  float tx = smooth(p->x - fx), ty = smooth(p->y - fy), tz = smooth(p->z - fz);
+  uint32_t ix = lattice_coord(fx), iy = lattice_coord(fy), iz = lattice_coord(fz);
+  float z0 = lerp(lerp(lattice3(ix, iy,     iz), lattice3(ix + 1, iy,     iz), tx),
+                  lerp(lattice3(ix, iy + 1, iz), lattice3(ix + 1, iy + 1, iz), tx), ty);
+  float z1 = lerp(lerp(lattice3(ix, iy,     iz + 1), lattice3(ix + 1, iy,     iz + 1), tx),
+                  lerp(lattice3(ix, iy + 1, iz + 1), lattice3(ix + 1, iy + 1, iz + 1), tx), ty);
+  return lerp(z0, z1, tz);
+}
+
+static float value_noise3(const worley_vec3 *p) {
+  return worley_value_noise3(p);
+}
+
+const worley_noise worley_default_noise = {
+  worley_value_noise2,
+  worley_value_noise2,
+  value_noise3,
+  "value"
+};
+
+/************* Parameters *************/
+
+void worley_params_default(worley_params *params) {
+  params->distance_measure = DIST_LINEAR;
+  params->distance_mode = DIST_F1;
+  params->scale = 1.0;
+  params->scaleX = 1.0;
+  params->gap_size = 0.05;
+  params->jagged_gap = 0;
+  params->noise = &worley_default_noise;
+  params->point_gen = WORLEY_GEN_NOISE;
+  params->seed = 0;
+  params->poisson_mean = 0;
+  params->search = WORLEY_SEARCH_FULL;
+  params->period = 0;
+  params->density = 0;
+  params->points_per_cube = 0;
+  params->minkowski_p = 3;
+  params->axis_weights[0] = params->axis_weights[1] = params->axis_weights[2] = 1;
+  params->gap_test = WORLEY_GAP_CLASSIC;
+  params->bevel_size = 0.1;
+}
+
+int worley_cube_points(const worley_params *params) {
+  int k = params->points_per_cube;
+  return k < 1 || k > PTS_PER_CUBE ? PTS_PER_CUBE : k;
+}
+
+float worley_cube_dist(const worley_params *params, int dims) {
+  float cube_dist = CUBE_DIST * params->scale;
+  int k = worley_cube_points(params);
+  float density = params->density > 0 ? params->density : PTS_PER_CUBE;
+  if(k != density)
+    cube_dist *= dims == 2 ? sqrtf(k / density) : cbrtf(k / density);
+  return cube_dist;
+}
+
+int worley_min_cube_points(const worley_params *params) {
+  return params->point_gen == WORLEY_GEN_HASH && params->poisson_mean > 0 ? 1 : worley_cube_points(params);
+}
+
+int worley_window_radius(int min_points, int dims, dist_measure measure) {
+  // manhattan distances are up to sqrt(dims) times the linear ones, so F3 reaches farther.
+  // Minkowski distances lie between the manhattan and the chebyshev ones, chebyshev distances below the linear ones.
+  if((measure == DIST_MANHATTAN || measure == DIST_MINKOWSKI) && dims == 3)
+    return min_points < 3 ? 2 : 1;
+  return min_points < 2 || (min_points < 3 && dims == 2) ? 2 : 1;
+}
+
+int worley_poisson_valid(const worley_params *params) {
+  return params->poisson_mean == 0 || (params->poisson_mean > 0 && params->poisson_mean <= worley_cube_points(params));
+}
+
+// the mean distance between feature points, relative to the default density: the searches' distances are divided by it
+static float density_spacing(const worley_params *params, int dims) {
+  if(!(params->density > 0) || params->density == PTS_PER_CUBE)
+    return 1;
+  float r = PTS_PER_CUBE / params->density;
+  return dims == 2 ? sqrtf(r) : cbrtf(r);
+}
+
+static const worley_noise *params_noise(const worley_params *params) {
+  return params->noise ? params->noise : &worley_default_noise;
+}
+
+/************* Cache *************/
+
+void worley_context2_init(worley_context2 *context) {
+  context->cache_initialized = 0;
+  memset(&context->stats, 0, sizeof(context->stats));
+  memset(&context->window, 0, sizeof(context->window));
+  context->cells = NULL;
+  for(int i = 0; i < WORLEY_CACHE_PAD2; ++i) {
+    context->cacheU[i] = INFINITY;
+    context->cacheV[i] = INFINITY;
+  }
+}
+
+void worley_context3_init(worley_context3 *context) {
+  context->cache_initialized = 0;
+  memset(&context->stats, 0, sizeof(context->stats));
+  memset(&context->window, 0, sizeof(context->window));
+  context->cells = NULL;
+  for(int i = 0; i < WORLEY_CACHE_PAD3; ++i) {
+    context->cacheX[i] = INFINITY;
+    context->cacheY[i] = INFINITY;
+    context->cacheZ[i] = INFINITY;
+  }
+}
+
+// the layout of the window for the points of gen
+static worley_window window_layout(const worley_generator *gen, int dims) {
+  worley_window w;
+  int min_points = gen->point_gen == WORLEY_GEN_HASH && gen->poisson_mean > 0 ? 1 : gen->points; // see worley_min_cube_points
+  w.radius = worley_window_radius(min_points, dims, gen->measure);
+  w.width = 2 * w.radius + 1;
+  w.size = (dims == 2 ? w.width * w.width : w.width * w.width * w.width) * gen->points;
+  w.padded = (w.size + 15) & ~15;
+  return w;
+}
+
+worley_vec2 point_cube(const worley_vec2 *pt, float cube_dist) {
+  worley_vec2 cube;
+  cube.u = floorf((pt->u) / cube_dist) * cube_dist;
+  cube.v = floorf((pt->v) / cube_dist) * cube_dist;
+  return cube;
+}
+
+worley_vec3 point_cube3(const worley_vec3 *pt, float cube_dist) {
+  worley_vec3 cube;
+  cube.x = floorf((pt->x) / cube_dist) * cube_dist;
+  cube.y = floorf((pt->y) / cube_dist) * cube_dist;
+  cube.z = floorf((pt->z) / cube_dist) * cube_dist;
+  return cube;
+}
+
+// clamped, so that far away (or infinite) points don't overflow
+static int cell_coord(float f) {
+  f = floorf(f);
+  if(f > 1e9f) return 1000000000;
+  if(f < -1e9f) return -1000000000;
+  return (int)f;
+}
+
+worley_cell2 point_cell(const worley_vec2 *pt, float cube_dist) {
+  worley_cell2 cell;
+  cell.u = cell_coord((pt->u) / cube_dist);
+  cell.v = cell_coord((pt->v) / cube_dist);
+  return cell;
+}
+
+worley_cell3 point_cell3(const worley_vec3 *pt, float cube_dist) {
+  worley_cell3 cell;
+  cell.x = cell_coord((pt->x) / cube_dist);
+  cell.y = cell_coord((pt->y) / cube_dist);
+  cell.z = cell_coord((pt->z) / cube_dist);
+  return cell;
+}
+
+void worley_generator_init(worley_generator *gen, const worley_params *params, float cube_dist) {
+  gen->point_gen = params->point_gen;
+  gen->noise = params_noise(params);
+  gen->seed = params->seed;
+  gen->poisson_mean = params->poisson_mean;
+  gen->cube_dist = cube_dist;
+  gen->period = params->period > 0 ? params->period : 0;
+  gen->points = worley_cube_points(params);
+  gen->measure = params->distance_measure;
+}
+
+int worley_generator_equal(const worley_generator *a, const worley_generator *b) {
+  if(a->point_gen != b->point_gen || a->cube_dist != b->cube_dist || a->period != b->period || a->points != b->points)
+    return 0;
+  if(a->point_gen == WORLEY_GEN_HASH)
+    return a->seed == b->seed && a->poisson_mean == b->poisson_mean;
+  return a->noise == b->noise;
+}
+
+int worley_wrap_cell(int c, int period) {
+  if(period <= 0)
+    return c;
+  int m = c % period;
+  return m < 0 ? m + period : m;
+}
+
+void generate_cell(const worley_generator *gen, const worley_cell2 *cell, float *us, float *vs) {
+  if(gen->point_gen == WORLEY_GEN_HASH) {
+    worley_hash_cells(cell, 1, gen, us, vs);
+    return;
+  }
+
+  const worley_noise *noise = gen->noise;
+  float cube_dist = gen->cube_dist;
+  worley_vec2 cube;
+  cube.u = cell->u * cube_dist;
+  cube.v = cell->v * cube_dist;
+
+  float uSeed = worley_wrap_cell(cell->u, gen->period) * cube_dist;
+  float vSeed = worley_wrap_cell(cell->v, gen->period) * cube_dist;
+  float uvIncrement = cube_dist / (PTS_PER_CUBE + 1);
+  for(int k = gen->points; k < PTS_PER_CUBE; ++k)
+    us[k] = vs[k] = INFINITY;
+  for(int k = 0; k < gen->points; ++k) {
+    worley_vec2 pt = cube;
+
+    // FIXME: this can be made better
+    // also, multiplication of seed by 1000 is somewhat arbitrary.
+    // the main point is that we need multiple random values in [0,1]
+    // which are somehow seeded from the current cube with reproducible results
+    pt.u += noise->unoise2(uSeed*1000, vSeed*1000) * cube_dist;
+    uSeed += uvIncrement;
+    pt.v += noise->unoise2(uSeed*1000, vSeed*1000) * cube_dist;
+    vSeed += uvIncrement;
+
+    us[k] = pt.u;
+    vs[k] = pt.v;
+  }
+}
+
+void generate_cell3(const worley_generator *gen, const worley_cell3 *cell, float *xs, float *ys, float *zs) {
+  if(gen->point_gen == WORLEY_GEN_HASH) {
+    worley_hash_cells3(cell, 1, gen, xs, ys, zs);
+    return;
+  }
+
+  const worley_noise *noise = gen->noise;
+  float cube_dist = gen->cube_dist;
+  worley_vec3 cube;
+  cube.x = cell->x * cube_dist;
+  cube.y = cell->y * cube_dist;
+  cube.z = cell->z * cube_dist;
+
+  worley_vec3 seed;
+  seed.x = (worley_wrap_cell(cell->x, gen->period) * cube_dist) * 1000;
+  seed.y = (worley_wrap_cell(cell->y, gen->period) * cube_dist) * 1000;
+  seed.z = (worley_wrap_cell(cell->z, gen->period) * cube_dist) * 1000;
+  float xyzIncrement = cube_dist / (PTS_PER_CUBE + 1);
+  for(int k = gen->points; k < PTS_PER_CUBE; ++k)
+    xs[k] = ys[k] = zs[k] = INFINITY;
+  for(int k = 0; k < gen->points; ++k) {
+    worley_vec3 pt = cube;
+
+    pt.x += noise->unoise3(&seed) * cube_dist;
+    seed.x = (seed.x + xyzIncrement) * 1000.0;
+
+    pt.y += noise->unoise3(&seed) * cube_dist;
+    seed.y = (seed.y + xyzIncrement) * 1000.0;
+
+    pt.z += noise->unoise3(&seed) * cube_dist;
+    seed.z = (seed.z + xyzIncrement) * 1000.0;
+
+    xs[k] = pt.x;
+    ys[k] = pt.y;
+    zs[k] = pt.z;
+  }
+}
+
+// the slot (0 to width - 1) of a cube coordinate in the window
+static int window_slot(int c, int width) {
+  int m = c % width;
+  return m < 0 ? m + width : m;
+}
+
+// whether cube coordinate c was inside the window around old_c
+static int in_window(int c, int old_c, int radius) {
+  long long d = (long long)c - old_c;
+  return d >= -radius && d <= radius;
+}
+
+double worley_cell_cache_hit_rate(const worley_cache_stats *stats) {
+  unsigned long long lookups = stats->cells_cached + stats->cells_generated;
+  return lookups ? (double)stats->cells_cached / lookups : 0.0;
+}
+
+void worley_cache_stats_add(worley_cache_stats *total, const worley_cache_stats *stats) {
+  total->cells_generated += stats->cells_generated;
+  total->cells_reused += stats->cells_reused;
+  total->cells_cached += stats->cells_cached;
+  total->searches += stats->searches;
+  total->cells_visited += stats->cells_visited;
+  total->points_visited += stats->points_visited;
+  total->packet_searches += stats->packet_searches;
+  total->samples += stats->samples;
+  total->jagged_searches += stats->jagged_searches;
+  total->search_cycles += stats->search_cycles;
+  total->generate_cycles += stats->generate_cycles;
+  total->unproven_searches += stats->unproven_searches;
+}
+
+const char *worley_profiled(void) {
+#ifdef WORLEY_PROFILE
+  return WORLEY_CLOCK;
+#else
+  return NULL;
+#endif
+}
+
+int worley_cache_stats_json(const worley_cache_stats *stats, char *buf, size_t size) {
+  return snprintf(buf, size,
+    "{\"profiled\": %s, \"clock\": \"%s\", \"samples\": %llu, \"searches\": %llu, \"jagged_searches\": %llu, "
+    "\"cells_generated\": %llu, \"cells_reused\": %llu, \"cells_cached\": %llu, \"cell_cache_hit_rate\": %.4f, "
+    "\"cells_visited\": %llu, \"points_visited\": %llu, \"packet_searches\": %llu, \"search_cycles\": %llu, \"generate_cycles\": %llu, "
+    "\"unproven_searches\": %llu}",
+    worley_profiled() ? "true" : "false", WORLEY_CLOCK, stats->samples, stats->searches, stats->jagged_searches,
+    stats->cells_generated, stats->cells_reused, stats->cells_cached, worley_cell_cache_hit_rate(stats),
+    stats->cells_visited, stats->points_visited, stats->packet_searches, stats->search_cycles, stats->generate_cycles,
+    stats->unproven_searches);
+}
+
+// puts the points of cube c into the window at index i, from the cell cache if possible
+static void fetch_cell(worley_context2 *context, const worley_generator *gen, const worley_cell2 *c, int i) {
+  float *us = context->cacheU + i, *vs = context->cacheV + i;
+  if(context->cells) {
+    int hit;
+    worley_cell_entry *entry = worley_cell_cache_lookup(context->cells, gen, c->u, c->v, 0, &hit);
+    if(!hit) {
+      float pts[3 * PTS_PER_CUBE];
+      PROFILE_START(t);
+      generate_cell(gen, c, pts, pts + PTS_PER_CUBE);
+      PROFILE_STOP(context->stats, generate_cycles, t);
+      worley_cell_cache_store(context->cells, entry, pts, 2);
+      for(int k = 0; k < gen->points; ++k) {
+        us[k] = pts[k];
+        vs[k] = pts[PTS_PER_CUBE + k];
+      }
+    }
+    else {
+      worley_cell_cache_load(context->cells, entry, gen->points, us, vs, NULL);
+      context->stats.cells_cached++;
+      return;
+    }
+  }
+  else {
+    PROFILE_START(t);
+    if(gen->points == PTS_PER_CUBE)
+      generate_cell(gen, c, us, vs);
+    else {
+      // the cube's slots in the window are fewer than the generated ones
+      float pts[2 * PTS_PER_CUBE];
+      generate_cell(gen, c, pts, pts + PTS_PER_CUBE);
+      for(int k = 0; k < gen->points; ++k) {
+        us[k] = pts[k];
+        vs[k] = pts[PTS_PER_CUBE + k];
+      }
+    }
+    PROFILE_STOP(context->stats, generate_cycles, t);
+  }
+  context->stats.cells_generated++;
+}
+
+static void fetch_cell3(worley_context3 *context, const worley_generator *gen, const worley_cell3 *c, int i) {
+  float *xs = context->cacheX + i, *ys = context->cacheY + i, *zs = context->cacheZ + i;
+  if(context->cells) {
+    int hit;
+    worley_cell_entry *entry = worley_cell_cache_lookup(context->cells, gen, c->x, c->y, c->z, &hit);
+    if(!hit) {
+      float pts[3 * PTS_PER_CUBE];
+      PROFILE_START(t);
+      generate_cell3(gen, c, pts, pts + PTS_PER_CUBE, pts + 2 * PTS_PER_CUBE);
+      PROFILE_STOP(context->stats, generate_cycles, t);
+      worley_cell_cache_store(context->cells, entry, pts, 3);
+      for(int k = 0; k < gen->points; ++k) {
+        xs[k] = pts[k];
+        ys[k] = pts[PTS_PER_CUBE + k];
+        zs[k] = pts[2 * PTS_PER_CUBE + k];
+      }
+    }
+    else {
+      worley_cell_cache_load(context->cells, entry, gen->points, xs, ys, zs);
+      context->stats.cells_cached++;
+      return;
+    }
+  }
+  else {
+    PROFILE_START(t);
+    if(gen->points == PTS_PER_CUBE)
+      generate_cell3(gen, c, xs, ys, zs);
+    else {
+      float pts[3 * PTS_PER_CUBE];
+      generate_cell3(gen, c, pts, pts + PTS_PER_CUBE, pts + 2 * PTS_PER_CUBE);
+      for(int k = 0; k < gen->points; ++k) {
+        xs[k] = pts[k];
+        ys[k] = pts[PTS_PER_CUBE + k];
+        zs[k] = pts[2 * PTS_PER_CUBE + k];
+      }
+    }
+    PROFILE_STOP(context->stats, generate_cycles, t);
+  }
+  context->stats.cells_generated++;
+}
+
+void update_cache(worley_context2 *context, const worley_generator *gen, const worley_cell2 *cell) {
+  int valid = context->cache_initialized && worley_generator_equal(&context->cacheGen, gen)
+              && context->cacheGen.measure == gen->measure;
+  worley_cell2 old = context->cacheCell;
+  if(valid && old.u == cell->u && old.v == cell->v) {
+    return;
+  }
+  if(!valid) {
+    // the layout may have changed; the slots past the points are searched as well, so they have to be at infinity
+    context->window = window_layout(gen, 2);
+    for(int i = context->window.size; i < context->window.padded; ++i)
+      context->cacheU[i] = context->cacheV[i] = INFINITY;
+  }
+  int r = context->window.radius, w = context->window.width;
+
+  // for the cubes of the window around the current cube,
+  // get the random points in that cube, unless they were already in the old window
+  for(int v=-r; v<=r; ++v) {
+    for(int u=-r; u<=r; ++u) {
+      worley_cell2 c;
+      c.u = cell->u + u;
+      c.v = cell->v + v;
+      if(valid && in_window(c.u, old.u, r) && in_window(c.v, old.v, r)) {
+        context->stats.cells_reused++;
+        continue;
+      }
+      int i = (window_slot(c.v, w) * w + window_slot(c.u, w)) * gen->points;
+      fetch_cell(context, gen, &c, i);
+    }
+  }
+
+  context->cacheCell = *cell;
+  context->cacheGen = *gen;
+  context->cache_initialized = 1;
+}
+
+void update_cache3(worley_context3 *context, const worley_generator *gen, const worley_cell3 *cell) {
+  int valid = context->cache_initialized && worley_generator_equal(&context->cacheGen, gen)
+              && context->cacheGen.measure == gen->measure;
+  worley_cell3 old = context->cacheCell;
+  if(valid && old.x == cell->x && old.y == cell->y && old.z == cell->z) {
+    return;
+  }
+  if(!valid) {
+    context->window = window_layout(gen, 3);
+    for(int i = context->window.size; i < context->window.padded; ++i)
+      context->cacheX[i] = context->cacheY[i] = context->cacheZ[i] = INFINITY;
+  }
+  int r = context->window.radius, w = context->window.width;
+
+  // for the cubes of the window around the current cube,
+  // get the random points in that cube, unless they were already in the old window
+  for(int z=-r; z<=r; ++z) {
+    for(int y=-r; y<=r; ++y) {
+      for(int x=-r; x<=r; ++x) {
+        worley_cell3 c;
+        c.x = cell->x + x;
+        c.y = cell->y + y;
+        c.z = cell->z + z;
+        if(valid && in_window(c.x, old.x, r) && in_window(c.y, old.y, r) && in_window(c.z, old.z, r)) {
+          context->stats.cells_reused++;
+          continue;
+        }
+        int i = ((window_slot(c.z, w) * w + window_slot(c.y, w)) * w + window_slot(c.x, w)) * gen->points;
+        fetch_cell3(context, gen, &c, i);
+      }
+    }
+  }
+
+  context->cacheCell = *cell;
+  context->cacheGen = *gen;
+  context->cache_initialized = 1;
+}
+
+/************* Evaluation *************/
+
+// The hot path is written once, as always-inlined bodies taking the distance measure and mode as arguments, and
+// generated with constants for them: DEFINE_SEARCHES generates the searches for every measure, so the distance kernel
+// is folded into their loops, and DEFINE_VARIANTS the evaluation of a sample (the searches, the classic gap test and
+// combining the distances) for every measure and mode. setup_body picks the variant once per parameter set
+// (eval_setup.variant); worley_evaluator keeps it from shader instance init on.
+// The rest (the exact gap test, gradients, filtered and fractal evaluation) takes the measure and mode at runtime
+// and is compiled once (NOINLINE), calling the searches through eval_setup.searches.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE static inline
+#endif
+
+// no inlining and no copies specialized for constant arguments (GCC's IPA-CP clones): compiled once
+#if defined(__clang__)
+#define NOINLINE static __attribute__((noinline))
+#elif defined(__GNUC__)
+#define NOINLINE static __attribute__((noinline, noclone))
+#else
+#define NOINLINE static
+#endif
+
+ALWAYS_INLINE float combine(dist_mode mode, float f1, float f2, float f3) {
+  switch(mode) {
+    case DIST_F1: return f1;
+    case DIST_F2_M_F1: return f2 - f1;
+    case DIST_F1_P_F2: return (2 * f1 + f2) / 3;
+    case DIST_F3_M_F2_M_F1: return (2 * f3 - f2 - f1) / 2;
+    case DIST_F1_P_F2_P_F3: return (0.5 * f1 + 0.33 * f2 + (1 - 0.5 - 0.33) * f3);
+    default: return 0.0;
+  }
+}
+
+float worley_combine(dist_mode mode, float f1, float f2, float f3) {
+  return combine(mode, f1, f2, f3);
+}
+
+// the search kernel of a measure; unknown measures fall back to linear distance.
+// Minkowski distances with p = 1, 2 or infinity are the manhattan, linear or chebyshev ones; p has to be clamped already.
+static worley_kernel_measure kernel_of(dist_measure m, float p) {
+  switch(m) {
+    case DIST_LINEAR: return KERNEL_LINEAR;
+    case DIST_LINEAR_SQUARED: return KERNEL_LINEAR_SQUARED;
+    case DIST_MANHATTAN: return KERNEL_MANHATTAN;
+    case DIST_CHEBYSHEV: return KERNEL_CHEBYSHEV;
+    case DIST_MINKOWSKI:
+      if(!(p > 1)) return KERNEL_MANHATTAN;
+      if(p == 2) return KERNEL_LINEAR;
+      if(isinf(p)) return KERNEL_CHEBYSHEV;
+      return p == (int)p ? KERNEL_POWER_INT : KERNEL_POWER;
+    default: return KERNEL_LINEAR;
+  }
+}
+
+struct eval_searches;
+struct eval_variant;
+
+// everything that follows from the parameters and doesn't change from sample to sample
+typedef struct eval_setup {
+  const worley_params *params;
+  dist_measure measure;
+  const struct eval_searches *searches; // the searches of the measure, see DEFINE_SEARCHES
+  const struct eval_variant *variant;   // the evaluation of the measure and params->distance_mode, see DEFINE_VARIANTS
+  const worley_noise *noise;
+  worley_generator gen;
+  float scale; // dist_scale * scale (* scaleX) * the density's spacing
+  worley_search2_fn search2;
+  worley_search3_fn search3;
+  worley_search2_pair_fn search2_pair;
+  worley_search3_pair_fn search3_pair;
+  worley_search2_packet_fn search2_packet;
+  worley_search3_packet_fn search3_packet;
+  worley_kernel_measure kernel; // kernel_of the measure
+  float power, inv_power; // the power kernels' exponent (minkowski_p, clamped) and its inverse
+  int weighted; // whether the sample points are scaled by weights before the search
+  float weights[3]; // axis_weights, normalized
+  int exact_gap; // gap_test is WORLEY_GAP_EXACT
+  float gap_scale; // the scale of the linear measure, which the exact gap is measured with
+  int want_edge, want_cell; // whether the samples need their edge and cell (for the batch outputs)
+} eval_setup;
+
+// the per-sample outputs of the evaluation
+typedef struct eval_sample {
+  float f1, f2, f3; // divided by eval_setup.scale
+  int gap;
+  float value;
+  float edge;    // only with want_edge or exact_gap: the distance to the edge of the gap, in the units of gap_size
+  uint32_t cell; // only with want_cell: cell_id2/cell_id3
+} eval_sample;
+
+static const struct eval_searches *searches_of(dist_measure m);
+static const struct eval_variant *variant_of(dist_measure m, dist_mode mode);
+
+static void setup_body(eval_setup *setup, const worley_params *params, dist_measure m, int dims) {
+  const worley_kernels *kernels = worley_get_kernels();
+  setup->params = params;
+  setup->measure = m;
+  setup->searches = searches_of(m);
+  setup->variant = variant_of(m, params->distance_mode);
+  setup->noise = params_noise(params);
+  worley_generator_init(&setup->gen, params, worley_cube_dist(params, dims));
+  float spacing = density_spacing(params, dims);
+  float p = isinf(params->minkowski_p) ? params->minkowski_p : fminf(params->minkowski_p, WORLEY_MINKOWSKI_MAX);
+  setup->scale = (m == DIST_MINKOWSKI ? worley_minkowski_scale(p) : dist_scale(m)) * params->scale
+                 * (m == DIST_LINEAR_SQUARED ? spacing * spacing : spacing);
+  setup->gap_scale = dist_scale(DIST_LINEAR) * params->scale * spacing;
+  if(dims == 3) {
+    setup->scale *= params->scaleX;
+    setup->gap_scale *= params->scaleX;
+  }
+  setup->exact_gap = params->gap_test == WORLEY_GAP_EXACT;
+  setup->want_edge = setup->want_cell = 0;
+  worley_kernel_measure k = kernel_of(m, p);
+  setup->kernel = k;
+  setup->power = k == KERNEL_POWER_INT || k == KERNEL_POWER ? p : 1;
+  setup->inv_power = 1 / setup->power;
+  setup->search2 = kernels->search2[k];
+  setup->search3 = kernels->search3[k];
+  setup->search2_pair = kernels->search2_pair[k];
+  setup->search3_pair = kernels->search3_pair[k];
+  setup->search2_packet = kernels->search2_packet[k];
+  setup->search3_packet = kernels->search3_packet[k];
+
+  // weights <= 0 count as 1; the normalization keeps the cells' mean size
+  float w[3], product = 1;
+  for(int a = 0; a < 3; ++a) {
+    w[a] = params->axis_weights[a] > 0 ? params->axis_weights[a] : 1;
+    if(a < dims)
+      product *= w[a];
+  }
+  float norm = dims == 2 ? sqrtf(product) : cbrtf(product);
+  setup->weighted = 0;
+  for(int a = 0; a < 3; ++a) {
+    setup->weights[a] = a < dims ? w[a] / norm : 1;
+    setup->weighted |= setup->weights[a] != 1;
+  }
+}
+
+// the kernel of the setup. For a constant measure other than DIST_MINKOWSKI, this is a constant, too.
+ALWAYS_INLINE worley_kernel_measure setup_kernel(const eval_setup *setup, dist_measure m) {
+  switch(m) {
+    case DIST_LINEAR: return KERNEL_LINEAR;
+    case DIST_LINEAR_SQUARED: return KERNEL_LINEAR_SQUARED;
+    case DIST_MANHATTAN: return KERNEL_MANHATTAN;
+    case DIST_CHEBYSHEV: return KERNEL_CHEBYSHEV;
+    default: return setup->kernel;
+  }
+}
+
+ALWAYS_INLINE int power_kernel(worley_kernel_measure k) {
+  return k == KERNEL_POWER_INT || k == KERNEL_POWER;
+}
+
+// a^n for an integer n >= 1, multiplied in the order of pow_int in worley_simd_kernel.h
+ALWAYS_INLINE float pow_int(float a, int n) {
+  float r = 1;
+  for(;;) {
+    if(n & 1) r *= a;
+    n >>= 1;
+    if(!n) return r;
+    a *= a;
+  }
+}
+
+// the distance as the kernels rank it, bit for bit: the power kernels leave out the root
+ALWAYS_INLINE float kernel_dist2(worley_kernel_measure k, float power, const worley_vec2 *v1, const worley_vec2 *v2) {
+  float du = fabsf(v1->u - v2->u), dv = fabsf(v1->v - v2->v);
+  switch(k) {
+    case KERNEL_LINEAR: return dist_linear(v1,v2);
+    case KERNEL_LINEAR_SQUARED: return dist_linear_squared(v1,v2);
+    case KERNEL_MANHATTAN: return dist_manhattan(v1,v2);
+    case KERNEL_CHEBYSHEV: return du > dv ? du : dv;
+    case KERNEL_POWER_INT: return pow_int(du, (int)power) + pow_int(dv, (int)power);
+    case KERNEL_POWER: return powf(du, power) + powf(dv, power);
+    default: return -1;
+  }
+}
+
+ALWAYS_INLINE float kernel_dist3(worley_kernel_measure k, float power, const worley_vec3 *v1, const worley_vec3 *v2) {
+  float dx = fabsf(v1->x - v2->x), dy = fabsf(v1->y - v2->y), dz = fabsf(v1->z - v2->z);
+  switch(k) {
+    case KERNEL_LINEAR: return dist_linear3(v1,v2);
+    case KERNEL_LINEAR_SQUARED: return dist_linear_squared3(v1,v2);
+    case KERNEL_MANHATTAN: return dist_manhattan3(v1,v2);
+    case KERNEL_CHEBYSHEV: { float m = dx > dy ? dx : dy; return m > dz ? m : dz; }
+    case KERNEL_POWER_INT: return pow_int(dx, (int)power) + pow_int(dy, (int)power) + pow_int(dz, (int)power);
+    case KERNEL_POWER: return powf(dx, power) + powf(dy, power) + powf(dz, power);
+    default: return -1;
+  }
+}
+
+// a ranked distance as a distance (FLT_MAX stays: no point)
+ALWAYS_INLINE float kernel_root(const eval_setup *setup, worley_kernel_measure k, float f) {
+  return power_kernel(k) && f != FLT_MAX ? powf(f, setup->inv_power) : f;
+}
+
+// the distance from v1 to v2 in the measure m of the setup
+ALWAYS_INLINE float dist2(const eval_setup *setup, dist_measure m, const worley_vec2 *v1, const worley_vec2 *v2) {
+  worley_kernel_measure k = setup_kernel(setup, m);
+  return kernel_root(setup, k, kernel_dist2(k, setup->power, v1, v2));
+}
+
+ALWAYS_INLINE float dist3(const eval_setup *setup, dist_measure m, const worley_vec3 *v1, const worley_vec3 *v2) {
+  worley_kernel_measure k = setup_kernel(setup, m);
+  return kernel_root(setup, k, kernel_dist3(k, setup->power, v1, v2));
+}
+
+// the sample point in the weighted space the searches run in
+ALWAYS_INLINE worley_vec2 weigh2(const eval_setup *setup, const worley_vec2 *pt) {
+  worley_vec2 w = { pt->u * setup->weights[0], pt->v * setup->weights[1] };
+  return w;
+}
+
+ALWAYS_INLINE worley_vec3 weigh3(const eval_setup *setup, const worley_vec3 *pt) {
+  worley_vec3 w = { pt->x * setup->weights[0], pt->y * setup->weights[1], pt->z * setup->weights[2] };
+  return w;
+}
+
+// turns the indices of the top 3 into points. Index -1: fewer than three points around, the point itself is used.
+// The power kernels' distances get their root here.
+ALWAYS_INLINE void store_result2(const worley_context2 *context, const eval_setup *setup, const worley_top3 *top, const worley_vec2 *pt,
+                                 worley_result2 *result) {
+  worley_vec2 *ps[3] = { &result->p1, &result->p2, &result->p3 };
+  for(int k = 0; k < 3; ++k) {
+    int i = top->i[k];
+    if(i >= 0) {
+      ps[k]->u = context->cacheU[i];
+      ps[k]->v = context->cacheV[i];
+    }
+    else
+      *ps[k] = *pt;
+  }
+  worley_kernel_measure k = setup->kernel;
+  result->f1 = kernel_root(setup, k, top->f[0]);
+  result->f2 = kernel_root(setup, k, top->f[1]);
+  result->f3 = kernel_root(setup, k, top->f[2]);
+}
+
+ALWAYS_INLINE void store_result3(const worley_context3 *context, const eval_setup *setup, const worley_top3 *top, const worley_vec3 *pt,
+                                 worley_result3 *result) {
+  worley_vec3 *ps[3] = { &result->p1, &result->p2, &result->p3 };
+  for(int k = 0; k < 3; ++k) {
+    int i = top->i[k];
+    if(i >= 0) {
+      ps[k]->x = context->cacheX[i];
+      ps[k]->y = context->cacheY[i];
+      ps[k]->z = context->cacheZ[i];
+    }
+    else
+      *ps[k] = *pt;
+  }
+  worley_kernel_measure k = setup->kernel;
+  result->f1 = kernel_root(setup, k, top->f[0]);
+  result->f2 = kernel_root(setup, k, top->f[1]);
+  result->f3 = kernel_root(setup, k, top->f[2]);
+}
+
+// Pruned search.
+// No point of a cube can be closer to pt than the cube's box, so the cubes are visited by the distance to their box
+// and the search stops at the first one that is farther away than the current f3.
+// The bounds are shrunk a little, as points on a face can end up an ulp outside their box.
+#define PRUNE_SLACK 0.99999f
+
+// the smallest possible distance as kernel k ranks it, given the per-axis distances to a box
+ALWAYS_INLINE float box_bound(worley_kernel_measure k, float power, float dx, float dy, float dz) {
+  switch(k) {
+    case KERNEL_LINEAR: return sqrtf(dx * dx + dy * dy + dz * dz) * PRUNE_SLACK;
+    case KERNEL_LINEAR_SQUARED: return (dx * dx + dy * dy + dz * dz) * PRUNE_SLACK;
+    case KERNEL_MANHATTAN: return (dx + dy + dz) * PRUNE_SLACK;
+    case KERNEL_CHEBYSHEV: return fmaxf(fmaxf(dx, dy), dz) * PRUNE_SLACK;
+    case KERNEL_POWER_INT: return (pow_int(dx, (int)power) + pow_int(dy, (int)power) + pow_int(dz, (int)power)) * PRUNE_SLACK;
+    case KERNEL_POWER: return (powf(dx, power) + powf(dy, power) + powf(dz, power)) * PRUNE_SLACK;
+    default: return 0;
+  }
+}
+
+// the distance along one axis from coordinate p (in cube c) to the boxes of cubes c - radius to c + radius
+static void axis_gaps(float p, int c, float cube_dist, int radius, float *gaps) {
+  float below = fmaxf(p - c * cube_dist, 0), above = fmaxf((c + 1) * cube_dist - p, 0);
+  gaps[radius] = 0;
+  for(int d = 1; d <= radius; ++d) {
+    gaps[radius - d] = below + (d - 1) * cube_dist;
+    gaps[radius + d] = above + (d - 1) * cube_dist;
+  }
+}
+
+// the distance from pt to the border of the window around cell: no point outside the window can be closer.
+// (Used by WORLEY_PROFILE builds to count the searches whose F3 isn't proven.)
+ALWAYS_INLINE float window_margin(worley_kernel_measure k, float power, const float *p, const int *c, int dims, float cube_dist, int radius) {
+  float margin = FLT_MAX;
+  for(int a = 0; a < dims; ++a) {
+    margin = fminf(margin, p[a] - (c[a] - radius) * cube_dist);
+    margin = fminf(margin, (c[a] + radius + 1) * cube_dist - p[a]);
+  }
+  return box_bound(k, power, fmaxf(margin, 0), 0, 0);
+}
+
+ALWAYS_INLINE int unproven2(const worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt,
+                            const worley_cell2 *cell, float f3, dist_measure m) {
+  float p[2] = { pt->u, pt->v };
+  int c[2] = { cell->u, cell->v };
+  return f3 > window_margin(setup_kernel(setup, m), setup->power, p, c, 2, setup->gen.cube_dist, context->window.radius);
+}
+
+ALWAYS_INLINE int unproven3(const worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt,
+                            const worley_cell3 *cell, float f3, dist_measure m) {
+  float p[3] = { pt->x, pt->y, pt->z };
+  int c[3] = { cell->x, cell->y, cell->z };
+  return f3 > window_margin(setup_kernel(setup, m), setup->power, p, c, 3, setup->gen.cube_dist, context->window.radius);
+}
+
+// the cubes in the window
+ALWAYS_INLINE int window_cubes(const worley_window *w, int dims) {
+  return dims == 2 ? w->width * w->width : w->width * w->width * w->width;
+}
+
+ALWAYS_INLINE void search2_full(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, worley_result2 *result,
+                                dist_measure m) {
+  worley_cell2 cell = point_cell(pt,setup->gen.cube_dist);
+  update_cache(context, &setup->gen, &cell);
+  context->stats.searches++;
+  context->stats.cells_visited += window_cubes(&context->window, 2);
+  context->stats.points_visited += context->window.size;
+
+  worley_top3 top;
+  PROFILE_START(t);
+  setup->search2(context->cacheU, context->cacheV, context->window.padded, setup->power, pt->u, pt->v, &top);
+  PROFILE_STOP(context->stats, search_cycles, t);
+  PROFILE_COUNT(context->stats, unproven_searches, unproven2(context, setup, pt, &cell, top.f[2], m));
+
+  store_result2(context, setup, &top, pt, result);
+}
+
+ALWAYS_INLINE void search3_full(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, worley_result3 *result,
+                                dist_measure m) {
+  worley_cell3 cell = point_cell3(pt,setup->gen.cube_dist);
+  update_cache3(context, &setup->gen, &cell);
+  context->stats.searches++;
+  context->stats.cells_visited += window_cubes(&context->window, 3);
+  context->stats.points_visited += context->window.size;
+
+  worley_top3 top;
+  PROFILE_START(t);
+  setup->search3(context->cacheX, context->cacheY, context->cacheZ, context->window.padded, setup->power, pt->x, pt->y, pt->z, &top);
+  PROFILE_STOP(context->stats, search_cycles, t);
+  PROFILE_COUNT(context->stats, unproven_searches, unproven3(context, setup, pt, &cell, top.f[2], m));
+
+  store_result3(context, setup, &top, pt, result);
+}
+
+// the cube of the window with the smallest bound that is left. The caller takes it out by setting its bound to infinity.
+// (Picking the next cube like this beats sorting all of them, as the search only visits a few.)
+static int nearest_box(const float *bounds, int n) {
+  int c = 0;
+  for(int k = 1; k < n; ++k)
+    if(bounds[k] < bounds[c])
+      c = k;
+  return c;
+}
+
+// whether (d, i) comes before entry k of the top 3. Ties go to the smaller index, like in the kernels.
+ALWAYS_INLINE int top3_before(float d, int i, const worley_top3 *top, int k) {
+  return d < top->f[k] || (d == top->f[k] && i < top->i[k]);
+}
+
+ALWAYS_INLINE void top3_insert(float d, int i, worley_top3 *top) {
+  if(top3_before(d, i, top, 2)) {
+    if(top3_before(d, i, top, 1)) {
+      top->f[2] = top->f[1]; top->i[2] = top->i[1];
+      if(top3_before(d, i, top, 0)) {
+        top->f[1] = top->f[0]; top->i[1] = top->i[0];
+        top->f[0] = d; top->i[0] = i;
+      }
+      else {
+        top->f[1] = d; top->i[1] = i;
+      }
+    }
+    else {
+      top->f[2] = d; top->i[2] = i;
+    }
+  }
+}
+
+ALWAYS_INLINE void search2_pruned(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, worley_result2 *result,
+                                  dist_measure m) {
+  float cube_dist = setup->gen.cube_dist;
+  worley_cell2 cell = point_cell(pt,cube_dist);
+  update_cache(context, &setup->gen, &cell);
+  worley_kernel_measure kernel = setup_kernel(setup, m);
+  float power = setup->power;
+  PROFILE_START(t);
+  int r = context->window.radius, w = context->window.width, n = w * w, points = setup->gen.points;
+
+  float gu[5], gv[5];
+  axis_gaps(pt->u, cell.u, cube_dist, r, gu);
+  axis_gaps(pt->v, cell.v, cube_dist, r, gv);
+  float bounds[25];
+  for(int dv = 0; dv < w; ++dv)
+    for(int du = 0; du < w; ++du)
+      bounds[dv * w + du] = box_bound(kernel, power, gu[du], gv[dv], 0);
+
+  worley_top3 top = { { FLT_MAX, FLT_MAX, FLT_MAX }, { INT_MAX, INT_MAX, INT_MAX } };
+  int visited = 0;
+  for(; visited < n; ++visited) {
+    int c = nearest_box(bounds, n);
+    if(bounds[c] > top.f[2])
+      break;
+    bounds[c] = INFINITY;
+    int i = (window_slot(cell.v + c / w - r, w) * w + window_slot(cell.u + c % w - r, w)) * points;
+    for(int k = i; k < i + points; ++k) {
+      worley_vec2 p = { context->cacheU[k], context->cacheV[k] };
+      top3_insert(kernel_dist2(kernel, power, pt, &p), k, &top);
+    }
+  }
+  PROFILE_STOP(context->stats, search_cycles, t);
+  PROFILE_COUNT(context->stats, unproven_searches, unproven2(context, setup, pt, &cell, top.f[2], m));
+  context->stats.searches++;
+  context->stats.cells_visited += visited;
+  context->stats.points_visited += visited * points;
+
+  for(int k = 0; k < 3; ++k)
+    if(top.i[k] == INT_MAX)
+      top.i[k] = -1;
+  store_result2(context, setup, &top, pt, result);
+}
+
+ALWAYS_INLINE void search3_pruned(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, worley_result3 *result,
+                                  dist_measure m) {
+  float cube_dist = setup->gen.cube_dist;
+  worley_cell3 cell = point_cell3(pt,cube_dist);
+  update_cache3(context, &setup->gen, &cell);
+  worley_kernel_measure kernel = setup_kernel(setup, m);
+  float power = setup->power;
+  PROFILE_START(t);
+  int r = context->window.radius, w = context->window.width, n = w * w * w, points = setup->gen.points;
+
+  float gx[5], gy[5], gz[5];
+  axis_gaps(pt->x, cell.x, cube_dist, r, gx);
+  axis_gaps(pt->y, cell.y, cube_dist, r, gy);
+  axis_gaps(pt->z, cell.z, cube_dist, r, gz);
+  float bounds[125];
+  for(int dz = 0; dz < w; ++dz)
+    for(int dy = 0; dy < w; ++dy)
+      for(int dx = 0; dx < w; ++dx)
+        bounds[(dz * w + dy) * w + dx] = box_bound(kernel, power, gx[dx], gy[dy], gz[dz]);
+
+  worley_top3 top = { { FLT_MAX, FLT_MAX, FLT_MAX }, { INT_MAX, INT_MAX, INT_MAX } };
+  int visited = 0;
+  for(; visited < n; ++visited) {
+    int c = nearest_box(bounds, n);
+    if(bounds[c] > top.f[2])
+      break;
+    bounds[c] = INFINITY;
+    int i = ((window_slot(cell.z + c / (w * w) - r, w) * w + window_slot(cell.y + c / w % w - r, w)) * w
+             + window_slot(cell.x + c % w - r, w)) * points;
+    for(int k = i; k < i + points; ++k) {
+      worley_vec3 p = { context->cacheX[k], context->cacheY[k], context->cacheZ[k] };
+      top3_insert(kernel_dist3(kernel, power, pt, &p), k, &top);
+    }
+  }
+  PROFILE_STOP(context->stats, search_cycles, t);
+  PROFILE_COUNT(context->stats, unproven_searches, unproven3(context, setup, pt, &cell, top.f[2], m));
+  context->stats.searches++;
+  context->stats.cells_visited += visited;
+  context->stats.points_visited += visited * points;
+
+  for(int k = 0; k < 3; ++k)
+    if(top.i[k] == INT_MAX)
+      top.i[k] = -1;
+  store_result3(context, setup, &top, pt, result);
+}
+
+ALWAYS_INLINE void search2(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, worley_result2 *result,
+                           dist_measure m) {
+  if(setup->params->search == WORLEY_SEARCH_PRUNED)
+    search2_pruned(context, setup, pt, result, m);
+  else
+    search2_full(context, setup, pt, result, m);
+}
+
+ALWAYS_INLINE void search3(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, worley_result3 *result,
+                           dist_measure m) {
+  if(setup->params->search == WORLEY_SEARCH_PRUNED)
+    search3_pruned(context, setup, pt, result, m);
+  else
+    search3_full(context, setup, pt, result, m);
+}
+
+// the searches of one measure (see DEFINE_SEARCHES)
+typedef struct eval_searches {
+  void (*search2)(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, worley_result2 *result);
+  void (*search3)(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, worley_result3 *result);
+  void (*search2_pair)(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, const worley_vec2 *ptX,
+                       worley_result2 *r, worley_result2 *rX);
+  void (*search3_pair)(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, const worley_vec3 *ptX,
+                       worley_result3 *r, worley_result3 *rX);
+} eval_searches;
+
+// the searches for pt and ptX (the jagged gap point) of one sample.
+// If both are in the same cube, they share the window and one pass over its points.
+ALWAYS_INLINE void search2_pair(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, const worley_vec2 *ptX,
+                                worley_result2 *r, worley_result2 *rX, dist_measure m) {
+  worley_cell2 cell = point_cell(pt,setup->gen.cube_dist);
+  worley_cell2 cellX = point_cell(ptX,setup->gen.cube_dist);
+  PROFILE_COUNT(context->stats, jagged_searches, 1);
+  if(setup->params->search != WORLEY_SEARCH_FULL || cell.u != cellX.u || cell.v != cellX.v) {
+    setup->searches->search2(context, setup, pt, r);
+    setup->searches->search2(context, setup, ptX, rX);
+    return;
+  }
+
+  update_cache(context, &setup->gen, &cell);
+  context->stats.searches += 2;
+  context->stats.cells_visited += 2 * window_cubes(&context->window, 2);
+  context->stats.points_visited += 2 * context->window.size;
+
+  worley_top3 top[2];
+  PROFILE_START(t);
+  setup->search2_pair(context->cacheU, context->cacheV, context->window.padded, setup->power, pt->u, pt->v, ptX->u, ptX->v, top);
+  PROFILE_STOP(context->stats, search_cycles, t);
+  PROFILE_COUNT(context->stats, unproven_searches, unproven2(context, setup, pt, &cell, top[0].f[2], m));
+  PROFILE_COUNT(context->stats, unproven_searches, unproven2(context, setup, ptX, &cell, top[1].f[2], m));
+  store_result2(context, setup, &top[0], pt, r);
+  store_result2(context, setup, &top[1], ptX, rX);
+}
+
+ALWAYS_INLINE void search3_pair(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, const worley_vec3 *ptX,
+                                worley_result3 *r, worley_result3 *rX, dist_measure m) {
+  worley_cell3 cell = point_cell3(pt,setup->gen.cube_dist);
+  worley_cell3 cellX = point_cell3(ptX,setup->gen.cube_dist);
+  PROFILE_COUNT(context->stats, jagged_searches, 1);
+  if(setup->params->search != WORLEY_SEARCH_FULL || cell.x != cellX.x || cell.y != cellX.y || cell.z != cellX.z) {
+    setup->searches->search3(context, setup, pt, r);
+    setup->searches->search3(context, setup, ptX, rX);
+    return;
+  }
+
+  update_cache3(context, &setup->gen, &cell);
+  context->stats.searches += 2;
+  context->stats.cells_visited += 2 * window_cubes(&context->window, 3);
+  context->stats.points_visited += 2 * context->window.size;
+
+  worley_top3 top[2];
+  PROFILE_START(t);
+  setup->search3_pair(context->cacheX, context->cacheY, context->cacheZ, context->window.padded, setup->power,
+                      pt->x, pt->y, pt->z, ptX->x, ptX->y, ptX->z, top);
+  PROFILE_STOP(context->stats, search_cycles, t);
+  PROFILE_COUNT(context->stats, unproven_searches, unproven3(context, setup, pt, &cell, top[0].f[2], m));
+  PROFILE_COUNT(context->stats, unproven_searches, unproven3(context, setup, ptX, &cell, top[1].f[2], m));
+  store_result3(context, setup, &top[0], pt, r);
+  store_result3(context, setup, &top[1], ptX, rX);
+}
+
+// the distance measures the hot path is generated for, as (name, measure)
+#define EVAL_MEASURES(X) \
+  X(linear, DIST_LINEAR) X(linear_squared, DIST_LINEAR_SQUARED) X(manhattan, DIST_MANHATTAN) \
+  X(minkowski, DIST_MINKOWSKI) X(chebyshev, DIST_CHEBYSHEV)
+
+// generates the searches of measure M. Compiled once per measure: the variants of all modes call them.
+#define DEFINE_SEARCHES(NAME, M) \
+NOINLINE void search2_##NAME(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, worley_result2 *result) { \
+  search2(context, setup, pt, result, M); \
+} \
+NOINLINE void search3_##NAME(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, worley_result3 *result) { \
+  search3(context, setup, pt, result, M); \
+} \
+NOINLINE void search2_pair_##NAME(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, const worley_vec2 *ptX, \
+                                  worley_result2 *r, worley_result2 *rX) { \
+  search2_pair(context, setup, pt, ptX, r, rX, M); \
+} \
+NOINLINE void search3_pair_##NAME(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, const worley_vec3 *ptX, \
+                                  worley_result3 *r, worley_result3 *rX) { \
+  search3_pair(context, setup, pt, ptX, r, rX, M); \
+}
+
+EVAL_MEASURES(DEFINE_SEARCHES)
+
+#define SEARCHES(NAME, M) { search2_##NAME, search3_##NAME, search2_pair_##NAME, search3_pair_##NAME },
+
+static const eval_searches measure_searches[5] = { EVAL_MEASURES(SEARCHES) };
+
+// Minkowski's kernel depends on p, so its searches take the kernel from the setup at runtime.
+// That makes them right for measures outside the enum, too (setup_kernel falls back to the setup's kernel).
+static const eval_searches *searches_of(dist_measure m) {
+  return &measure_searches[m >= DIST_LINEAR && m <= DIST_CHEBYSHEV ? m : DIST_MINKOWSKI];
+}
+
+void point_distances(worley_context2 *context, const worley_params *params,
+                     const worley_vec2 *pt, worley_result2 *result) {
+  eval_setup setup;
+  setup_body(&setup, params, params->distance_measure, 2);
+  if(!setup.weighted) {
+    setup.searches->search2(context, &setup, pt, result);
+    return;
+  }
+  // the points back in the space of pt
+  worley_vec2 wpt = weigh2(&setup, pt);
+  setup.searches->search2(context, &setup, &wpt, result);
+  worley_vec2 *ps[3] = { &result->p1, &result->p2, &result->p3 };
+  for(int k = 0; k < 3; ++k) {
+    ps[k]->u /= setup.weights[0];
+    ps[k]->v /= setup.weights[1];
+  }
+}
+
+void point_distances3(worley_context3 *context, const worley_params *params,
+                      const worley_vec3 *pt, worley_result3 *result) {
+  eval_setup setup;
+  setup_body(&setup, params, params->distance_measure, 3);
+  if(!setup.weighted) {
+    setup.searches->search3(context, &setup, pt, result);
+    return;
+  }
+  worley_vec3 wpt = weigh3(&setup, pt);
+  setup.searches->search3(context, &setup, &wpt, result);
+  worley_vec3 *ps[3] = { &result->p1, &result->p2, &result->p3 };
+  for(int k = 0; k < 3; ++k) {
+    ps[k]->x /= setup.weights[0];
+    ps[k]->y /= setup.weights[1];
+    ps[k]->z /= setup.weights[2];
+  }
+}
+
+// jagged edges. useful for broken earth crusts
+// the point the gap is tested at instead of pt
+ALWAYS_INLINE worley_vec2 jagged_point2(const eval_setup *setup, const worley_vec2 *pt) {
+  float scale = setup->scale;
+  worley_vec2 ptX = *pt;
+  ptX.u += setup->noise->noise2(pt->u*1000,pt->v*1000) * 0.15 * scale;
+  ptX.v += setup->noise->noise2(pt->u*1000 + 100,pt->v*1000+100) * 0.15 * scale;
+  return ptX;
+}
+
+ALWAYS_INLINE worley_vec3 jagged_point3(const eval_setup *setup, const worley_vec3 *pt) {
+  float scale = setup->scale;
+  worley_vec3 ptX = *pt;
+  const worley_noise *noise = setup->noise;
+  worley_vec3 seed = *pt;
+  seed.x *= 3 / scale; seed.y *= 3 / scale; seed.z *= 3 / scale;
+  float jaggingX = (noise->unoise3(&seed) - 0.5) * scale * 0.2;
+  ptX.x += jaggingX; seed.x += 1000;
+  float jaggingY = (noise->unoise3(&seed) - 0.5) * scale * 0.2;
+  ptX.y += jaggingY; seed.y += 1000;
+  float jaggingZ = (noise->unoise3(&seed) - 0.5) * scale * 0.2;
+  ptX.z += jaggingZ;
+  return ptX;
+}
+
+// the gradient of the distance f from pt to p with respect to pt
+// (chebyshev: along the axis of the largest difference; minkowski: sign(d) * (|d| / f)^(p - 1) per axis d)
+ALWAYS_INLINE worley_vec2 dist_gradient2(const eval_setup *setup, dist_measure m, const worley_vec2 *pt, const worley_vec2 *p, float f) {
+  worley_vec2 g = { pt->u - p->u, pt->v - p->v };
+  switch(setup_kernel(setup, m)) {
+    case KERNEL_LINEAR:
+      if(f > 0) { g.u /= f; g.v /= f; }
+      else { g.u = 0; g.v = 0; }
+      break;
+    case KERNEL_LINEAR_SQUARED:
+      g.u *= 2; g.v *= 2;
+      break;
+    case KERNEL_MANHATTAN:
+      g.u = (g.u > 0) - (g.u < 0);
+      g.v = (g.v > 0) - (g.v < 0);
+      break;
+    case KERNEL_CHEBYSHEV: {
+      int u = fabsf(g.u) >= fabsf(g.v);
+      g.u = u ? (g.u > 0) - (g.u < 0) : 0;
+      g.v = u ? 0 : (g.v > 0) - (g.v < 0);
+      break;
+    }
+    case KERNEL_POWER_INT:
+    case KERNEL_POWER:
+      if(f > 0) {
+        g.u = copysignf(powf(fabsf(g.u) / f, setup->power - 1), g.u);
+        g.v = copysignf(powf(fabsf(g.v) / f, setup->power - 1), g.v);
+      }
+      else { g.u = 0; g.v = 0; }
+      break;
+    default:
+      g.u = 0; g.v = 0;
+  }
+  return g;
+}
+
+ALWAYS_INLINE worley_vec3 dist_gradient3(const eval_setup *setup, dist_measure m, const worley_vec3 *pt, const worley_vec3 *p, float f) {
+  worley_vec3 g = { pt->x - p->x, pt->y - p->y, pt->z - p->z };
+  switch(setup_kernel(setup, m)) {
+    case KERNEL_LINEAR:
+      if(f > 0) { g.x /= f; g.y /= f; g.z /= f; }
+      else { g.x = 0; g.y = 0; g.z = 0; }
+      break;
+    case KERNEL_LINEAR_SQUARED:
+      g.x *= 2; g.y *= 2; g.z *= 2;
+      break;
+    case KERNEL_MANHATTAN:
+      g.x = (g.x > 0) - (g.x < 0);
+      g.y = (g.y > 0) - (g.y < 0);
+      g.z = (g.z > 0) - (g.z < 0);
+      break;
+    case KERNEL_CHEBYSHEV: {
+      float ax = fabsf(g.x), ay = fabsf(g.y), az = fabsf(g.z);
+      int a = ax >= ay && ax >= az ? 0 : (ay >= az ? 1 : 2);
+      g.x = a == 0 ? (g.x > 0) - (g.x < 0) : 0;
+      g.y = a == 1 ? (g.y > 0) - (g.y < 0) : 0;
+      g.z = a == 2 ? (g.z > 0) - (g.z < 0) : 0;
+      break;
+    }
+    case KERNEL_POWER_INT:
+    case KERNEL_POWER:
+      if(f > 0) {
+        g.x = copysignf(powf(fabsf(g.x) / f, setup->power - 1), g.x);
+        g.y = copysignf(powf(fabsf(g.y) / f, setup->power - 1), g.y);
+        g.z = copysignf(powf(fabsf(g.z) / f, setup->power - 1), g.z);
+      }
+      else { g.x = 0; g.y = 0; g.z = 0; }
+      break;
+    default:
+      g.x = 0; g.y = 0; g.z = 0;
+  }
+  return g;
+}
+
+/************* Exact gap *************/
+
+// WORLEY_GAP_EXACT. The border of the cell of p1 (the F1 point at pt) is the nearest of its borders with the other points.
+// The window of the search at pt holds every point whose border can come near pt, so one more pass over its points
+// gives the distance to it, without another search.
+
+// the distance from x to the border between the cells of p1 and q, and in g the direction in which it grows.
+// b2 is |x - p1|^2, f1 and g1 the distance from x to p1 in the measure and its gradient (not needed with planes).
+ALWAYS_INLINE float border2(const eval_setup *setup, dist_measure m, int planes, const worley_vec2 *x, const worley_vec2 *p1,
+                            float b2, float f1, const worley_vec2 *g1, const worley_vec2 *q, worley_vec2 *g) {
+  if(planes) {
+    // (|x - q|^2 - |x - p1|^2) / (2 |q - p1|), growing towards p1
+    float au = x->u - q->u, av = x->v - q->v;
+    g->u = p1->u - q->u; g->v = p1->v - q->v;
+    float len = sqrtf(g->u * g->u + g->v * g->v);
+    g->u /= len; g->v /= len;
+    return (au * au + av * av - b2) / (2 * len);
+  }
+  float fq = dist2(setup, m, x, q);
+  worley_vec2 gq = dist_gradient2(setup, m, x, q, fq);
+  g->u = gq.u - g1->u; g->v = gq.v - g1->v;
+  float len = sqrtf(g->u * g->u + g->v * g->v);
+  if(!(len > 0)) // the distances differ by a constant here: no border nearby
+    return FLT_MAX;
+  g->u /= len; g->v /= len;
+  return (fq - f1) / len;
+}
+
+ALWAYS_INLINE float border3(const eval_setup *setup, dist_measure m, int planes, const worley_vec3 *x, const worley_vec3 *p1,
+                            float b2, float f1, const worley_vec3 *g1, const worley_vec3 *q, worley_vec3 *g) {
+  if(planes) {
+    float ax = x->x - q->x, ay = x->y - q->y, az = x->z - q->z;
+    g->x = p1->x - q->x; g->y = p1->y - q->y; g->z = p1->z - q->z;
+    float len = sqrtf(g->x * g->x + g->y * g->y + g->z * g->z);
+    g->x /= len; g->y /= len; g->z /= len;
+    return (ax * ax + ay * ay + az * az - b2) / (2 * len);
+  }
+  float fq = dist3(setup, m, x, q);
+  worley_vec3 gq = dist_gradient3(setup, m, x, q, fq);
+  g->x = gq.x - g1->x; g->y = gq.y - g1->y; g->z = gq.z - g1->z;
+  float len = sqrtf(g->x * g->x + g->y * g->y + g->z * g->z);
+  if(!(len > 0))
+    return FLT_MAX;
+  g->x /= len; g->y /= len; g->z /= len;
+  return (fq - f1) / len;
+}
+
+// Points farther than this from x (as |x - q|^2) can't have a border nearer than best: it is at least
+// (|x - q| - |x - p1|) / 2 away, and for the other measures at least the difference of their distances over the largest
+// length of its gradient, 2 sqrt(dims); these distances are at least |x - q| / sqrt(dims). b is |x - p1|.
+ALWAYS_INLINE float border_limit(int planes, int dims, float b, float f1, float best) {
+  float slack = best > 0 ? best : 0;
+  if(planes) {
+    float l = b + 2 * slack;
+    return l * l * 1.00001f;
+  }
+  float l = f1 + 2 * (dims == 2 ? 1.4142136f : 1.7320508f) * slack;
+  return dims * l * l * 1.00001f;
+}
+
+// The distance from x to the border of the cell of r->p1 (a point of the context's window), negative if x is outside:
+// for the linear measures the exact distance to the nearest bisector, for the others the difference of the two distances
+// over the length of its gradient (exact where the border is straight). normal (may be NULL) gets the direction in which
+// the distance grows; index the window index of p1, -1 if it isn't in the window.
+// The border with F2's cell is usually the nearest; starting with it, most points fail border_limit.
+NOINLINE float cell_border2(const worley_context2 *context, const eval_setup *setup, dist_measure m,
+                            const worley_vec2 *x, const worley_result2 *r, worley_vec2 *normal, int *index) {
+  worley_kernel_measure k = setup_kernel(setup, m);
+  int planes = k == KERNEL_LINEAR || k == KERNEL_LINEAR_SQUARED;
+  const worley_vec2 *p1 = &r->p1;
+  float bu = x->u - p1->u, bv = x->v - p1->v, b2 = bu * bu + bv * bv;
+  float f1 = planes ? 0 : dist2(setup, m, x, p1);
+  worley_vec2 g1 = { 0, 0 }, n = { 0, 0 }, g;
+  if(!planes)
+    g1 = dist_gradient2(setup, m, x, p1, f1);
+
+  float best = FLT_MAX;
+  if(r->p2.u != p1->u || r->p2.v != p1->v) {
+    float d = border2(setup, m, planes, x, p1, b2, f1, &g1, &r->p2, &g);
+    if(d < best) { best = d; n = g; }
+  }
+  float limit = border_limit(planes, 2, sqrtf(b2), f1, best);
+  // the distances in a pass of their own, which vectorizes; few points are left to look at after it
+  float a2[WORLEY_CACHE_PAD2];
+  int size = context->window.size;
+  for(int i = 0; i < size; ++i) {
+    float du = x->u - context->cacheU[i], dv = x->v - context->cacheV[i];
+    a2[i] = du * du + dv * dv;
+  }
+  *index = -1;
+  for(int i = 0; i < size; ++i) {
+    if(a2[i] > limit) // as are the unused slots at infinity
+      continue;
+    worley_vec2 q = { context->cacheU[i], context->cacheV[i] };
+    if(q.u == p1->u && q.v == p1->v) {
+      *index = i;
+      continue;
+    }
+    if(planes && best > 0) {
+      // the bisector is farther than best if (a2 - b2) / (2 len) >= best; no root needed to tell
+      float eu = p1->u - q.u, ev = p1->v - q.v, num = a2[i] - b2;
+      if(num >= 0 && num * num >= 4 * best * best * (eu * eu + ev * ev))
+        continue;
+    }
+    float d = border2(setup, m, planes, x, p1, b2, f1, &g1, &q, &g);
+    if(d < best) {
+      best = d;
+      n = g;
+      limit = border_limit(planes, 2, sqrtf(b2), f1, best);
+    }
+  }
+  if(normal)
+    *normal = n;
+  return best;
+}
+
+NOINLINE float cell_border3(const worley_context3 *context, const eval_setup *setup, dist_measure m,
+                            const worley_vec3 *x, const worley_result3 *r, worley_vec3 *normal, int *index) {
+  worley_kernel_measure k = setup_kernel(setup, m);
+  int planes = k == KERNEL_LINEAR || k == KERNEL_LINEAR_SQUARED;
+  const worley_vec3 *p1 = &r->p1;
+  float bx = x->x - p1->x, by = x->y - p1->y, bz = x->z - p1->z, b2 = bx * bx + by * by + bz * bz;
+  float f1 = planes ? 0 : dist3(setup, m, x, p1);
+  worley_vec3 g1 = { 0, 0, 0 }, n = { 0, 0, 0 }, g;
+  if(!planes)
+    g1 = dist_gradient3(setup, m, x, p1, f1);
+
+  float best = FLT_MAX;
+  if(r->p2.x != p1->x || r->p2.y != p1->y || r->p2.z != p1->z) {
+    float d = border3(setup, m, planes, x, p1, b2, f1, &g1, &r->p2, &g);
+    if(d < best) { best = d; n = g; }
+  }
+  float limit = border_limit(planes, 3, sqrtf(b2), f1, best);
+  float a2[WORLEY_CACHE_PAD3];
+  int size = context->window.size;
+  for(int i = 0; i < size; ++i) {
+    float dx = x->x - context->cacheX[i], dy = x->y - context->cacheY[i], dz = x->z - context->cacheZ[i];
+    a2[i] = dx * dx + dy * dy + dz * dz;
+  }
+  *index = -1;
+  for(int i = 0; i < size; ++i) {
+    if(a2[i] > limit)
+      continue;
+    worley_vec3 q = { context->cacheX[i], context->cacheY[i], context->cacheZ[i] };
+    if(q.x == p1->x && q.y == p1->y && q.z == p1->z) {
+      *index = i;
+      continue;
+    }
+    if(planes && best > 0) {
+      float ex = p1->x - q.x, ey = p1->y - q.y, ez = p1->z - q.z, num = a2[i] - b2;
+      if(num >= 0 && num * num >= 4 * best * best * (ex * ex + ey * ey + ez * ez))
+        continue;
+    }
+    float d = border3(setup, m, planes, x, p1, b2, f1, &g1, &q, &g);
+    if(d < best) {
+      best = d;
+      n = g;
+      limit = border_limit(planes, 3, sqrtf(b2), f1, best);
+    }
+  }
+  if(normal)
+    *normal = n;
+  return best;
+}
+
+// the edge of the gap in the units of gap_size for a distance d to the border of the cell.
+// The gap is measured with the linear measure's scale, so it has the same width for every measure;
+// for the linear measure, it equals the classic test wherever the border with F2's cell is the nearest.
+ALWAYS_INLINE float exact_edge(const eval_setup *setup, float d) {
+  return 2 * d / setup->gap_scale - setup->params->gap_size;
+}
+
+/************* Cell ids *************/
+
+ALWAYS_INLINE uint32_t id_hash(uint32_t v) {
+  uint32_t state = v * 747796405u + 2891336453u;
+  uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+// the cube of a window slot s along one axis, for the window around cube c
+ALWAYS_INLINE int slot_cube(int c, const worley_window *window, int s) {
+  int lo = c - window->radius;
+  return lo + window_slot(s - lo, window->width);
+}
+
+// the window index of p, or -1
+ALWAYS_INLINE int window_index2(const worley_context2 *context, const worley_vec2 *p) {
+  for(int i = 0; i < context->window.size; ++i)
+    if(context->cacheU[i] == p->u && context->cacheV[i] == p->v)
+      return i;
+  return -1;
+}
+
+ALWAYS_INLINE int window_index3(const worley_context3 *context, const worley_vec3 *p) {
+  for(int i = 0; i < context->window.size; ++i)
+    if(context->cacheX[i] == p->x && context->cacheY[i] == p->y && context->cacheZ[i] == p->z)
+      return i;
+  return -1;
+}
+
+// the id of p1, the F1 point of the search at pt: a hash of its cube (with a period, its copy) and its slot in the cube.
+// index is its window index if known, else -1. 0 if there is no point.
+NOINLINE uint32_t cell_id2(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, const worley_vec2 *p1,
+                           int index) {
+  if(index < 0)
+    index = window_index2(context, p1);
+  if(index < 0) {
+    // the window moved on for a jagged gap point
+    worley_cell2 cell = point_cell(pt, setup->gen.cube_dist);
+    update_cache(context, &setup->gen, &cell);
+    index = window_index2(context, p1);
+    if(index < 0)
+      return 0;
+  }
+  const worley_window *window = &context->window;
+  int points = context->cacheGen.points, cube = index / points;
+  int u = worley_wrap_cell(slot_cube(context->cacheCell.u, window, cube % window->width), setup->gen.period);
+  int v = worley_wrap_cell(slot_cube(context->cacheCell.v, window, cube / window->width), setup->gen.period);
+  return id_hash((uint32_t)u ^ id_hash((uint32_t)v ^ id_hash((uint32_t)(index % points) ^ setup->gen.seed)));
+}
+
+NOINLINE uint32_t cell_id3(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, const worley_vec3 *p1,
+                           int index) {
+  if(index < 0)
+    index = window_index3(context, p1);
+  if(index < 0) {
+    worley_cell3 cell = point_cell3(pt, setup->gen.cube_dist);
+    update_cache3(context, &setup->gen, &cell);
+    index = window_index3(context, p1);
+    if(index < 0)
+      return 0;
+  }
+  const worley_window *window = &context->window;
+  int points = context->cacheGen.points, cube = index / points, w = window->width;
+  int x = worley_wrap_cell(slot_cube(context->cacheCell.x, window, cube % w), setup->gen.period);
+  int y = worley_wrap_cell(slot_cube(context->cacheCell.y, window, cube / w % w), setup->gen.period);
+  int z = worley_wrap_cell(slot_cube(context->cacheCell.z, window, cube / (w * w)), setup->gen.period);
+  return id_hash((uint32_t)x ^ id_hash((uint32_t)y ^ id_hash((uint32_t)z ^ id_hash((uint32_t)(index % points) ^ setup->gen.seed))));
+}
+
+/************* Samples *************/
+
+// the gap test and the value of a sample, from the searches at the point (r) and at the point the gap is tested at (gapR)
+ALWAYS_INLINE void sample2_body(const eval_setup *setup, const worley_result2 *r, const worley_result2 *gapR, eval_sample *sample,
+                                dist_measure m, dist_mode mode) {
+  float scale = setup->scale;
+  float s = 1.0;
+  {
+    // based on code from "Advanced Renderman"
+    // this leads to gaps of equal width, in contrast to just simple thresholding of f2 - f1.
+    float scaleFactor = (dist2(setup, m, &gapR->p1, &gapR->p2) * scale) / (gapR->f1 + gapR->f2);
+
+    // FIXME: there may be some adjustment needed for distance measures that are not just dist_linear
+    if(setup->params->gap_size * scaleFactor > gapR->f2 - gapR->f1) //  on left side
+      s = -1.0;
+    if(setup->want_edge)
+      sample->edge = scaleFactor > 0 ? (gapR->f2 - gapR->f1) / scaleFactor - setup->params->gap_size : FLT_MAX;
+  }
+
+  sample->f1 = r->f1 / scale;
+  sample->f2 = r->f2 / scale;
+  sample->f3 = r->f3 / scale;
+  sample->gap = s < 0;
+  sample->value = s * scaling_function(combine(mode, sample->f1, sample->f2, sample->f3));
+}
+
+ALWAYS_INLINE void sample3_body(const eval_setup *setup, const worley_result3 *r, const worley_result3 *gapR, eval_sample *sample,
+                                dist_measure m, dist_mode mode) {
+  float scale = setup->scale;
+  float s = 1.0;
+  {
+    float scaleFactor = (dist3(setup, m, &gapR->p1, &gapR->p2) * scale) / (gapR->f1 + gapR->f2);
+    if(setup->params->gap_size * scaleFactor > gapR->f2 - gapR->f1)
+      s = -1.0;
+    if(setup->want_edge)
+      sample->edge = scaleFactor > 0 ? (gapR->f2 - gapR->f1) / scaleFactor - setup->params->gap_size : FLT_MAX;
+  }
+
+  sample->f1 = r->f1 / scale;
+  sample->f2 = r->f2 / scale;
+  sample->f3 = r->f3 / scale;
+  sample->gap = s < 0;
+  sample->value = s * scaling_function(combine(mode, sample->f1, sample->f2, sample->f3));
+}
+
+// WORLEY_GAP_EXACT: the gap test and the value of a sample from the search at pt (r) alone
+NOINLINE void exact_sample2(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, const worley_result2 *r,
+                            eval_sample *sample, dist_mode mode) {
+  worley_vec2 ptX = setup->params->jagged_gap ? jagged_point2(setup, pt) : *pt;
+  int index;
+  float edge = exact_edge(setup, cell_border2(context, setup, setup->measure, &ptX, r, NULL, &index));
+  float scale = setup->scale;
+  sample->f1 = r->f1 / scale;
+  sample->f2 = r->f2 / scale;
+  sample->f3 = r->f3 / scale;
+  sample->gap = edge < 0;
+  sample->value = (sample->gap ? -1.0f : 1.0f) * scaling_function(combine(mode, sample->f1, sample->f2, sample->f3));
+  sample->edge = edge;
+  if(setup->want_cell)
+    sample->cell = cell_id2(context, setup, pt, &r->p1, index);
+}
+
+NOINLINE void exact_sample3(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, const worley_result3 *r,
+                            eval_sample *sample, dist_mode mode) {
+  worley_vec3 ptX = setup->params->jagged_gap ? jagged_point3(setup, pt) : *pt;
+  int index;
+  float edge = exact_edge(setup, cell_border3(context, setup, setup->measure, &ptX, r, NULL, &index));
+  float scale = setup->scale;
+  sample->f1 = r->f1 / scale;
+  sample->f2 = r->f2 / scale;
+  sample->f3 = r->f3 / scale;
+  sample->gap = edge < 0;
+  sample->value = (sample->gap ? -1.0f : 1.0f) * scaling_function(combine(mode, sample->f1, sample->f2, sample->f3));
+  sample->edge = edge;
+  if(setup->want_cell)
+    sample->cell = cell_id3(context, setup, pt, &r->p1, index);
+}
+
+// the value (and the other outputs) of one sample
+ALWAYS_INLINE void eval2_body(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, eval_sample *sample,
+                              dist_measure m, dist_mode mode) {
+  const eval_searches *searches = &measure_searches[m];
+  const worley_params *params = setup->params;
+  PROFILE_COUNT(context->stats, samples, 1);
+  worley_vec2 wpt;
+  if(setup->weighted) {
+    wpt = weigh2(setup, pt);
+    pt = &wpt;
+  }
+
+  // without jagged edges, the gap is tested at pt itself, so one search does for both
+  worley_result2 r, rX;
+  const worley_result2 *gapR = &r;
+  if(setup->exact_gap) {
+    searches->search2(context, setup, pt, &r);
+    exact_sample2(context, setup, pt, &r, sample, mode);
+    return;
+  }
+  if(params->jagged_gap) {
+    worley_vec2 ptX = jagged_point2(setup, pt);
+    searches->search2_pair(context, setup, pt, &ptX, &r, &rX);
+    gapR = &rX;
+  }
+  else
+    searches->search2(context, setup, pt, &r);
+
+  sample2_body(setup, &r, gapR, sample, m, mode);
+  if(setup->want_cell)
+    sample->cell = cell_id2(context, setup, pt, &r.p1, -1);
+}
+
+// the value (and the other outputs) of one sample
+ALWAYS_INLINE void eval3_body(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, eval_sample *sample,
+                              dist_measure m, dist_mode mode) {
+  const eval_searches *searches = &measure_searches[m];
+  const worley_params *params = setup->params;
+  PROFILE_COUNT(context->stats, samples, 1);
+  worley_vec3 wpt;
+  if(setup->weighted) {
+    wpt = weigh3(setup, pt);
+    pt = &wpt;
+  }
+
+  // without jagged edges, the gap is tested at pt itself, so one search does for both
+  worley_result3 r, rX;
+  const worley_result3 *gapR = &r;
+  if(setup->exact_gap) {
+    searches->search3(context, setup, pt, &r);
+    exact_sample3(context, setup, pt, &r, sample, mode);
+    return;
+  }
+  if(params->jagged_gap) {
+    worley_vec3 ptX = jagged_point3(setup, pt);
+    searches->search3_pair(context, setup, pt, &ptX, &r, &rX);
+    gapR = &rX;
+  }
+  else
+    searches->search3(context, setup, pt, &r);
+
+  sample3_body(setup, &r, gapR, sample, m, mode);
+  if(setup->want_cell)
+    sample->cell = cell_id3(context, setup, pt, &r.p1, -1);
+}
+
+// the distance modes the hot path is generated for, as (name, mode); other is every mode outside the enum
+#define EVAL_MODES(X, NAME, M) \
+  X(NAME, M, f1, DIST_F1) X(NAME, M, f2_m_f1, DIST_F2_M_F1) X(NAME, M, f1_p_f2, DIST_F1_P_F2) \
+  X(NAME, M, f3_m_f2_m_f1, DIST_F3_M_F2_M_F1) X(NAME, M, f1_p_f2_p_f3, DIST_F1_P_F2_P_F3) X(NAME, M, other, (dist_mode)-1)
+
+typedef void (*eval2_fn)(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, eval_sample *sample);
+typedef void (*eval3_fn)(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, eval_sample *sample);
+typedef void (*sample2_fn)(const eval_setup *setup, const worley_result2 *r, const worley_result2 *gapR, eval_sample *sample);
+typedef void (*sample3_fn)(const eval_setup *setup, const worley_result3 *r, const worley_result3 *gapR, eval_sample *sample);
+
+// the evaluation of one sample and the gap test and value from given searches, for one measure and mode
+typedef struct eval_variant {
+  eval2_fn eval2;
+  eval3_fn eval3;
+  sample2_fn sample2;
+  sample3_fn sample3;
+} eval_variant;
+
+// generates the variant of measure M and mode MODE
+#define DEFINE_VARIANT(NAME, M, MODE_NAME, MODE) \
+static void eval2_##NAME##_##MODE_NAME(worley_context2 *context, const eval_setup *setup, const worley_vec2 *pt, eval_sample *sample) { \
+  eval2_body(context, setup, pt, sample, M, MODE); \
+} \
+static void eval3_##NAME##_##MODE_NAME(worley_context3 *context, const eval_setup *setup, const worley_vec3 *pt, eval_sample *sample) { \
+  eval3_body(context, setup, pt, sample, M, MODE); \
+} \
+static void sample2_##NAME##_##MODE_NAME(const eval_setup *setup, const worley_result2 *r, const worley_result2 *gapR, \
+                                         eval_sample *sample) { \
+  sample2_body(setup, r, gapR, sample, M, MODE); \
+} \
+static void sample3_##NAME##_##MODE_NAME(const eval_setup *setup, const worley_result3 *r, const worley_result3 *gapR, \
+                                         eval_sample *sample) { \
+  sample3_body(setup, r, gapR, sample, M, MODE); \
+}
+#define DEFINE_VARIANTS(NAME, M) EVAL_MODES(DEFINE_VARIANT, NAME, M)
+
+EVAL_MEASURES(DEFINE_VARIANTS)
+
+#define VARIANT(NAME, M, MODE_NAME, MODE) \
+  { eval2_##NAME##_##MODE_NAME, eval3_##NAME##_##MODE_NAME, sample2_##NAME##_##MODE_NAME, sample3_##NAME##_##MODE_NAME },
+#define VARIANTS(NAME, M) { EVAL_MODES(VARIANT, NAME, M) },
+
+static const eval_variant variants[5][6] = { EVAL_MEASURES(VARIANTS) };
+
+// Measures outside the enum take Minkowski's variants, like their searches (see searches_of): its distance kernel is
+// the setup's.
+static const eval_variant *variant_of(dist_measure m, dist_mode mode) {
+  int i = m >= DIST_LINEAR && m <= DIST_CHEBYSHEV ? (int)m : DIST_MINKOWSKI;
+  int j = mode >= DIST_F1 && mode <= DIST_F1_P_F2_P_F3 ? (int)mode : 5;
+  return &variants[i][j];
+}
+
+float worleynoise_val(worley_context2 *context, const worley_params *params, const worley_vec2 *pt) {
+  eval_setup setup; eval_sample sample;
+  setup_body(&setup, params, params->distance_measure, 2);
+  setup.variant->eval2(context, &setup, pt, &sample);
+  return sample.value;
+}
+
+float worleynoise3d_val(worley_context3 *context, const worley_params *params, const worley_vec3 *pt) {
+  eval_setup setup; eval_sample sample;
+  setup_body(&setup, params, params->distance_measure, 3);
+  setup.variant->eval3(context, &setup, pt, &sample);
+  return sample.value;
+}
+
+/************* Evaluators *************/
+
+struct worley_evaluator {
+  worley_params params;
+  eval_setup setup; // points at params
+  int dims;
+};
+
+worley_evaluator *worley_evaluator_create(const worley_params *params, int dims) {
+  if(dims != 2 && dims != 3)
+    return NULL;
+  worley_evaluator *eval = malloc(sizeof(worley_evaluator));
+  if(!eval)
+    return NULL;
+  eval->params = *params;
+  eval->dims = dims;
+  setup_body(&eval->setup, &eval->params, params->distance_measure, dims);
+  return eval;
+}
+
+void worley_evaluator_destroy(worley_evaluator *eval) {
+  free(eval);
+}
+
+const worley_params *worley_evaluator_params(const worley_evaluator *eval) {
+  return &eval->params;
+}
+
+float worley_evaluator_val(const worley_evaluator *eval, worley_context2 *context, const worley_vec2 *pt) {
+  eval_sample sample;
+  eval->setup.variant->eval2(context, &eval->setup, pt, &sample);
+  return sample.value;
+}
+
+float worley_evaluator_val3(const worley_evaluator *eval, worley_context3 *context, const worley_vec3 *pt) {
+  eval_sample sample;
+  eval->setup.variant->eval3(context, &eval->setup, pt, &sample);
+  return sample.value;
+}
+
+/************* Batch evaluation *************/
+
+// 0 in the gap, rising smoothly to 1 at bevel_size from its edge
+static float bevel(float edge, float bevel_size) {
+  if(!(bevel_size > 0))
+    return edge >= 0;
+  float t = edge / bevel_size;
+  if(t <= 0) return 0;
+  if(t >= 1) return 1;
+  return t * t * (3 - 2 * t);
+}
+
+// which of the outputs beyond the value the batch needs
+static void batch_wants(eval_setup *setup, const worley_batch_out *out) {
+  setup->want_edge = out->edge || out->bevel;
+  setup->want_cell = out->cell != NULL;
+}
+
+static void batch_store(const eval_setup *setup, const eval_sample *sample, const worley_colors *colors, size_t i,
+                        worley_batch_out *out) {
+  if(out->f1) out->f1[i] = sample->f1;
+  if(out->f2) out->f2[i] = sample->f2;
+  if(out->f3) out->f3[i] = sample->f3;
+  if(out->gap) out->gap[i] = (unsigned char)sample->gap;
+  if(out->value) out->value[i] = sample->value;
+  if(out->color && colors) {
+    if(sample->value < 0)
+      out->color[i] = colors->gap;
+    else
+      grey_to_color(sample->value, &colors->inner, &colors->outer, &out->color[i]);
+  }
+  if(out->edge) out->edge[i] = sample->edge;
+  if(out->bevel) out->bevel[i] = bevel(sample->edge, setup->params->bevel_size);
+  if(out->cell) out->cell[i] = sample->cell;
+}
+
+// the batch from a prepared setup, which it copies to set what it wants
+static void batch2_body(worley_context2 *context, const eval_setup *prepared, const worley_colors *colors,
+                        const worley_vec2 *pts, size_t n, worley_batch_out *out) {
+  eval_setup setup = *prepared;
+  batch_wants(&setup, out);
+  eval2_fn eval = setup.variant->eval2;
+  for(size_t i = 0; i < n; ++i) {
+    eval_sample sample;
+    eval(context, &setup, &pts[i], &sample);
+    batch_store(&setup, &sample, colors, i, out);
+  }
+}
+
+static void batch3_body(worley_context3 *context, const eval_setup *prepared, const worley_colors *colors,
+                        const worley_vec3 *pts, size_t n, worley_batch_out *out) {
+  eval_setup setup = *prepared;
+  batch_wants(&setup, out);
+  eval3_fn eval = setup.variant->eval3;
+  for(size_t i = 0; i < n; ++i) {
+    eval_sample sample;
+    eval(context, &setup, &pts[i], &sample);
+    batch_store(&setup, &sample, colors, i, out);
+  }
+}
+
+void worleynoise_batch(worley_context2 *context, const worley_params *params, const worley_colors *colors,
+                       const worley_vec2 *pts, size_t n, worley_batch_out *out) {
+  eval_setup setup;
+  setup_body(&setup, params, params->distance_measure, 2);
+  batch2_body(context, &setup, colors, pts, n, out);
+}
+
+void worleynoise3d_batch(worley_context3 *context, const worley_params *params, const worley_colors *colors,
+                         const worley_vec3 *pts, size_t n, worley_batch_out *out) {
+  eval_setup setup;
+  setup_body(&setup, params, params->distance_measure, 3);
+  batch3_body(context, &setup, colors, pts, n, out);
+}
+
+void worley_evaluator_batch(const worley_evaluator *eval, worley_context2 *context, const worley_colors *colors,
+                            const worley_vec2 *pts, size_t n, worley_batch_out *out) {
+  batch2_body(context, &eval->setup, colors, pts, n, out);
+}
+
+void worley_evaluator_batch3(const worley_evaluator *eval, worley_context3 *context, const worley_colors *colors,
+                             const worley_vec3 *pts, size_t n, worley_batch_out *out) {
+  batch3_body(context, &eval->setup, colors, pts, n, out);
+}
+
+/************* Packet evaluation *************/
+
+// whether the first count points are all in one cube; if so, that cube goes to cell
+static int packet_cell2(const worley_vec2 *pts, int count, float cube_dist, worley_cell2 *cell) {
+  *cell = point_cell(&pts[0], cube_dist);
+  for(int j = 1; j < count; ++j) {
+    worley_cell2 c = point_cell(&pts[j], cube_dist);
+    if(c.u != cell->u || c.v != cell->v)
+      return 0;
+  }
+  return 1;
+}
+
+static int packet_cell3(const worley_vec3 *pts, int count, float cube_dist, worley_cell3 *cell) {
+  *cell = point_cell3(&pts[0], cube_dist);
+  for(int j = 1; j < count; ++j) {
+    worley_cell3 c = point_cell3(&pts[j], cube_dist);
+    if(c.x != cell->x || c.y != cell->y || c.z != cell->z)
+      return 0;
+  }
+  return 1;
+}
+
+// n (at most WORLEY_PACKET) points in q, which has room for their jagged gap points after them. They are weighed in place.
+// The packet kernels take up to WORLEY_PACKET_LANES = 2 * WORLEY_PACKET points, so both sets fit into one pass.
+static int packet2_body(worley_context2 *context, const eval_setup *setup, worley_vec2 *q, int n, float *values) {
+  // the exact gap test needs no search at the jagged gap points
+  int jagged = setup->params->jagged_gap && !setup->exact_gap, count = jagged ? 2 * n : n;
+  for(int j = 0; setup->weighted && j < n; ++j)
+    q[j] = weigh2(setup, &q[j]);
+  for(int j = 0; jagged && j < n; ++j)
+    q[n + j] = jagged_point2(setup, &q[j]);
+  PROFILE_COUNT(context->stats, samples, n);
+  PROFILE_COUNT(context->stats, jagged_searches, jagged ? n : 0);
+
+  worley_cell2 cell;
+  if(!packet_cell2(q, count, setup->gen.cube_dist, &cell)) {
+    // incoherent: every point on its own, like eval2_body
+    for(int j = 0; j < n; ++j) {
+      worley_result2 r, rX;
+      if(jagged)
+        setup->searches->search2_pair(context, setup, &q[j], &q[n + j], &r, &rX);
+      else
+        setup->searches->search2(context, setup, &q[j], &r);
+      eval_sample sample;
+      if(setup->exact_gap)
+        exact_sample2(context, setup, &q[j], &r, &sample, setup->params->distance_mode);
+      else
+        setup->variant->sample2(setup, &r, jagged ? &rX : &r, &sample);
+      values[j] = sample.value;
+    }
+    return 0;
+  }
+
+  update_cache(context, &setup->gen, &cell);
+  float pu[WORLEY_PACKET_LANES], pv[WORLEY_PACKET_LANES];
+  for(int j = 0; j < WORLEY_PACKET_LANES; ++j) {
+    const worley_vec2 *p = &q[j < count ? j : count - 1];
+    pu[j] = p->u;
+    pv[j] = p->v;
+  }
+  worley_top3 top[WORLEY_PACKET_LANES];
+  PROFILE_START(t);
+  setup->search2_packet(context->cacheU, context->cacheV, context->window.size, setup->power, pu, pv, count, top);
+  PROFILE_STOP(context->stats, search_cycles, t);
+  context->stats.searches += count;
+  context->stats.packet_searches += count;
+  context->stats.cells_visited += count * window_cubes(&context->window, 2);
+  context->stats.points_visited += count * context->window.size;
+
+  for(int j = 0; j < n; ++j) {
+    worley_result2 r, rX;
+    store_result2(context, setup, &top[j], &q[j], &r);
+    PROFILE_COUNT(context->stats, unproven_searches, unproven2(context, setup, &q[j], &cell, top[j].f[2], setup->measure));
+    if(jagged) {
+      store_result2(context, setup, &top[n + j], &q[n + j], &rX);
+      PROFILE_COUNT(context->stats, unproven_searches, unproven2(context, setup, &q[n + j], &cell, top[n + j].f[2], setup->measure));
+    }
+    eval_sample sample;
+    if(setup->exact_gap)
+      exact_sample2(context, setup, &q[j], &r, &sample, setup->params->distance_mode);
+    else
+      setup->variant->sample2(setup, &r, jagged ? &rX : &r, &sample);
+    values[j] = sample.value;
+  }
+  return n;
+}
+
+static int packet3_body(worley_context3 *context, const eval_setup *setup, worley_vec3 *q, int n, float *values) {
+  // the exact gap test needs no search at the jagged gap points
+  int jagged = setup->params->jagged_gap && !setup->exact_gap, count = jagged ? 2 * n : n;
+  for(int j = 0; setup->weighted && j < n; ++j)
+    q[j] = weigh3(setup, &q[j]);
+  for(int j = 0; jagged && j < n; ++j)
+    q[n + j] = jagged_point3(setup, &q[j]);
+  PROFILE_COUNT(context->stats, samples, n);
+  PROFILE_COUNT(context->stats, jagged_searches, jagged ? n : 0);
+
+  worley_cell3 cell;
+  if(!packet_cell3(q, count, setup->gen.cube_dist, &cell)) {
+    for(int j = 0; j < n; ++j) {
+      worley_result3 r, rX;
+      if(jagged)
+        setup->searches->search3_pair(context, setup, &q[j], &q[n + j], &r, &rX);
+      else
+        setup->searches->search3(context, setup, &q[j], &r);
+      eval_sample sample;
+      if(setup->exact_gap)
+        exact_sample3(context, setup, &q[j], &r, &sample, setup->params->distance_mode);
+      else
+        setup->variant->sample3(setup, &r, jagged ? &rX : &r, &sample);
+      values[j] = sample.value;
+    }
+    return 0;
+  }
+
+  update_cache3(context, &setup->gen, &cell);
+  float px[WORLEY_PACKET_LANES], py[WORLEY_PACKET_LANES], pz[WORLEY_PACKET_LANES];
+  for(int j = 0; j < WORLEY_PACKET_LANES; ++j) {
+    const worley_vec3 *p = &q[j < count ? j : count - 1];
+    px[j] = p->x;
+    py[j] = p->y;
+    pz[j] = p->z;
+  }
+  worley_top3 top[WORLEY_PACKET_LANES];
+  PROFILE_START(t);
+  setup->search3_packet(context->cacheX, context->cacheY, context->cacheZ, context->window.size, setup->power, px, py, pz, count, top);
+  PROFILE_STOP(context->stats, search_cycles, t);
+  context->stats.searches += count;
+  context->stats.packet_searches += count;
+  context->stats.cells_visited += count * window_cubes(&context->window, 3);
+  context->stats.points_visited += count * context->window.size;
+
+  for(int j = 0; j < n; ++j) {
+    worley_result3 r, rX;
+    store_result3(context, setup, &top[j], &q[j], &r);
+    PROFILE_COUNT(context->stats, unproven_searches, unproven3(context, setup, &q[j], &cell, top[j].f[2], setup->measure));
+    if(jagged) {
+      store_result3(context, setup, &top[n + j], &q[n + j], &rX);
+      PROFILE_COUNT(context->stats, unproven_searches, unproven3(context, setup, &q[n + j], &cell, top[n + j].f[2], setup->measure));
+    }
+    eval_sample sample;
+    if(setup->exact_gap)
+      exact_sample3(context, setup, &q[j], &r, &sample, setup->params->distance_mode);
+    else
+      setup->variant->sample3(setup, &r, jagged ? &rX : &r, &sample);
+    values[j] = sample.value;
+  }
+  return n;
+}
+
+int worleynoise_packet(worley_context2 *context, const worley_params *params, const worley_vec2 *pts, int n, float *values) {
+  eval_setup setup;
+  setup_body(&setup, params, params->distance_measure, 2);
+  int coherent = 0;
+  for(int i = 0; i < n; i += WORLEY_PACKET) {
+    int k = n - i < WORLEY_PACKET ? n - i : WORLEY_PACKET;
+    worley_vec2 q[2 * WORLEY_PACKET];
+    memcpy(q, pts + i, sizeof(worley_vec2) * k);
+    coherent += packet2_body(context, &setup, q, k, values + i);
+  }
+  return coherent;
+}
+
+int worleynoise3d_packet(worley_context3 *context, const worley_params *params, const float *matrix,
+                         const worley_vec3 *pts, int n, float *values) {
+  eval_setup setup;
+  setup_body(&setup, params, params->distance_measure, 3);
+  int coherent = 0;
+  for(int i = 0; i < n; i += WORLEY_PACKET) {
+    int k = n - i < WORLEY_PACKET ? n - i : WORLEY_PACKET;
+    worley_vec3 q[2 * WORLEY_PACKET];
+    if(matrix) {
+      const float *mt = matrix;
+      for(int j = 0; j < k; ++j) {
+        const worley_vec3 *p = &pts[i + j];
+        q[j].x = p->x * mt[0] + p->y * mt[4] + p->z * mt[8] + mt[12];
+        q[j].y = p->x * mt[1] + p->y * mt[5] + p->z * mt[9] + mt[13];
+        q[j].z = p->x * mt[2] + p->y * mt[6] + p->z * mt[10] + mt[14];
+      }
+    }
+    else
+      memcpy(q, pts + i, sizeof(worley_vec3) * k);
+    coherent += packet3_body(context, &setup, q, k, values + i);
+  }
+  return coherent;
+}
+
+/************* Filtered evaluation *************/
+
+// edge is the signed distance to the gap's edge (negative inside the gap), width how much it changes over the footprint
+static float gap_coverage(float edge, float width) {
+  float h = 0.5f * width;
+  if(!(h > 0))
+    return edge < 0;
+  float t = (h - edge) / (2 * h);
+  if(t <= 0) return 0;
+  if(t >= 1) return 1;
+  return t * t * (3 - 2 * t);
+}
+
+void worleynoise_filtered(worley_context2 *context, const worley_params *params, const worley_vec2 *pt,
+                          const worley_footprint2 *footprint, worley_filtered2 *out) {
+  dist_measure m = params->distance_measure;
+  eval_setup setup;
+  setup_body(&setup, params, m, 2);
+  float scale = setup.scale;
+  PROFILE_COUNT(context->stats, samples, 1);
+  // with axis weights, the search runs at the weighted point over the weighted footprint;
+  // the gradients are taken there and turned back into ones with respect to pt
+  worley_vec2 wpt = weigh2(&setup, pt);
+  worley_footprint2 fp = { weigh2(&setup, &footprint->dx), weigh2(&setup, &footprint->dy) };
+  pt = &wpt;
+  footprint = &fp;
+  const float *w = setup.weights;
+
+  worley_result2 r, rX;
+  const worley_result2 *gapR = &r;
+  worley_vec2 ptX = *pt;
+  if(params->jagged_gap)
+    ptX = jagged_point2(&setup, pt);
+  if(params->jagged_gap && !setup.exact_gap) {
+    setup.searches->search2_pair(context, &setup, pt, &ptX, &r, &rX);
+    gapR = &rX;
+  }
+  else
+    setup.searches->search2(context, &setup, pt, &r);
+
+  worley_vec2 g1 = dist_gradient2(&setup, m, pt, &r.p1, r.f1);
+  worley_vec2 g2 = dist_gradient2(&setup, m, pt, &r.p2, r.f2);
+  worley_vec2 g3 = dist_gradient2(&setup, m, pt, &r.p3, r.f3);
+  out->f1 = r.f1 / scale; out->df1.u = g1.u * w[0] / scale; out->df1.v = g1.v * w[1] / scale;
+  out->f2 = r.f2 / scale; out->df2.u = g2.u * w[0] / scale; out->df2.v = g2.v * w[1] / scale;
+  out->f3 = r.f3 / scale; out->df3.u = g3.u * w[0] / scale; out->df3.v = g3.v * w[1] / scale;
+  out->value = scaling_function(worley_combine(params->distance_mode, out->f1, out->f2, out->f3));
+
+  if(setup.exact_gap) {
+    // the distance to the border grows by one along its normal, the edge by two
+    worley_vec2 n;
+    int index;
+    float edge = exact_edge(&setup, cell_border2(context, &setup, m, &ptX, &r, &n, &index)) * setup.gap_scale;
+    float width = 2 * (fabsf(n.u * footprint->dx.u + n.v * footprint->dx.v) + fabsf(n.u * footprint->dy.u + n.v * footprint->dy.v));
+    out->gap_coverage = gap_coverage(edge, width);
+    out->gap_edge = edge / scale;
+    return;
+  }
+
+  // the same gap test as in eval2_body, but as a distance to the edge.
+  // Its change over the footprint comes from the gradient of f2 - f1 (the jagging and scaleFactor are taken as constant).
+  float scaleFactor = (dist2(&setup, m, &gapR->p1, &gapR->p2) * scale) / (gapR->f1 + gapR->f2);
+  float edge = (gapR->f2 - gapR->f1) - params->gap_size * scaleFactor;
+  worley_vec2 gX1 = dist_gradient2(&setup, m, &ptX, &gapR->p1, gapR->f1);
+  worley_vec2 gX2 = dist_gradient2(&setup, m, &ptX, &gapR->p2, gapR->f2);
+  worley_vec2 ge = { gX2.u - gX1.u, gX2.v - gX1.v };
+  float width = fabsf(ge.u * footprint->dx.u + ge.v * footprint->dx.v) + fabsf(ge.u * footprint->dy.u + ge.v * footprint->dy.v);
+  out->gap_coverage = gap_coverage(edge, width);
+  out->gap_edge = edge / scale;
+}
+
+void worleynoise3d_filtered(worley_context3 *context, const worley_params *params, const worley_vec3 *pt,
+                            const worley_footprint3 *footprint, worley_filtered3 *out) {
+  dist_measure m = params->distance_measure;
+  eval_setup setup;
+  setup_body(&setup, params, m, 3);
+  float scale = setup.scale;
+  PROFILE_COUNT(context->stats, samples, 1);
+  worley_vec3 wpt = weigh3(&setup, pt);
+  worley_footprint3 fp = { weigh3(&setup, &footprint->dx), weigh3(&setup, &footprint->dy) };
+  pt = &wpt;
+  footprint = &fp;
+  const float *w = setup.weights;
+
+  worley_result3 r, rX;
+  const worley_result3 *gapR = &r;
+  worley_vec3 ptX = *pt;
+  if(params->jagged_gap)
+    ptX = jagged_point3(&setup, pt);
+  if(params->jagged_gap && !setup.exact_gap) {
+    setup.searches->search3_pair(context, &setup, pt, &ptX, &r, &rX);
+    gapR = &rX;
+  }
+  else
+    setup.searches->search3(context, &setup, pt, &r);
+
+  worley_vec3 g1 = dist_gradient3(&setup, m, pt, &r.p1, r.f1);
+  worley_vec3 g2 = dist_gradient3(&setup, m, pt, &r.p2, r.f2);
+  worley_vec3 g3 = dist_gradient3(&setup, m, pt, &r.p3, r.f3);
+  out->f1 = r.f1 / scale; out->df1.x = g1.x * w[0] / scale; out->df1.y = g1.y * w[1] / scale; out->df1.z = g1.z * w[2] / scale;
+  out->f2 = r.f2 / scale; out->df2.x = g2.x * w[0] / scale; out->df2.y = g2.y * w[1] / scale; out->df2.z = g2.z * w[2] / scale;
+  out->f3 = r.f3 / scale; out->df3.x = g3.x * w[0] / scale; out->df3.y = g3.y * w[1] / scale; out->df3.z = g3.z * w[2] / scale;
+  out->value = scaling_function(worley_combine(params->distance_mode, out->f1, out->f2, out->f3));
+
+  if(setup.exact_gap) {
+    worley_vec3 n;
+    int index;
+    float edge = exact_edge(&setup, cell_border3(context, &setup, m, &ptX, &r, &n, &index)) * setup.gap_scale;
+    float width = 2 * (fabsf(n.x * footprint->dx.x + n.y * footprint->dx.y + n.z * footprint->dx.z)
+                     + fabsf(n.x * footprint->dy.x + n.y * footprint->dy.y + n.z * footprint->dy.z));
+    out->gap_coverage = gap_coverage(edge, width);
+    out->gap_edge = edge / scale;
+    return;
+  }
+
+  float scaleFactor = (dist3(&setup, m, &gapR->p1, &gapR->p2) * scale) / (gapR->f1 + gapR->f2);
+  float edge = (gapR->f2 - gapR->f1) - params->gap_size * scaleFactor;
+  worley_vec3 gX1 = dist_gradient3(&setup, m, &ptX, &gapR->p1, gapR->f1);
+  worley_vec3 gX2 = dist_gradient3(&setup, m, &ptX, &gapR->p2, gapR->f2);
+  worley_vec3 ge = { gX2.x - gX1.x, gX2.y - gX1.y, gX2.z - gX1.z };
+  float width = fabsf(ge.x * footprint->dx.x + ge.y * footprint->dx.y + ge.z * footprint->dx.z)
+              + fabsf(ge.x * footprint->dy.x + ge.y * footprint->dy.y + ge.z * footprint->dy.z);
+  out->gap_coverage = gap_coverage(edge, width);
+  out->gap_edge = edge / scale;
+}
+
+void worley_filtered_color(float value, float gap_coverage, const worley_colors *colors, worley_color *result) {
+  worley_color c;
+  grey_to_color(value, &colors->inner, &colors->outer, &c);
+  grey_to_color(gap_coverage, &c, &colors->gap, result);
+}
+
+/************* Fractal evaluation *************/
+
+void worley_fractal_default(worley_fractal *fractal, dist_mode mode) {
+  fractal->octaves = 1;
+  fractal->lacunarity = 2;
+  fractal->gain = 0.5f;
+  for(int i = 0; i < WORLEY_MAX_OCTAVES; ++i)
+    fractal->modes[i] = mode;
+  fractal->threshold = 1.0f / 512;
+}
+
+// Every octave has its own context, so each keeps its window of cubes from sample to sample.
+// They sample the same pattern (only at different points), so they can share one cell cache.
+
+// where octave i samples the pattern, in cubes: shifted, so the octaves don't line up at the origin
+static const float octave_shift[WORLEY_MAX_OCTAVES][3] = {
+  { 0, 0, 0 }, { 17.31f, 5.79f, 11.17f }, { 3.53f, 23.89f, 7.41f }, { 29.13f, 13.67f, 2.29f },
+  { 7.97f, 31.43f, 19.61f }, { 23.11f, 2.83f, 37.37f }, { 11.59f, 19.07f, 29.71f }, { 37.19f, 29.53f, 3.07f }
+};
+
+// the weights of the octaves after the first, already faded by the footprint. Returns the number of octaves to evaluate.
+static int octave_weights(const worley_fractal *fractal, float cube_dist, float footprint, float *weights) {
+  int octaves = fractal->octaves < 1 ? 1 : (fractal->octaves > WORLEY_MAX_OCTAVES ? WORLEY_MAX_OCTAVES : fractal->octaves);
+  float amp = 1, size = cube_dist;
+  weights[0] = 1;
+  for(int i = 1; i < octaves; ++i) {
+    amp *= fractal->gain;
+    size /= fractal->lacunarity;
+    float fade = footprint > 0 ? size / footprint - 1 : 1;
+    if(fade <= 0)
+      return i;
+    weights[i] = amp * (fade < 1 ? fade : 1);
+  }
+  return octaves;
+}
+
+float worleynoise_fractal(worley_context2 *contexts, const worley_params *params, const worley_fractal *fractal,
+                          const worley_vec2 *pt, float footprint) {
+  dist_measure m = params->distance_measure;
+  eval_setup setup;
+  setup_body(&setup, params, m, 2);
+  float weights[WORLEY_MAX_OCTAVES];
+  int octaves = octave_weights(fractal, setup.gen.cube_dist, footprint, weights);
+
+  eval_sample sample;
+  variant_of(m, fractal->modes[0])->eval2(&contexts[0], &setup, pt, &sample);
+  if(octaves == 1)
+    return sample.value;
+  float rest = 0;
+  for(int i = 1; i < octaves; ++i)
+    rest += weights[i];
+
+  worley_vec2 wpt = weigh2(&setup, pt); // the variant weighs its point itself
+  float sum = fabsf(sample.value), total = 1, freq = 1;
+  for(int i = 1; i < octaves; ++i) {
+    // the remaining octaves move the average by at most rest / (total + rest)
+    if(rest < fractal->threshold * (total + rest))
+      break;
+    freq *= fractal->lacunarity;
+    worley_vec2 pti = { wpt.u * freq + octave_shift[i][0] * setup.gen.cube_dist,
+                        wpt.v * freq + octave_shift[i][1] * setup.gen.cube_dist };
+    worley_result2 r;
+    setup.searches->search2(&contexts[i], &setup, &pti, &r);
+    sum += weights[i] * scaling_function(worley_combine(fractal->modes[i], r.f1 / setup.scale, r.f2 / setup.scale, r.f3 / setup.scale));
+    total += weights[i];
+    rest -= weights[i];
+  }
+  return sample.gap ? -sum / total : sum / total;
+}
+
+float worleynoise3d_fractal(worley_context3 *contexts, const worley_params *params, const worley_fractal *fractal,
+                            const worley_vec3 *pt, float footprint) {
+  dist_measure m = params->distance_measure;
+  eval_setup setup;
+  setup_body(&setup, params, m, 3);
+  float weights[WORLEY_MAX_OCTAVES];
+  int octaves = octave_weights(fractal, setup.gen.cube_dist, footprint, weights);
+
+  eval_sample sample;
+  variant_of(m, fractal->modes[0])->eval3(&contexts[0], &setup, pt, &sample);
+  if(octaves == 1)
+    return sample.value;
+  float rest = 0;
+  for(int i = 1; i < octaves; ++i)
+    rest += weights[i];
+
+  worley_vec3 wpt = weigh3(&setup, pt);
+  float sum = fabsf(sample.value), total = 1, freq = 1;
+  for(int i = 1; i < octaves; ++i) {
+    if(rest < fractal->threshold * (total + rest))
+      break;
+    freq *= fractal->lacunarity;
+    worley_vec3 pti = { wpt.x * freq + octave_shift[i][0] * setup.gen.cube_dist,
+                        wpt.y * freq + octave_shift[i][1] * setup.gen.cube_dist,
+                        wpt.z * freq + octave_shift[i][2] * setup.gen.cube_dist };
+    worley_result3 r;
+    setup.searches->search3(&contexts[i], &setup, &pti, &r);
+    sum += weights[i] * scaling_function(worley_combine(fractal->modes[i], r.f1 / setup.scale, r.f2 / setup.scale, r.f3 / setup.scale));
+    total += weights[i];
+    rest -= weights[i];
+  }
+  return sample.gap ? -sum / total : sum / total;
+}
+
+/************* Shading *************/
+
+void grey_to_color(float val, const worley_color *color1, const worley_color *color2, worley_color *result) {
+  result->r = color1->r * (1 - val) + color2->r * val;
+  result->g = color1->g * (1 - val) + color2->g * val;
+  result->b = color1->b * (1 - val) + color2->b * val;
+  result->a = color1->a * (1 - val) + color2->a * val;
+}
+
+// scales its positive input (which should already be approximately between 0 and 1) to the interval [0, 1)
+// it is a tuned logistic sigmoid function
+float scaling_function(float x) {
+  return 2 * (1 / (1 + expf((-1) * (3*x))) - 0.5);
+}
@@ -0,0 +1,604 @@
+/*
+ * Renderer-independent core of the Worley noise shaders.
+ *
+ * Everything in here is plain C99 and does not depend on mental ray's shader.h,
+ * so the noise can be built, profiled and baked without a renderer.
+ * The mental ray shaders (texture_worleynoise.c, texture_worleynoise3d.c) are thin adapters over it.
+ */
+
+#ifndef WORLEY_H
+#define WORLEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************* Types *************/
+
+// layout-compatible with miVector2d, miVector and miColor
+typedef struct { float u, v; } worley_vec2;
+typedef struct { float x, y, z; } worley_vec3;
+typedef struct { float r, g, b, a; } worley_color;
+
+/************* Distance measures *************/
+
+typedef enum dist_measure {
+  DIST_LINEAR = 0
+, DIST_LINEAR_SQUARED = 1
+, DIST_MANHATTAN = 2
+, DIST_MINKOWSKI = 3 // (|dx|^p + |dy|^p + |dz|^p)^(1/p), p = worley_params.minkowski_p
+, DIST_CHEBYSHEV = 4 // max(|dx|, |dy|, |dz|)
+} dist_measure;
+
+typedef enum dist_mode {
+  DIST_F1 = 0 // f1
+, DIST_F2_M_F1 = 1 // f2 - f1,
+, DIST_F1_P_F2 = 2 // (2 * f1 + f2) / 3,
+, DIST_F3_M_F2_M_F1 = 3 // (2 * f3 - f2 - f1) / 2,
+, DIST_F1_P_F2_P_F3 = 4 // (0.5 * f1 + 0.33 * f2 + (1 - 0.5 - 0.33) * f3)
+} dist_mode;
+
+float dist_linear_squared(const worley_vec2 *v1, const worley_vec2 *v2);
+float dist_linear(const worley_vec2 *v1, const worley_vec2 *v2);
+float dist_manhattan(const worley_vec2 *v1, const worley_vec2 *v2);
+
+float dist_linear_squared3(const worley_vec3 *v1, const worley_vec3 *v2);
+float dist_linear3(const worley_vec3 *v1, const worley_vec3 *v2);
+float dist_manhattan3(const worley_vec3 *v1, const worley_vec3 *v2);
+
+float dist_chebyshev(const worley_vec2 *v1, const worley_vec2 *v2);
+float dist_chebyshev3(const worley_vec3 *v1, const worley_vec3 *v2);
+
+// powf per component; the searches only take the root of the three nearest (see worley_params.minkowski_p)
+float dist_minkowski(float p, const worley_vec2 *v1, const worley_vec2 *v2);
+float dist_minkowski3(float p, const worley_vec3 *v1, const worley_vec3 *v2);
+
+// DIST_MINKOWSKI: the entry for p = 2; see worley_minkowski_scale for the others
+float dist_scale(dist_measure m);
+// between the manhattan (p = 1), linear (p = 2) and chebyshev (p = infinity) scales, linear in 1/p
+float worley_minkowski_scale(float p);
+
+// -1 for DIST_MINKOWSKI, which needs p
+float distance(dist_measure distance_measure, const worley_vec2 *v1, const worley_vec2 *v2);
+float distance3(dist_measure distance_measure, const worley_vec3 *v1, const worley_vec3 *v2);
+
+/************* Noise sources *************/
+
+// The feature points of a cube and the jagged gap offsets are seeded from a scalar noise.
+// The mental ray adapters plug in mi_unoise_2d/mi_noise_2d/mi_unoise_3d here (to keep the look of existing scenes),
+// standalone users get worley_default_noise, a hashed value noise.
+// All functions return values in [0,1].
+typedef struct worley_noise {
+  float (*unoise2)(float u, float v);
+  float (*noise2)(float u, float v);
+  float (*unoise3)(const worley_vec3 *p);
+  const char *name; // tells noise sources apart across processes (see the tile cache)
+} worley_noise;
+
+extern const worley_noise worley_default_noise;
+
+float worley_value_noise2(float u, float v);
+float worley_value_noise3(const worley_vec3 *p);
+
+/************* Parameters *************/
+
+// how the F1/F2/F3 search visits the cubes around a point
+typedef enum worley_search {
+  WORLEY_SEARCH_FULL = 0,    // all 3^DIMENSIONS cubes, vectorized
+  WORLEY_SEARCH_PRUNED = 1,  // the home cube first, then the others by their smallest possible distance; stops once that exceeds f3
+  WORLEY_SEARCH_SEPARATE = 2 // as FULL, but the jagged gap point gets a search of its own instead of sharing the sample's pass
+                             // over the window; only there to check that pass against (see worley_regress check)
+} worley_search;
+
+// where the feature points of a cube come from
+typedef enum worley_point_gen {
+  WORLEY_GEN_NOISE = 0, // seeded from the noise source (mi_unoise_* in mental ray); the look of existing scenes
+  WORLEY_GEN_HASH = 1   // an integer hash of the cube coordinates. Much faster and better distributed.
+} worley_point_gen;
+
+// how a sample is found to be in the gap between two cells
+typedef enum worley_gap_test {
+  // from F1, F2 and the distance between their points, after "Advanced RenderMan". The gap is only even for the linear
+  // measures, and a jagged gap takes a second search at the jagged point. The look of existing scenes.
+  WORLEY_GAP_CLASSIC = 0,
+  // the distance to the border of F1's cell, against all points of the window the search used; no second search.
+  // Exact (the nearest bisector) for the linear measures, to first order for the others, so the gap has the same width
+  // for every measure. A jagged gap moves the border of the sample's cell by the jagging.
+  WORLEY_GAP_EXACT = 1
+} worley_gap_test;
+
+// the resolved (i.e already evaluated) shader parameters.
+typedef struct worley_params {
+  dist_measure distance_measure;
+  dist_mode distance_mode;
+  float scale;
+  float scaleX; // only used in 3D; 1 for no anisotropy
+  float gap_size;
+  int jagged_gap;
+  const worley_noise *noise; // NULL for worley_default_noise
+  worley_point_gen point_gen;
+  unsigned int seed;   // WORLEY_GEN_HASH only
+  float poisson_mean;  // WORLEY_GEN_HASH only: > 0 for Poisson distributed points per cube, see worley_poisson_valid
+  worley_search search;
+  int period; // if > 0, the feature points repeat every period cubes in every direction (for tileable textures)
+  // The grid the feature points are generated in (see worley_cube_dist). The defaults give the classic pattern.
+  float density;       // mean feature points per CUBE_DIST * scale cube; 0 for PTS_PER_CUBE. The values keep their range.
+  int points_per_cube; // feature points per grid cube, 1 to PTS_PER_CUBE; 0 for PTS_PER_CUBE
+  // DIST_MINKOWSKI: p >= 1. 1, 2 and infinity are the manhattan, linear and chebyshev searches. Other p rank the points
+  // by sums of powers and take the root of the three nearest only: an integer p by repeated multiplies,
+  // any other p with a powf per coordinate and point (about 1.5 and 15 times the time of linear distance).
+  // p is clamped to WORLEY_MINKOWSKI_MAX (but infinity), as higher powers of small distances underflow.
+  float minkowski_p;
+  // Per-axis weights of the distance measure (the 2D pattern uses the first two); 1, 1, 1 for none.
+  // Cells get longer along the axes with smaller weights. The weights are normalized to a product of 1,
+  // so the density of the pattern stays the same. Applied to the sample point before the search,
+  // so all measures, searches and kernels support them at the cost of a multiply per axis.
+  float axis_weights[3];
+  worley_gap_test gap_test;
+  float bevel_size; // the width of the bevel output of worleynoise_batch next to the gap, in the units of gap_size
+} worley_params;
+
+#define WORLEY_MINKOWSKI_MAX 8 // the largest finite minkowski_p
+
+void worley_params_default(worley_params *params);
+
+// The cube size follows from the density and the points per cube: CUBE_DIST * scale * (points_per_cube / density)^(1/dims).
+// Fewer points per cube mean smaller cubes for the same pattern density, so the search looks at fewer points:
+// 27 with 3 per cube instead of 36 in 2D, 54 with 2 per cube instead of 108 in 3D.
+// The search looks at the cubes within worley_window_radius of the point's cube. It is exact whenever F3 is at most the
+// distance from the point to the border of that window, which is at least radius * the cube size.
+// The radius is picked so that this holds for all but a tiny fraction of points: for uniform points and linear distance,
+// the 3^dims window misses one of the 3 nearest points for 1 in 240 points in 2D (1 in 2800 in 3D) with one point per cube,
+// 1 in 200000 in 2D with two, and was never seen to with more in 4 * 10^5 samples. Manhattan distances reach farther:
+// in 3D, the 3^3 window misses 1 in 500 points with two points per cube (1 in 5000 to 10000 with three or four, as always).
+// So one point per cube, two in 2D and two in 3D with manhattan distance use a 5^dims window.
+// Minkowski distances are taken as manhattan ones; chebyshev distances never exceed the linear ones.
+// The radius goes by the fewest points a cube can have (worley_min_cube_points): Poisson distributed cubes may hold
+// only one, so they always get the 5^dims window.
+// WORLEY_PROFILE builds count the searches the bound doesn't cover (unproven_searches).
+int worley_cube_points(const worley_params *params);
+int worley_min_cube_points(const worley_params *params);
+float worley_cube_dist(const worley_params *params, int dims);
+int worley_window_radius(int min_points, int dims, dist_measure measure);
+
+// With WORLEY_GEN_HASH and poisson_mean > 0, the number of points of each cube is drawn from a Poisson distribution
+// of that mean, truncated to 1 to worley_cube_points (the slots a cube has). So the actual mean is below poisson_mean,
+// markedly so as it nears the cap, and larger means hardly differ: they are rejected as parameters.
+// Returns whether poisson_mean is 0 or in (0, worley_cube_points].
+int worley_poisson_valid(const worley_params *params);
+
+/************* Cache *************/
+
+#define PTS_PER_CUBE 4 // at most, see worley_params.points_per_cube
+#define CUBE_DIST 0.05
+
+// room for the largest window: 5^dims cubes of PTS_PER_CUBE points (Poisson distributed points, see worley_window_radius),
+// padded to a multiple of the widest vector (16 floats) with points at infinity
+#define WORLEY_CACHE_PAD2 112
+#define WORLEY_CACHE_PAD3 512
+
+#if defined(__GNUC__) || defined(__clang__)
+#define WORLEY_ALIGNED __attribute__((aligned(64)))
+#else
+#define WORLEY_ALIGNED
+#endif
+
+// integer cube coordinates; cube (x, y, z) covers [x, x+1) * cube_dist and so on
+typedef struct { int u, v; } worley_cell2;
+typedef struct { int x, y, z; } worley_cell3;
+
+// everything the feature points of a cube depend on, besides its coordinates
+typedef struct worley_generator {
+  worley_point_gen point_gen;
+  const worley_noise *noise;
+  unsigned int seed;
+  float poisson_mean;
+  float cube_dist;
+  int period;
+  int points; // per cube, 1 to PTS_PER_CUBE
+  dist_measure measure; // only picks the window around the cube (see worley_window_radius), not compared by worley_generator_equal
+} worley_generator;
+
+void worley_generator_init(worley_generator *gen, const worley_params *params, float cube_dist);
+int worley_generator_equal(const worley_generator *a, const worley_generator *b);
+
+typedef struct worley_cache_stats {
+  unsigned long long cells_generated; // cubes whose points had to be computed
+  unsigned long long cells_reused;    // cubes kept from the previous window when the window moved
+  unsigned long long cells_cached;    // cubes found in the context's cell cache (hits; misses are cells_generated)
+  unsigned long long searches;        // F1/F2/F3 searches
+  unsigned long long cells_visited;   // cubes looked at by the searches
+  unsigned long long points_visited;  // feature points whose distance the searches computed
+  unsigned long long packet_searches; // searches done in a shared pass of a coherent packet (see worleynoise3d_packet)
+  // only counted if the core is built with WORLEY_PROFILE (see worley_profiled), 0 otherwise
+  unsigned long long samples;         // evaluations (single, batch, filtered or the first octave of a fractal)
+  unsigned long long jagged_searches; // second searches for the jagged gap point
+  unsigned long long search_cycles;   // clock ticks spent in the searches, without the window updates
+  unsigned long long generate_cycles; // clock ticks spent generating cubes
+  unsigned long long unproven_searches; // searches whose F3 reached past the window (see worley_window_radius)
+} worley_cache_stats;
+
+// fraction of the cubes entering the window that came from the cell cache
+double worley_cell_cache_hit_rate(const worley_cache_stats *stats);
+
+// adds the counters of stats to total, e.g to sum up the contexts of all threads
+void worley_cache_stats_add(worley_cache_stats *total, const worley_cache_stats *stats);
+
+// the clock the cycle counters use if the core was built with WORLEY_PROFILE ("tsc", "cntvct" or "clock"), NULL otherwise
+const char *worley_profiled(void);
+
+// Writes stats as one JSON object into buf (like snprintf: returns the length it needs, writes at most size bytes).
+int worley_cache_stats_json(const worley_cache_stats *stats, char *buf, size_t size);
+
+// Cache of recently generated cubes, shared by the window updates of one context.
+// It is flushed when the generator (e.g the scale) changes.
+// The contexts of one thread may share one if they use the same generator (see worleynoise_fractal); never share one between threads.
+typedef struct worley_cell_cache worley_cell_cache;
+
+// How a cell cache stores the points. The compact formats keep every coordinate as a fixed point offset
+// in its cube and decode it when the cube enters a context's window, so the values change slightly
+// (worley_bench cells=16 or cells=8 reports by how much). Only the cell cache shrinks: the window and the searches
+// stay in float, so the memory the searches run over is the same in every format.
+// The sizes are per cube, with its coordinates and its LRU stamp.
+typedef enum worley_cell_format {
+  WORLEY_CELLS_FLOAT = 0, // the points as generated, 60 bytes per cube. Results equal those without a cell cache.
+  WORLEY_CELLS_16 = 1,    // 16 bit offsets, 36 bytes per cube; off by at most 1/131070 of a cube per coordinate
+  WORLEY_CELLS_8 = 2      // 8 bit offsets, 28 bytes per cube; off by at most 1/510 of a cube per coordinate
+} worley_cell_format;
+
+// capacity is the number of cubes (rounded up to a power of two, at least 4)
+worley_cell_cache *worley_cell_cache_create(size_t capacity, worley_cell_format format);
+void worley_cell_cache_destroy(worley_cell_cache *cache);
+size_t worley_cell_cache_capacity(const worley_cell_cache *cache);
+// the memory the cache takes, in bytes
+size_t worley_cell_cache_bytes(const worley_cell_cache *cache);
+// the memory a cube takes in a cache of the format, in bytes
+size_t worley_cell_format_bytes(worley_cell_format format);
+void worley_cell_cache_clear(worley_cell_cache *cache);
+
+// per-thread state. Never share a context between threads.
+// The points of the window of cubes around cacheCell (3 or 5 cubes wide, see worley_window_radius) are stored
+// in structure-of-arrays form for the search kernels, cacheGen.points per cube.
+// A cube is stored in the slot given by its coordinates modulo the window width, so when the window moves,
+// the cubes it still covers stay where they are and only the newly exposed cubes are generated.
+typedef struct worley_window {
+  int radius; // cubes on each side of the center cube
+  int width;  // 2 * radius + 1
+  int size;   // points in the window
+  int padded; // size rounded up for the kernels; the points in between are at infinity
+} worley_window;
+
+typedef struct worley_context2 {
+  int cache_initialized;
+  worley_cell2 cacheCell; // the "center" cube of the cache
+  worley_generator cacheGen; // what the cache was built with
+  worley_window window;      // its layout, which follows from cacheGen
+  worley_cache_stats stats;
+  worley_cell_cache *cells; // optional, NULL by default. Owned by the caller.
+  float cacheU[WORLEY_CACHE_PAD2] WORLEY_ALIGNED;
+  float cacheV[WORLEY_CACHE_PAD2] WORLEY_ALIGNED;
+} worley_context2;
+
+typedef struct worley_context3 {
+  int cache_initialized;
+  worley_cell3 cacheCell; // the "center" cube of the cache
+  worley_generator cacheGen; // what the cache was built with
+  worley_window window;      // its layout, which follows from cacheGen
+  worley_cache_stats stats;
+  worley_cell_cache *cells; // optional, NULL by default. Owned by the caller.
+  float cacheX[WORLEY_CACHE_PAD3] WORLEY_ALIGNED;
+  float cacheY[WORLEY_CACHE_PAD3] WORLEY_ALIGNED;
+  float cacheZ[WORLEY_CACHE_PAD3] WORLEY_ALIGNED;
+} worley_context3;
+
+void worley_context2_init(worley_context2 *context);
+void worley_context3_init(worley_context3 *context);
+
+// Contexts for a known number of threads, allocated up front in one block, e.g at shader instance init.
+// Every slot holds `contexts` contexts (e.g one per octave for worleynoise_fractal) of one dimension, sharing one
+// cell cache of cell_cache_size cubes (0 for none) in cell_format. Slots and cell caches start on their own cache lines,
+// so threads never share a line. Works with any threads: index slots by thread number, or claim them.
+typedef struct worley_context_pool worley_context_pool;
+
+// Returns NULL for unusable arguments or when out of memory.
+worley_context_pool *worley_context_pool_create(int slots, int dims, int contexts, size_t cell_cache_size,
+                                                worley_cell_format cell_format);
+void worley_context_pool_destroy(worley_context_pool *pool);
+int worley_context_pool_slots(const worley_context_pool *pool);
+
+// the contexts of a slot, or NULL if the slot is out of range or the pool has the other dimension.
+// A slot must only be used by one thread at a time.
+worley_context2 *worley_context_pool_get2(worley_context_pool *pool, int slot);
+worley_context3 *worley_context_pool_get3(worley_context_pool *pool, int slot);
+
+// for threads without a number: hands out every slot once, lock-free. Returns -1 once all slots are taken.
+int worley_context_pool_claim(worley_context_pool *pool);
+
+// the stats of all contexts of the pool, summed up
+void worley_context_pool_stats(const worley_context_pool *pool, worley_cache_stats *total);
+
+// the origin of the cube a point is in
+worley_vec2 point_cube(const worley_vec2 *pt, float cube_dist);
+worley_vec3 point_cube3(const worley_vec3 *pt, float cube_dist);
+
+// the cube a point is in
+worley_cell2 point_cell(const worley_vec2 *pt, float cube_dist);
+worley_cell3 point_cell3(const worley_vec3 *pt, float cube_dist);
+
+// the feature points of one cube, in PTS_PER_CUBE slots. Unused slots (see points and poisson_mean) are at infinity.
+void generate_cell(const worley_generator *gen, const worley_cell2 *cell, float *us, float *vs);
+void generate_cell3(const worley_generator *gen, const worley_cell3 *cell, float *xs, float *ys, float *zs);
+
+// the cube whose random numbers cube coordinate c uses: c itself, or with a period, its copy in [0, period)
+int worley_wrap_cell(int c, int period);
+
+// WORLEY_GEN_HASH points of n cubes; cube j goes to index j * PTS_PER_CUBE
+void worley_hash_cells(const worley_cell2 *cells, int n, const worley_generator *gen, float *us, float *vs);
+void worley_hash_cells3(const worley_cell3 *cells, int n, const worley_generator *gen, float *xs, float *ys, float *zs);
+
+void update_cache(worley_context2 *context, const worley_generator *gen, const worley_cell2 *cell);
+void update_cache3(worley_context3 *context, const worley_generator *gen, const worley_cell3 *cell);
+
+/************* Evaluation *************/
+
+// The F1/F2/F3 search runs on AVX-512, AVX2, SSE4.1 or plain scalar code, whatever the CPU supports.
+// All of them give identical results. The environment variable WORLEY_ISA (scalar, sse, avx2, avx512) overrides the choice.
+const char *worley_isa(void);
+// selects the kernels for an instruction set (NULL for the best one). Returns 0 if the CPU doesn't support it.
+int worley_set_isa(const char *isa);
+
+// the three closest feature points and the distances to them
+typedef struct worley_result2 {
+  float f1, f2, f3;
+  worley_vec2 p1, p2, p3;
+} worley_result2;
+
+typedef struct worley_result3 {
+  float f1, f2, f3;
+  worley_vec3 p1, p2, p3;
+} worley_result3;
+
+void point_distances(worley_context2 *context, const worley_params *params,
+                     const worley_vec2 *pt, worley_result2 *result);
+void point_distances3(worley_context3 *context, const worley_params *params,
+                      const worley_vec3 *pt, worley_result3 *result);
+
+// combines f1, f2 and f3 according to the distance mode
+float worley_combine(dist_mode mode, float f1, float f2, float f3);
+
+// compute the value (between 0 and 1) for the given point. If the point is in the gap between two cells, returns the negative value
+float worleynoise_val(worley_context2 *context, const worley_params *params, const worley_vec2 *pt);
+float worleynoise3d_val(worley_context3 *context, const worley_params *params, const worley_vec3 *pt);
+
+// Parameters prepared for evaluation once, e.g. at shader instance init: worleynoise_val works out the cube size,
+// kernels and weights and picks the evaluation for the distance measure and mode on every call, the evaluator
+// when it is created. It keeps a copy of the parameters and is only read when evaluating, so threads can share it.
+typedef struct worley_evaluator worley_evaluator;
+
+// dims is 2 or 3; returns NULL for other dims or when out of memory
+worley_evaluator *worley_evaluator_create(const worley_params *params, int dims);
+void worley_evaluator_destroy(worley_evaluator *eval);
+const worley_params *worley_evaluator_params(const worley_evaluator *eval);
+
+// worleynoise_val and worleynoise3d_val with the evaluator's parameters; the evaluator has to have the dims
+float worley_evaluator_val(const worley_evaluator *eval, worley_context2 *context, const worley_vec2 *pt);
+float worley_evaluator_val3(const worley_evaluator *eval, worley_context3 *context, const worley_vec3 *pt);
+
+/************* Batch evaluation *************/
+
+// Evaluates n points at once. The parameters are resolved once for the whole batch,
+// so this is the path to use for baking.
+
+// colors used for the final color output
+typedef struct worley_colors {
+  worley_color inner;
+  worley_color outer;
+  worley_color gap;
+} worley_colors;
+
+// each array has room for n values. Outputs that aren't needed can be NULL.
+typedef struct worley_batch_out {
+  float *f1, *f2, *f3;  // divided by dist_scale * scale, i.e as they go into the distance mode
+  unsigned char *gap;   // 1 if the point is in the gap between two cells
+  float *value;         // same as worleynoise_val / worleynoise3d_val
+  worley_color *color;  // the final color; only written if colors are passed
+  // From the same search as the value:
+  float *edge;          // distance to the edge of the gap in the units of gap_size (see worley_gap_test), negative in the gap
+  float *bevel;         // 0 in the gap, rising smoothly to 1 at bevel_size from its edge
+  uint32_t *cell;       // an id of F1's feature point, the same for all samples in its cell (and its copies with a period)
+} worley_batch_out;
+
+void worleynoise_batch(worley_context2 *context, const worley_params *params, const worley_colors *colors,
+                       const worley_vec2 *pts, size_t n, worley_batch_out *out);
+void worleynoise3d_batch(worley_context3 *context, const worley_params *params, const worley_colors *colors,
+                         const worley_vec3 *pts, size_t n, worley_batch_out *out);
+// the same with an evaluator's parameters
+void worley_evaluator_batch(const worley_evaluator *eval, worley_context2 *context, const worley_colors *colors,
+                            const worley_vec2 *pts, size_t n, worley_batch_out *out);
+void worley_evaluator_batch3(const worley_evaluator *eval, worley_context3 *context, const worley_colors *colors,
+                             const worley_vec3 *pts, size_t n, worley_batch_out *out);
+
+/************* Packet evaluation *************/
+
+// For renderers that shade bundles of coherent rays, WORLEY_PACKET points at a time.
+// If all points of a packet (and with the classic gap test, their jagged gap points) are in the same cube, the window around it is searched once
+// for all of them, with the SIMD lanes running over the points instead of over the candidates.
+// Incoherent packets fall back to evaluating every point on its own. Either way, values[i] equals worleynoise_val.
+// n may exceed WORLEY_PACKET; the points are then taken WORLEY_PACKET at a time.
+// Returns the number of points that were evaluated in coherent packets.
+#define WORLEY_PACKET 8
+
+int worleynoise_packet(worley_context2 *context, const worley_params *params, const worley_vec2 *pts, int n, float *values);
+
+// matrix (NULL for none) transforms the points first, all of them together, like the shader's matrix parameter:
+// 16 floats, row vectors, translation in elements 12 to 14 (an affine miMatrix). values[i] then equals
+// worleynoise3d_val at the transformed point.
+int worleynoise3d_packet(worley_context3 *context, const worley_params *params, const float *matrix,
+                         const worley_vec3 *pts, int n, float *values);
+
+/************* Filtered evaluation *************/
+
+// For antialiasing without supersampling. The only discontinuity of the noise is the edge of the gap,
+// so instead of thresholding, the gap is faded in over the footprint of the sample.
+
+// the footprint of a sample: how the lookup point changes from one pixel to the next in raster x and y
+typedef struct worley_footprint2 { worley_vec2 dx, dy; } worley_footprint2;
+typedef struct worley_footprint3 { worley_vec3 dx, dy; } worley_footprint3;
+
+typedef struct worley_filtered2 {
+  float f1, f2, f3;          // divided by dist_scale * scale, like in worley_batch_out
+  worley_vec2 df1, df2, df3; // their gradients with respect to the lookup point
+  float gap_coverage;        // how much of the footprint lies in the gap, between 0 and 1
+  float gap_edge;            // distance to the edge of the gap (divided like f1), negative in the gap
+  float value;               // the value outside of the gap, between 0 and 1
+} worley_filtered2;
+
+typedef struct worley_filtered3 {
+  float f1, f2, f3;
+  worley_vec3 df1, df2, df3;
+  float gap_coverage;
+  float gap_edge;
+  float value;
+} worley_filtered3;
+
+// with a zero footprint, gap_coverage is 0 or 1 and agrees with the sign of worleynoise_val
+void worleynoise_filtered(worley_context2 *context, const worley_params *params, const worley_vec2 *pt,
+                          const worley_footprint2 *footprint, worley_filtered2 *out);
+void worleynoise3d_filtered(worley_context3 *context, const worley_params *params, const worley_vec3 *pt,
+                            const worley_footprint3 *footprint, worley_filtered3 *out);
+
+// the color of a filtered sample: value between the inner and outer color, blended with the gap color by gap_coverage
+void worley_filtered_color(float value, float gap_coverage, const worley_colors *colors, worley_color *result);
+
+/************* Fractal evaluation *************/
+
+// Several octaves of the noise summed in one evaluation, instead of layering shader nodes.
+// Octave i is the pattern at scale / lacunarity^i with amplitude gain^i and its own distance mode.
+// The first octave decides the gap; the finer ones only add detail to the value.
+// All octaves sample one pattern at different points: they are evaluated with one setup of the parameters,
+// and the contexts of the octaves can share one cell cache.
+#define WORLEY_MAX_OCTAVES 8
+
+typedef struct worley_fractal {
+  int octaves;      // 1 to WORLEY_MAX_OCTAVES
+  float lacunarity; // scale ratio between octaves; integers keep a period tileable
+  float gain;       // amplitude ratio between octaves
+  dist_mode modes[WORLEY_MAX_OCTAVES];
+  // octaves are skipped once all the remaining ones together can change the value by less than this
+  float threshold;
+} worley_fractal;
+
+// octaves 1, lacunarity 2, gain 0.5, mode for all octaves, threshold 1/512
+void worley_fractal_default(worley_fractal *fractal, dist_mode mode);
+
+// like worleynoise_val / worleynoise3d_val, for the weighted average of the octaves.
+// footprint is the size of a sample (in u/v units or 3D units, before scaling); octaves whose cubes are
+// smaller than twice the footprint fade out and those smaller than it are skipped. 0 evaluates all octaves.
+// contexts holds one context per octave (fractal->octaves of them); contexts[0] is used like in worleynoise_val.
+float worleynoise_fractal(worley_context2 *contexts, const worley_params *params, const worley_fractal *fractal,
+                          const worley_vec2 *pt, float footprint);
+float worleynoise3d_fractal(worley_context3 *contexts, const worley_params *params, const worley_fractal *fractal,
+                            const worley_vec3 *pt, float footprint);
+
+/************* Atlas *************/
+
+// A baked, tileable texture of the 2D noise for one parameter set, with a full mip chain.
+// It stores F1, F2, F3 and the distance to the gap edge over one period of the feature points
+// (params->period cubes in u and v), and lookups interpolate trilinearly instead of searching the cubes.
+// The jagged gap offsets don't repeat with the period, so jagged gaps can show a faint seam at the texture border.
+// An atlas takes size^2 * 21 bytes (about 5.6MB for 512).
+typedef struct worley_atlas worley_atlas;
+
+// size (a power of two) is the resolution of the finest level. params->period has to be > 0, and the first two axis_weights equal.
+// Returns NULL for unusable parameters or when out of memory.
+worley_atlas *worley_atlas_bake(const worley_params *params, int size);
+void worley_atlas_destroy(worley_atlas *atlas);
+size_t worley_atlas_bytes(const worley_atlas *atlas);
+
+// whether the atlas was baked for these parameters. The distance mode may differ, it is applied at lookup.
+int worley_atlas_matches(const worley_atlas *atlas, const worley_params *params);
+
+// like worleynoise_val. footprint is the size of a sample in u/v units; 0 always uses the finest level.
+float worley_atlas_val(const worley_atlas *atlas, dist_mode mode, const worley_vec2 *pt, float footprint);
+
+/************* Tile cache *************/
+
+// An on-disk cache of baked tiles of the noise, shared by all render processes on a machine.
+// Every tile covers a fixed block of cubes (8x8 in 2D, 4x4x4 in 3D) and stores F1, F2, F3 and the distance to
+// the gap edge on a regular grid, so lookups interpolate instead of searching the cubes.
+// Tiles are files named after a hash of the parameters that shape the noise (worley_tile_key), and are mapped
+// read-only, so processes share the pages. Missing tiles are baked and written atomically if write_back is set.
+// Tiles are in noise space: the distance mode is applied at lookup, and the caller's transformations don't matter.
+// Values are interpolated, so they are an approximation of what worleynoise_val returns between grid points
+// (1/32 cube apart in 2D, 1/16 in 3D): near gap edges some samples land on the other side of the gap, about 1% of
+// all samples at the default parameters. A miss with write_back bakes the whole tile before returning:
+// 257^2 evaluations in 2D (about 1MB), 65^3 in 3D (about 4.4MB), on the caller's thread.
+// A cache is not thread safe; like the cell cache, use one per thread.
+typedef struct worley_tile_cache worley_tile_cache;
+
+typedef struct worley_tile_stats {
+  size_t lookups;       // served from a tile
+  size_t tiles_mapped;  // tile files mapped
+  size_t tiles_written; // tiles baked and written by this cache
+  size_t tiles_missing; // tiles neither on disk nor written
+} worley_tile_stats;
+
+// dir is created if needed. capacity is the number of tiles kept mapped (rounded up to a power of two, at least 4).
+// Returns NULL if dir is NULL or empty, when out of memory, or on platforms without mmap.
+worley_tile_cache *worley_tile_cache_open(const char *dir, size_t capacity, int write_back);
+void worley_tile_cache_close(worley_tile_cache *cache);
+const worley_tile_stats *worley_tile_cache_stats(const worley_tile_cache *cache);
+
+// the hash naming the tiles of these parameters, for dims 2 or 3
+uint64_t worley_tile_key(const worley_params *params, int dims);
+
+// like worleynoise_val and worleynoise3d_val, from the cached tile around pt.
+// Return 1 and set *val if the tile was cached (or written), 0 if the caller has to evaluate pt itself
+// (always for a 2D jagged gap, which the tiles can't hold).
+int worley_tile_val(worley_tile_cache *cache, worley_context2 *context, const worley_params *params,
+                    const worley_vec2 *pt, float *val);
+int worley_tile_val3(worley_tile_cache *cache, worley_context3 *context, const worley_params *params,
+                     const worley_vec3 *pt, float *val);
+
+/************* Volumes *************/
+
+// A dense grid of voxels of the 3D noise, e.g for clouds or rock interiors that are ray marched.
+// Voxel (i, j, k) has the value texture_worleynoise3d would return for the point at the center of its box
+// between lo and hi (the shader's state->point), transformed by matrix like the shader does.
+typedef struct worley_volume {
+  int nx, ny, nz;
+  float lo[3], hi[3];
+  float matrix[16]; // like miMatrix: row vectors times the matrix
+  int slab;         // slices per slab, 0 for WORLEY_VOLUME_SLAB
+} worley_volume;
+
+#define WORLEY_VOLUME_SLAB 8
+
+// receives slices z0 to z0 + n - 1 as n * ny * nx values, x fastest, as worleynoise3d_val or worleynoise3d_fractal
+// returns them (negative in the gap). The buffer is reused for the next slab. Return 0 to stop the bake.
+typedef int (*worley_slab_fn)(void *user, int z0, int n, const float *values);
+
+// Bakes slices [z0, z1) of the volume slab by slab, in order, and streams every slab to fn.
+// Memory stays at one slab and a cell cache sized for two slabs' cubes, so the cubes of a slab are generated once
+// and reused by the next one instead of being regenerated. fractal may be NULL for a single octave;
+// octaves finer than a voxel fade out. Split [0, nz) into ranges to bake on several threads.
+// Adds to *stats if not NULL. Returns 0 when out of memory or if fn stopped the bake, 1 otherwise.
+int worley_volume_bake(const worley_volume *volume, const worley_params *params, const worley_fractal *fractal,
+                       int z0, int z1, worley_slab_fn fn, void *user, worley_cache_stats *stats);
+
+/************* Shading *************/
+
+void grey_to_color(float val, const worley_color *color1, const worley_color *color2, worley_color *result);
+
+// scales its positive input (which should already be approximately between 0 and 1) to the interval [0, 1)
+// it is a tuned logistic sigmoid function
+float scaling_function(float x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Baked, tileable texture of the 2D noise with a mip chain (see worley_atlas_bake in worley.h).
+ *
+ * Every texel stores F1, F2, F3 and the distance to the gap edge at its center, as returned by worleynoise_filtered.
+ * The texture covers one period of the feature points, so it tiles seamlessly.
+ * Coarser levels are 2x2 box filtered, which blurs the gap edges into a coverage-like fade.
+ */
+
+#include "worley.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+typedef struct atlas_texel {
+  float f1, f2, f3, edge;
+} atlas_texel;
+
+#define ATLAS_MAX_LEVELS 16
+
+struct worley_atlas {
+  worley_params params;
+  float period_len; // of the texture, in u/v units
+  int size;         // of level 0
+  int levels;
+  atlas_texel *level[ATLAS_MAX_LEVELS];
+  atlas_texel *texels;
+  size_t count;
+};
+
+static void bake_level0(worley_atlas *atlas) {
+  worley_context2 context;
+  worley_context2_init(&context);
+  worley_footprint2 none = { { 0, 0 }, { 0, 0 } };
+  int n = atlas->size;
+  for(int y = 0; y < n; ++y) {
+    for(int x = 0; x < n; ++x) {
+      worley_vec2 pt;
+      pt.u = (x + 0.5f) / n * atlas->period_len;
+      pt.v = (y + 0.5f) / n * atlas->period_len;
+      worley_filtered2 f;
+      worleynoise_filtered(&context, &atlas->params, &pt, &none, &f);
+      atlas_texel *t = &atlas->level[0][y * n + x];
+      t->f1 = f.f1; t->f2 = f.f2; t->f3 = f.f3; t->edge = f.gap_edge;
+    }
+  }
+}
+
+static void downsample(const atlas_texel *src, int n, atlas_texel *dst) {
+  int m = n / 2;
+  for(int y = 0; y < m; ++y) {
+    for(int x = 0; x < m; ++x) {
+      const atlas_texel *a = &src[2 * y * n + 2 * x], *b = a + 1, *c = a + n, *d = c + 1;
+      atlas_texel *t = &dst[y * m + x];
+      t->f1 = 0.25f * (a->f1 + b->f1 + c->f1 + d->f1);
+      t->f2 = 0.25f * (a->f2 + b->f2 + c->f2 + d->f2);
+      t->f3 = 0.25f * (a->f3 + b->f3 + c->f3 + d->f3);
+      t->edge = 0.25f * (a->edge + b->edge + c->edge + d->edge);
+    }
+  }
+}
+
+worley_atlas *worley_atlas_bake(const worley_params *params, int size) {
+  // unequal axis weights stretch the period differently along u and v, which one square texture can't cover
+  if(params->period <= 0 || size < 1 || (size & (size - 1)) || params->scale <= 0
+     || params->axis_weights[0] != params->axis_weights[1])
+    return NULL;
+  worley_atlas *atlas = calloc(1, sizeof(worley_atlas));
+  if(!atlas)
+    return NULL;
+  atlas->params = *params;
+  atlas->period_len = params->period * worley_cube_dist(params, 2);
+  atlas->size = size;
+
+  size_t count = 0;
+  for(int n = size; n >= 1 && atlas->levels < ATLAS_MAX_LEVELS; n /= 2) {
+    count += (size_t)n * n;
+    atlas->levels++;
+  }
+  atlas->texels = malloc(count * sizeof(atlas_texel));
+  if(!atlas->texels) {
+    free(atlas);
+    return NULL;
+  }
+  atlas->count = count;
+  size_t offset = 0;
+  for(int l = 0, n = size; l < atlas->levels; ++l, n /= 2) {
+    atlas->level[l] = atlas->texels + offset;
+    offset += (size_t)n * n;
+  }
+
+  bake_level0(atlas);
+  for(int l = 1, n = size; l < atlas->levels; ++l, n /= 2)
+    downsample(atlas->level[l - 1], n, atlas->level[l]);
+  return atlas;
+}
+
+void worley_atlas_destroy(worley_atlas *atlas) {
+  if(!atlas)
+    return;
+  free(atlas->texels);
+  free(atlas);
+}
+
+size_t worley_atlas_bytes(const worley_atlas *atlas) {
+  return sizeof(worley_atlas) + atlas->count * sizeof(atlas_texel);
+}
+
+int worley_atlas_matches(const worley_atlas *atlas, const worley_params *params) {
+  const worley_params *a = &atlas->params;
+  return a->distance_measure == params->distance_measure && a->scale == params->scale
+      && a->gap_size == params->gap_size && a->jagged_gap == params->jagged_gap
+      && a->noise == params->noise && a->point_gen == params->point_gen && a->seed == params->seed
+      && a->poisson_mean == params->poisson_mean && a->period == params->period
+      && a->density == params->density && a->points_per_cube == params->points_per_cube
+      && a->minkowski_p == params->minkowski_p
+      && a->axis_weights[0] == params->axis_weights[0] && a->axis_weights[1] == params->axis_weights[1]
+      && a->gap_test == params->gap_test;
+}
+
+// bilinear lookup in level l, at s, t in periods (wrapping around)
+static atlas_texel sample_level(const worley_atlas *atlas, int l, float s, float t) {
+  int n = atlas->size >> l, mask = n - 1;
+  float x = s * n - 0.5f, y = t * n - 0.5f;
+  float fx = floorf(x), fy = floorf(y);
+  float ax = x - fx, ay = y - fy;
+  int x0 = (int)fx & mask, y0 = (int)fy & mask;
+  int x1 = (x0 + 1) & mask, y1 = (y0 + 1) & mask;
+  const atlas_texel *tex = atlas->level[l];
+  const atlas_texel *a = &tex[y0 * n + x0], *b = &tex[y0 * n + x1], *c = &tex[y1 * n + x0], *d = &tex[y1 * n + x1];
+  float wa = (1 - ax) * (1 - ay), wb = ax * (1 - ay), wc = (1 - ax) * ay, wd = ax * ay;
+  atlas_texel r;
+  r.f1 = wa * a->f1 + wb * b->f1 + wc * c->f1 + wd * d->f1;
+  r.f2 = wa * a->f2 + wb * b->f2 + wc * c->f2 + wd * d->f2;
+  r.f3 = wa * a->f3 + wb * b->f3 + wc * c->f3 + wd * d->f3;
+  r.edge = wa * a->edge + wb * b->edge + wc * c->edge + wd * d->edge;
+  return r;
+}
+
+float worley_atlas_val(const worley_atlas *atlas, dist_mode mode, const worley_vec2 *pt, float footprint) {
+  float s = pt->u / atlas->period_len, t = pt->v / atlas->period_len;
+  s -= floorf(s);
+  t -= floorf(t);
+
+  float texels = footprint / atlas->period_len * atlas->size;
+  float lod = texels > 1 ? log2f(texels) : 0;
+  if(lod > atlas->levels - 1)
+    lod = atlas->levels - 1;
+  int l = (int)lod;
+  float w = lod - l;
+  atlas_texel r = sample_level(atlas, l, s, t);
+  if(w > 0) {
+    atlas_texel r1 = sample_level(atlas, l + 1, s, t);
+    r.f1 += w * (r1.f1 - r.f1);
+    r.f2 += w * (r1.f2 - r.f2);
+    r.f3 += w * (r1.f3 - r.f3);
+    r.edge += w * (r1.edge - r.edge);
+  }
+
+  float value = scaling_function(worley_combine(mode, r.f1, r.f2, r.f3));
+  return r.edge < 0 ? -value : value;
+}
@@ -0,0 +1,749 @@
+/*
+ * worley_bake: renders texture_worleynoise / texture_worleynoise3d into an image file, on all cores.
+ *
+ * usage: worley_bake [name=value ...] output.bmp|.ppm|.pfm|.nrrd
+ *
+ * The shader parameters have the names from worleynoise.mi / worleynoise3d.mi
+ * (jagged_gap, inner, outer, gap, distance_measure, distance_mode, scale, scaleX, gap_size, matrix, point_generator, filter_size, period,
+ * octaves, lacunarity, gain, octave_distance_mode, density, points_per_cube, minkowski_p, axis_weights, gap_test);
+ * colors are given as r,g,b,a, axis_weights as x,y,z and the matrix as 16 comma separated values. Besides that:
+ *   shader      texture_worleynoise (default) or texture_worleynoise3d
+ *   width, height  image size in pixels (default 1024)
+ *   region      u0,v0,u1,v1: the part of the uv plane the image covers (default 0,0,1,1)
+ *   z           the z coordinate of the baked slice (3D only, before the matrix)
+ *   depth, zrange  .nrrd only: the number of slices (default: width) and z0,z1, the z range they cover (default 0,1)
+ *   filter_size in pixels for both shaders (unlike texture_worleynoise's u/v units); 1 antialiases the gap over a pixel
+ *   seed, poisson_mean, search  the corresponding worley_params fields
+ *   tile        tile size in pixels (default 256)
+ *   threads     number of worker threads (default: all cores)
+ *   stats       writes the counters of all threads to this JSON file (timings only with a core built with make PROFILE=1)
+ *
+ * The image is split into tiles, which are evaluated by a pool of workers with work stealing.
+ * Every worker has its own slot of a worley_context_pool (contexts and a cell cache) and writes its finished tiles straight into the file,
+ * so memory use doesn't grow with the image size.
+ *
+ * A .nrrd output is a volume of texture_worleynoise3d instead: width x height x depth float voxels covering region x zrange
+ * (before the matrix), with the shader's value per voxel (negative in the gap; the colors are not applied).
+ * Every thread bakes a range of slices with worley_volume_bake and writes its slabs straight into the file.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "worley.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BAKE_CELL_CACHE_SIZE 4096
+
+/************* Options *************/
+
+typedef struct bake_options {
+  int dims; // 2: texture_worleynoise, 3: texture_worleynoise3d
+  int width, height;
+  float region[4];
+  float z;
+  int depth;
+  float zrange[2];
+  float matrix[16];
+  float filter_size;
+  worley_params params;
+  worley_fractal fractal;
+  int octave_mode; // -1 for distance_mode
+  worley_colors colors;
+  int tile;
+  int threads;
+  const char *output;
+  const char *stats; // JSON file for the counters of all threads, or NULL
+} bake_options;
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: worley_bake [name=value ...] output.bmp|.ppm|.pfm|.nrrd\n"
+    "shader parameters: jagged_gap inner outer gap distance_measure distance_mode scale scaleX gap_size matrix point_generator filter_size period\n"
+    "  octaves lacunarity gain octave_distance_mode density points_per_cube minkowski_p axis_weights gap_test\n"
+    "baker parameters: shader width height depth region z zrange seed poisson_mean search tile threads stats\n");
+}
+
+static int parse_floats(const char *s, float *out, int n) {
+  for(int i = 0; i < n; ++i) {
+    char *end;
+    out[i] = strtof(s, &end);
+    if(end == s || (i < n - 1 && *end != ','))
+      return 0;
+    s = end + (i < n - 1);
+  }
+  return *s == '\0';
+}
+
+static int parse_int(const char *s, int min, int max, int *out) {
+  char *end;
+  long v = strtol(s, &end, 10);
+  if(end == s || *end != '\0' || v < min || v > max)
+    return 0;
+  *out = (int)v;
+  return 1;
+}
+
+static int parse_color(const char *s, worley_color *c) {
+  float f[4];
+  if(!parse_floats(s, f, 4))
+    return 0;
+  c->r = f[0]; c->g = f[1]; c->b = f[2]; c->a = f[3];
+  return 1;
+}
+
+static void options_default(bake_options *o) {
+  o->dims = 2;
+  o->width = o->height = 1024;
+  o->region[0] = 0; o->region[1] = 0; o->region[2] = 1; o->region[3] = 1;
+  o->z = 0;
+  o->depth = 0;
+  o->zrange[0] = 0; o->zrange[1] = 1;
+  for(int i = 0; i < 16; ++i)
+    o->matrix[i] = (i % 5 == 0) ? 1 : 0;
+  o->filter_size = 0;
+  worley_params_default(&o->params);
+  worley_fractal_default(&o->fractal, o->params.distance_mode);
+  o->octave_mode = -1;
+  // the defaults of the .mi files
+  worley_color inner = { 1, 1, 0, 1 }, outer = { 0, 0.2, 0, 1 }, gap = { 0, 0, 0, 0 };
+  o->colors.inner = inner;
+  o->colors.outer = outer;
+  o->colors.gap = gap;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  o->tile = 256;
+  o->threads = cores > 0 ? (int)cores : 1;
+  o->output = NULL;
+  o->stats = NULL;
+}
+
+static int parse_option(bake_options *o, const char *name, const char *value) {
+  worley_params *p = &o->params;
+  int i;
+  if(!strcmp(name, "shader")) {
+    if(!strcmp(value, "texture_worleynoise")) o->dims = 2;
+    else if(!strcmp(value, "texture_worleynoise3d")) o->dims = 3;
+    else return 0;
+    return 1;
+  }
+  if(!strcmp(name, "jagged_gap")) return parse_int(value, 0, 1, &p->jagged_gap);
+  if(!strcmp(name, "inner")) return parse_color(value, &o->colors.inner);
+  if(!strcmp(name, "outer")) return parse_color(value, &o->colors.outer);
+  if(!strcmp(name, "gap")) return parse_color(value, &o->colors.gap);
+  if(!strcmp(name, "distance_measure")) {
+    if(!parse_int(value, DIST_LINEAR, DIST_CHEBYSHEV, &i)) return 0;
+    p->distance_measure = (dist_measure)i;
+    return 1;
+  }
+  if(!strcmp(name, "distance_mode")) {
+    if(!parse_int(value, DIST_F1, DIST_F1_P_F2_P_F3, &i)) return 0;
+    p->distance_mode = (dist_mode)i;
+    return 1;
+  }
+  if(!strcmp(name, "scale")) return parse_floats(value, &p->scale, 1) && p->scale > 0;
+  if(!strcmp(name, "scaleX")) return parse_floats(value, &p->scaleX, 1) && p->scaleX > 0;
+  if(!strcmp(name, "gap_size")) return parse_floats(value, &p->gap_size, 1);
+  if(!strcmp(name, "matrix")) return parse_floats(value, o->matrix, 16);
+  if(!strcmp(name, "filter_size")) return parse_floats(value, &o->filter_size, 1) && o->filter_size >= 0;
+  if(!strcmp(name, "point_generator")) {
+    if(!parse_int(value, WORLEY_GEN_NOISE, WORLEY_GEN_HASH, &i)) return 0;
+    p->point_gen = (worley_point_gen)i;
+    return 1;
+  }
+  if(!strcmp(name, "seed")) {
+    if(!parse_int(value, 0, INT32_MAX, &i)) return 0;
+    p->seed = (unsigned int)i;
+    return 1;
+  }
+  if(!strcmp(name, "poisson_mean")) return parse_floats(value, &p->poisson_mean, 1) && p->poisson_mean >= 0;
+  if(!strcmp(name, "period")) return parse_int(value, 0, 1 << 20, &p->period);
+  if(!strcmp(name, "density")) return parse_floats(value, &p->density, 1) && p->density >= 0;
+  if(!strcmp(name, "points_per_cube")) return parse_int(value, 0, PTS_PER_CUBE, &p->points_per_cube);
+  if(!strcmp(name, "minkowski_p")) return parse_floats(value, &p->minkowski_p, 1) && p->minkowski_p >= 1;
+  if(!strcmp(name, "axis_weights")) return parse_floats(value, p->axis_weights, 3);
+  if(!strcmp(name, "gap_test")) {
+    if(!parse_int(value, WORLEY_GAP_CLASSIC, WORLEY_GAP_EXACT, &i)) return 0;
+    p->gap_test = (worley_gap_test)i;
+    return 1;
+  }
+  if(!strcmp(name, "search")) {
+    if(!parse_int(value, WORLEY_SEARCH_FULL, WORLEY_SEARCH_SEPARATE, &i)) return 0;
+    p->search = (worley_search)i;
+    return 1;
+  }
+  if(!strcmp(name, "octaves")) return parse_int(value, 1, WORLEY_MAX_OCTAVES, &o->fractal.octaves);
+  if(!strcmp(name, "lacunarity")) return parse_floats(value, &o->fractal.lacunarity, 1) && o->fractal.lacunarity >= 1;
+  if(!strcmp(name, "gain")) return parse_floats(value, &o->fractal.gain, 1) && o->fractal.gain >= 0;
+  if(!strcmp(name, "octave_distance_mode")) return parse_int(value, -1, DIST_F1_P_F2_P_F3, &o->octave_mode);
+  if(!strcmp(name, "width")) return parse_int(value, 1, 1 << 20, &o->width);
+  if(!strcmp(name, "height")) return parse_int(value, 1, 1 << 20, &o->height);
+  if(!strcmp(name, "region")) return parse_floats(value, o->region, 4);
+  if(!strcmp(name, "z")) return parse_floats(value, &o->z, 1);
+  if(!strcmp(name, "depth")) return parse_int(value, 1, 1 << 20, &o->depth);
+  if(!strcmp(name, "zrange")) return parse_floats(value, o->zrange, 2);
+  if(!strcmp(name, "tile")) return parse_int(value, 1, 1 << 16, &o->tile);
+  if(!strcmp(name, "threads")) return parse_int(value, 1, 1024, &o->threads);
+  if(!strcmp(name, "stats")) { o->stats = value; return *value != '\0'; }
+  return 0;
+}
+
+// whether the output is a volume
+static int is_volume(const char *path) {
+  const char *ext = strrchr(path, '.');
+  return ext && !strcmp(ext, ".nrrd");
+}
+
+static int parse_args(bake_options *o, int argc, char **argv) {
+  for(int i = 1; i < argc; ++i) {
+    char *eq = strchr(argv[i], '=');
+    if(!eq) {
+      if(o->output) {
+        fprintf(stderr, "more than one output file: %s\n", argv[i]);
+        return 0;
+      }
+      o->output = argv[i];
+      continue;
+    }
+    *eq = '\0';
+    if(!parse_option(o, argv[i], eq + 1)) {
+      fprintf(stderr, "invalid parameter: %s=%s\n", argv[i], eq + 1);
+      return 0;
+    }
+  }
+  if(!o->output) {
+    usage();
+    return 0;
+  }
+  if(!worley_poisson_valid(&o->params)) {
+    fprintf(stderr, "invalid parameter: poisson_mean=%g is above the points per cube (%d)\n", o->params.poisson_mean,
+            worley_cube_points(&o->params));
+    return 0;
+  }
+  // volumes are always texture_worleynoise3d; texture_worleynoise has no scaleX
+  if(is_volume(o->output))
+    o->dims = 3;
+  if(o->dims == 2)
+    o->params.scaleX = 1.0;
+  for(int i = 0; i < WORLEY_MAX_OCTAVES; ++i)
+    o->fractal.modes[i] = (i == 0 || o->octave_mode < 0) ? o->params.distance_mode : (dist_mode)o->octave_mode;
+  return 1;
+}
+
+/************* Image files *************/
+
+// All formats have a fixed-size header and fixed-size rows, so tiles can be written in any order.
+typedef enum image_format { FMT_BMP, FMT_PPM, FMT_PFM } image_format;
+
+typedef struct image_file {
+  int fd;
+  image_format format;
+  int width, height;
+  size_t header;    // bytes before the first row
+  size_t row_bytes; // including padding
+  int pixel_bytes;
+} image_file;
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+}
+
+static int write_all(int fd, const void *buf, size_t n, off_t offset) {
+  const char *p = buf;
+  while(n > 0) {
+    ssize_t w = pwrite(fd, p, n, offset);
+    if(w <= 0)
+      return 0;
+    p += w; n -= w; offset += w;
+  }
+  return 1;
+}
+
+static int image_open(image_file *img, const char *path, int width, int height) {
+  const char *ext = strrchr(path, '.');
+  if(ext && !strcmp(ext, ".bmp")) img->format = FMT_BMP;
+  else if(ext && !strcmp(ext, ".ppm")) img->format = FMT_PPM;
+  else if(ext && !strcmp(ext, ".pfm")) img->format = FMT_PFM;
+  else {
+    fprintf(stderr, "unknown image format (use .bmp, .ppm or .pfm): %s\n", path);
+    return 0;
+  }
+  img->width = width;
+  img->height = height;
+
+  unsigned char header[64];
+  switch(img->format) {
+    case FMT_BMP: {
+      img->pixel_bytes = 3;
+      img->row_bytes = ((size_t)width * 3 + 3) & ~(size_t)3;
+      img->header = 54;
+      uint64_t size = img->header + img->row_bytes * height;
+      if(size > UINT32_MAX) {
+        fprintf(stderr, "image too large for a .bmp, use .ppm or .pfm\n");
+        return 0;
+      }
+      memset(header, 0, 54);
+      header[0] = 'B'; header[1] = 'M';
+      put_le32(header + 2, (uint32_t)size);
+      put_le32(header + 10, 54);
+      put_le32(header + 14, 40);
+      put_le32(header + 18, width);
+      put_le32(header + 22, height); // positive: bottom-up rows
+      header[26] = 1;  // planes
+      header[28] = 24; // bits per pixel
+      put_le32(header + 34, (uint32_t)(img->row_bytes * height));
+      break;
+    }
+    case FMT_PPM:
+      img->pixel_bytes = 3;
+      img->row_bytes = (size_t)width * 3;
+      img->header = snprintf((char *)header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+      break;
+    case FMT_PFM:
+      img->pixel_bytes = 12;
+      img->row_bytes = (size_t)width * 12;
+      // negative scale: little endian. Rows are stored bottom-up.
+      img->header = snprintf((char *)header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+      break;
+  }
+
+  img->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(img->fd < 0) {
+    perror(path);
+    return 0;
+  }
+  if(!write_all(img->fd, header, img->header, 0) || ftruncate(img->fd, img->header + img->row_bytes * height) != 0) {
+    perror(path);
+    close(img->fd);
+    return 0;
+  }
+  return 1;
+}
+
+static unsigned char to_byte(float c) {
+  if(!(c > 0)) return 0;
+  if(c >= 1) return 255;
+  return (unsigned char)(c * 255 + 0.5f);
+}
+
+// writes n pixels of image row y (0 is the top), starting at column x. buf needs room for n * pixel_bytes.
+static int image_write(const image_file *img, int x, int y, const worley_color *colors, int n, unsigned char *buf) {
+  for(int i = 0; i < n; ++i) {
+    const worley_color *c = &colors[i];
+    switch(img->format) {
+      case FMT_BMP:
+        buf[3 * i] = to_byte(c->b); buf[3 * i + 1] = to_byte(c->g); buf[3 * i + 2] = to_byte(c->r);
+        break;
+      case FMT_PPM:
+        buf[3 * i] = to_byte(c->r); buf[3 * i + 1] = to_byte(c->g); buf[3 * i + 2] = to_byte(c->b);
+        break;
+      case FMT_PFM: {
+        float f[3] = { c->r, c->g, c->b };
+        memcpy(buf + 12 * i, f, 12);
+        break;
+      }
+    }
+  }
+  int row = img->format == FMT_PPM ? y : img->height - 1 - y;
+  off_t offset = img->header + img->row_bytes * row + (size_t)x * img->pixel_bytes;
+  return write_all(img->fd, buf, (size_t)n * img->pixel_bytes, offset);
+}
+
+/************* Work stealing pool *************/
+
+// Every worker starts with a contiguous range of tiles, so neighbouring tiles share cubes in its cell cache.
+// The owner takes tiles from the front; idle workers steal from the back.
+typedef struct tile_queue {
+  pthread_mutex_t lock;
+  int next, end;
+} tile_queue;
+
+typedef struct baker baker;
+
+typedef struct worker {
+  baker *baker;
+  int id;
+  tile_queue queue;
+  worley_context2 *context2;
+  worley_context3 *context3;
+  worley_vec2 *pts2;
+  worley_vec3 *pts3;
+  worley_color *colors;
+  unsigned char *row;
+  long long tiles, stolen;
+  int failed;
+} worker;
+
+struct baker {
+  const bake_options *options;
+  image_file image;
+  int tiles_x, tiles_y;
+  worker *workers;
+  worley_context_pool *contexts; // a slot per worker, one context per octave
+};
+
+static int queue_pop(tile_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  int t = q->next < q->end ? q->next++ : -1;
+  pthread_mutex_unlock(&q->lock);
+  return t;
+}
+
+static int queue_steal(tile_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  int t = q->next < q->end ? --q->end : -1;
+  pthread_mutex_unlock(&q->lock);
+  return t;
+}
+
+static int next_tile(worker *w) {
+  int t = queue_pop(&w->queue);
+  if(t >= 0)
+    return t;
+  // tiles are never added, so once all queues are empty, the work is done
+  int n = w->baker->options->threads;
+  for(int k = 1; k < n; ++k) {
+    t = queue_steal(&w->baker->workers[(w->id + k) % n].queue);
+    if(t >= 0) {
+      w->stolen++;
+      return t;
+    }
+  }
+  return -1;
+}
+
+// the point the shader would get for pixel (x, y)
+static void pixel_uv(const bake_options *o, int x, int y, float *u, float *v) {
+  *u = o->region[0] + (o->region[2] - o->region[0]) * (x + 0.5f) / o->width;
+  *v = o->region[3] - (o->region[3] - o->region[1]) * (y + 0.5f) / o->height;
+}
+
+// like mi_point_transform: row vector times matrix
+static worley_vec3 transform_point(const float *m, float x, float y, float z) {
+  worley_vec3 p;
+  p.x = x * m[0] + y * m[4] + z * m[8] + m[12];
+  p.y = x * m[1] + y * m[5] + z * m[9] + m[13];
+  p.z = x * m[2] + y * m[6] + z * m[10] + m[14];
+  return p;
+}
+
+// the footprint of one pixel, times filter_size
+static void pixel_footprint(const bake_options *o, worley_footprint2 *fp2, worley_footprint3 *fp3) {
+  float du = (o->region[2] - o->region[0]) / o->width * o->filter_size;
+  float dv = -(o->region[3] - o->region[1]) / o->height * o->filter_size;
+  fp2->dx.u = du; fp2->dx.v = 0;
+  fp2->dy.u = 0; fp2->dy.v = dv;
+  // the matrix is linear apart from the translation
+  const float *m = o->matrix;
+  fp3->dx.x = du * m[0]; fp3->dx.y = du * m[1]; fp3->dx.z = du * m[2];
+  fp3->dy.x = dv * m[4]; fp3->dy.y = dv * m[5]; fp3->dy.z = dv * m[6];
+}
+
+// filtered evaluation has no batch version; evaluates the points of one row one by one
+static void bake_filtered(worker *w, int n) {
+  const bake_options *o = w->baker->options;
+  worley_footprint2 fp2;
+  worley_footprint3 fp3;
+  pixel_footprint(o, &fp2, &fp3);
+  for(int x = 0; x < n; ++x) {
+    if(o->dims == 2) {
+      worley_filtered2 f;
+      worleynoise_filtered(w->context2, &o->params, &w->pts2[x], &fp2, &f);
+      worley_filtered_color(f.value, f.gap_coverage, &o->colors, &w->colors[x]);
+    }
+    else {
+      worley_filtered3 f;
+      worleynoise3d_filtered(w->context3, &o->params, &w->pts3[x], &fp3, &f);
+      worley_filtered_color(f.value, f.gap_coverage, &o->colors, &w->colors[x]);
+    }
+  }
+}
+
+// multi-octave evaluation has no batch version either. Octaves finer than a pixel (times filter_size, if set) fade out.
+static void bake_fractal(worker *w, int n) {
+  const bake_options *o = w->baker->options;
+  float s = o->filter_size > 0 ? o->filter_size : 1;
+  float du = (o->region[2] - o->region[0]) / o->width * s;
+  float dv = (o->region[3] - o->region[1]) / o->height * s;
+  float footprint = fmaxf(fabsf(du), fabsf(dv));
+  if(o->dims == 3) {
+    const float *m = o->matrix;
+    footprint = fmaxf(fabsf(du) * sqrtf(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]),
+                      fabsf(dv) * sqrtf(m[4] * m[4] + m[5] * m[5] + m[6] * m[6]));
+  }
+  for(int x = 0; x < n; ++x) {
+    float val = o->dims == 2 ? worleynoise_fractal(w->context2, &o->params, &o->fractal, &w->pts2[x], footprint)
+                             : worleynoise3d_fractal(w->context3, &o->params, &o->fractal, &w->pts3[x], footprint);
+    if(val < 0)
+      w->colors[x] = o->colors.gap;
+    else
+      grey_to_color(val, &o->colors.inner, &o->colors.outer, &w->colors[x]);
+  }
+}
+
+static int bake_tile(worker *w, int t) {
+  baker *b = w->baker;
+  const bake_options *o = b->options;
+  int x0 = (t % b->tiles_x) * o->tile, y0 = (t / b->tiles_x) * o->tile;
+  int nx = o->width - x0 < o->tile ? o->width - x0 : o->tile;
+  int ny = o->height - y0 < o->tile ? o->height - y0 : o->tile;
+
+  worley_batch_out out;
+  memset(&out, 0, sizeof(out));
+  out.color = w->colors;
+  for(int y = y0; y < y0 + ny; ++y) {
+    for(int x = 0; x < nx; ++x) {
+      float u, v;
+      pixel_uv(o, x0 + x, y, &u, &v);
+      if(o->dims == 2) {
+        w->pts2[x].u = u;
+        w->pts2[x].v = v;
+      }
+      else
+        w->pts3[x] = transform_point(o->matrix, u, v, o->z);
+    }
+    if(o->fractal.octaves > 1)
+      bake_fractal(w, nx);
+    else if(o->filter_size > 0)
+      bake_filtered(w, nx);
+    else if(o->dims == 2)
+      worleynoise_batch(w->context2, &o->params, &o->colors, w->pts2, nx, &out);
+    else
+      worleynoise3d_batch(w->context3, &o->params, &o->colors, w->pts3, nx, &out);
+    if(!image_write(&b->image, x0, y, w->colors, nx, w->row))
+      return 0;
+  }
+  return 1;
+}
+
+static void *worker_main(void *arg) {
+  worker *w = arg;
+  int t;
+  while((t = next_tile(w)) >= 0) {
+    if(!bake_tile(w, t)) {
+      w->failed = 1;
+      break;
+    }
+    w->tiles++;
+  }
+  return NULL;
+}
+
+static int worker_init(worker *w, baker *b, int id, int first, int end) {
+  const bake_options *o = b->options;
+  memset(w, 0, sizeof(*w));
+  w->baker = b;
+  w->id = id;
+  pthread_mutex_init(&w->queue.lock, NULL);
+  w->queue.next = first;
+  w->queue.end = end;
+
+  if(o->dims == 2) {
+    w->context2 = worley_context_pool_get2(b->contexts, id);
+    w->pts2 = malloc(sizeof(worley_vec2) * o->tile);
+  }
+  else {
+    w->context3 = worley_context_pool_get3(b->contexts, id);
+    w->pts3 = malloc(sizeof(worley_vec3) * o->tile);
+  }
+  w->colors = malloc(sizeof(worley_color) * o->tile);
+  w->row = malloc((size_t)12 * o->tile);
+  return (w->pts2 || w->pts3) && w->colors && w->row;
+}
+
+static void worker_free(worker *w) {
+  free(w->pts2);
+  free(w->pts3);
+  free(w->colors);
+  free(w->row);
+  pthread_mutex_destroy(&w->queue.lock);
+}
+
+/************* Volumes *************/
+
+typedef struct volume_part {
+  const worley_volume *volume;
+  const bake_options *options;
+  int fd;
+  size_t header;
+  int z0, z1;
+  worley_cache_stats stats;
+  int ok;
+} volume_part;
+
+static int write_slab(void *user, int z0, int n, const float *values) {
+  volume_part *part = user;
+  size_t slice = (size_t)part->volume->nx * part->volume->ny * sizeof(float);
+  return write_all(part->fd, values, slice * n, part->header + slice * z0);
+}
+
+static void *volume_main(void *arg) {
+  volume_part *part = arg;
+  part->ok = worley_volume_bake(part->volume, &part->options->params, &part->options->fractal,
+                                part->z0, part->z1, write_slab, part, &part->stats);
+  return NULL;
+}
+
+// a raw little or big endian float volume with an NRRD header, which most volume tools read
+static int volume_open(const char *path, const worley_volume *volume, size_t *header_bytes) {
+  uint16_t one = 1;
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+                   "NRRD0004\ntype: float\ndimension: 3\nsizes: %d %d %d\nencoding: raw\nendian: %s\n\n",
+                   volume->nx, volume->ny, volume->nz, *(unsigned char *)&one ? "little" : "big");
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return -1;
+  if(!write_all(fd, header, n, 0) || ftruncate(fd, n + (off_t)volume->nx * volume->ny * volume->nz * sizeof(float)) != 0) {
+    close(fd);
+    return -1;
+  }
+  *header_bytes = n;
+  return fd;
+}
+
+// bakes the volume on o->threads threads, each a contiguous range of slabs
+static int bake_volume(const bake_options *o, worley_cache_stats *stats) {
+  worley_volume volume;
+  volume.nx = o->width;
+  volume.ny = o->height;
+  volume.nz = o->depth > 0 ? o->depth : o->width;
+  volume.lo[0] = o->region[0]; volume.lo[1] = o->region[1]; volume.lo[2] = o->zrange[0];
+  volume.hi[0] = o->region[2]; volume.hi[1] = o->region[3]; volume.hi[2] = o->zrange[1];
+  memcpy(volume.matrix, o->matrix, sizeof(volume.matrix));
+  volume.slab = WORLEY_VOLUME_SLAB;
+
+  size_t header;
+  int fd = volume_open(o->output, &volume, &header);
+  if(fd < 0)
+    return 0;
+  int slabs = (volume.nz + volume.slab - 1) / volume.slab;
+  int threads = o->threads < slabs ? o->threads : slabs;
+  volume_part *parts = calloc(threads, sizeof(volume_part));
+  pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+  int ok = parts && ids;
+  for(int i = 0; ok && i < threads; ++i) {
+    volume_part *part = &parts[i];
+    part->volume = &volume;
+    part->options = o;
+    part->fd = fd;
+    part->header = header;
+    part->z0 = (int)((long long)slabs * i / threads) * volume.slab;
+    part->z1 = (int)((long long)slabs * (i + 1) / threads) * volume.slab;
+    pthread_create(&ids[i], NULL, volume_main, part);
+  }
+  for(int i = 0; ok && i < threads; ++i) {
+    pthread_join(ids[i], NULL);
+    ok = parts[i].ok;
+    worley_cache_stats_add(stats, &parts[i].stats);
+  }
+  free(ids);
+  free(parts);
+  return close(fd) == 0 && ok;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the counters of all threads, as JSON. The timing ones need a core built with WORLEY_PROFILE.
+static int write_stats(const char *path, const worley_cache_stats *stats, double seconds) {
+  char json[1024];
+  worley_cache_stats_json(stats, json, sizeof(json));
+  FILE *f = fopen(path, "w");
+  if(!f)
+    return 0;
+  fprintf(f, "{\"seconds\": %.4f, \"stats\": %s}\n", seconds, json);
+  return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+  bake_options o;
+  options_default(&o);
+  if(!parse_args(&o, argc, argv))
+    return 1;
+
+  if(is_volume(o.output)) {
+    worley_cache_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    double start = now();
+    if(!bake_volume(&o, &stats)) {
+      perror(o.output);
+      return 1;
+    }
+    double seconds = now() - start;
+    double voxels = (double)o.width * o.height * (o.depth > 0 ? o.depth : o.width);
+    fprintf(stderr, "%s: %dx%dx%d on %d threads in %.2fs, %.1f Mvoxels/s, %llu cubes generated, cell cache hit rate %.1f%%\n",
+            o.output, o.width, o.height, o.depth > 0 ? o.depth : o.width, o.threads, seconds, voxels / seconds * 1e-6,
+            stats.cells_generated, 100 * worley_cell_cache_hit_rate(&stats));
+    if(o.stats && !write_stats(o.stats, &stats, seconds)) {
+      perror(o.stats);
+      return 1;
+    }
+    return 0;
+  }
+
+  baker b;
+  b.options = &o;
+  b.tiles_x = (o.width + o.tile - 1) / o.tile;
+  b.tiles_y = (o.height + o.tile - 1) / o.tile;
+  int tiles = b.tiles_x * b.tiles_y;
+  if(o.threads > tiles)
+    o.threads = tiles;
+  if(!image_open(&b.image, o.output, o.width, o.height))
+    return 1;
+
+  b.workers = calloc(o.threads, sizeof(worker));
+  b.contexts = worley_context_pool_create(o.threads, o.dims, WORLEY_MAX_OCTAVES, BAKE_CELL_CACHE_SIZE, WORLEY_CELLS_FLOAT);
+  int ok = b.workers != NULL && b.contexts != NULL;
+  for(int i = 0; ok && i < o.threads; ++i)
+    ok = worker_init(&b.workers[i], &b, i, (int)((long long)tiles * i / o.threads), (int)((long long)tiles * (i + 1) / o.threads));
+  if(!ok) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  double start = now();
+  pthread_t *threads = malloc(sizeof(pthread_t) * o.threads);
+  for(int i = 0; i < o.threads; ++i)
+    pthread_create(&threads[i], NULL, worker_main, &b.workers[i]);
+  for(int i = 0; i < o.threads; ++i)
+    pthread_join(threads[i], NULL);
+  double seconds = now() - start;
+
+  worley_cache_stats stats;
+  worley_context_pool_stats(b.contexts, &stats);
+  worley_context_pool_destroy(b.contexts);
+  long long stolen = 0;
+  int failed = 0;
+  for(int i = 0; i < o.threads; ++i) {
+    stolen += b.workers[i].stolen;
+    failed |= b.workers[i].failed;
+    worker_free(&b.workers[i]);
+  }
+  free(threads);
+  free(b.workers);
+  if(close(b.image.fd) != 0 || failed) {
+    perror(o.output);
+    return 1;
+  }
+
+  double samples = (double)o.width * o.height;
+  fprintf(stderr, "%s: %dx%d, %d tiles (%lld stolen) on %d threads in %.2fs, %.1f Msamples/s, cell cache hit rate %.1f%%\n",
+          o.output, o.width, o.height, tiles, stolen, o.threads, seconds, samples / seconds * 1e-6,
+          100 * worley_cell_cache_hit_rate(&stats));
+  if(o.stats && !write_stats(o.stats, &stats, seconds)) {
+    perror(o.stats);
+    return 1;
+  }
+  return 0;
+}
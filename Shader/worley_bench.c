@@ -0,0 +1,468 @@
+/*
+ * worley_bench: throughput of the noise core, as a baseline for performance changes.
+ *
+ * usage: worley_bench [name=value ...]
+ *   time             seconds to run each measurement (default 0.1)
+ *   n                number of sample points per access pattern (default 65536)
+ *   filter           only run the measurements whose name contains this string
+ *   point_generator, search, scale, minkowski_p  the corresponding worley_params fields
+ *   cells            format of the contexts' cell caches: float (default), 16 or 8 (see worley_cell_format)
+ *
+ * The first part times the hot functions on their own (distance/distance3, scaling_function,
+ * update_cache/update_cache3 and point_distances/point_distances3).
+ * The second part times whole shader evaluations (worley_evaluator_val and worley_evaluator_val3, with the
+ * parameters prepared once per measurement, as the shaders do at instance init) for every distance measure,
+ * distance mode, 2D/3D and jagged gap on/off, with three access patterns:
+ *   coherent  scanlines over the uv square, like baking or a camera looking straight at a plane
+ *   random    uniformly distributed points, like secondary rays
+ *   zoom      a camera zooming out from a tiny to a huge footprint per pixel
+ * The third part times the packet interface (worleynoise_packet/worleynoise3d_packet, distance mode f1)
+ * on the same patterns, WORLEY_PACKET consecutive points per call.
+ * Every measurement starts with a fresh context and a cell cache of the size the shaders use.
+ * With compact cells, an accuracy report comes first: for every distance measure and mode, 2D and 3D,
+ * how far the values of the random pattern are off from the float cell cache (maximum and mean)
+ * and the fraction of samples that moved into or out of the gap.
+ * Output is one tab separated line per measurement: name, Msamples/s, ns/sample,
+ * the fraction of window cubes reused and the cell cache hit rate.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "worley.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_CELL_CACHE_SIZE 512 // MR_CELL_CACHE_SIZE
+
+typedef struct bench_options {
+  double time;
+  int n;
+  const char *filter;
+  worley_cell_format cells;
+  worley_params params;
+} bench_options;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// keeps the compiler from dropping the benchmarked calls
+static volatile float sink;
+
+/************* Access patterns *************/
+
+typedef enum pattern { PATTERN_COHERENT, PATTERN_RANDOM, PATTERN_ZOOM, PATTERN_COUNT } pattern;
+static const char *pattern_names[PATTERN_COUNT] = { "coherent", "random", "zoom" };
+
+static unsigned int rng_state = 12345;
+static float rng(void) {
+  rng_state = rng_state * 1664525u + 1013904223u;
+  return (rng_state >> 8) * (1.0f / 16777216.0f);
+}
+
+// the uv coordinates of sample i of n; 3D points use (u, v, w)
+static void pattern_point(pattern p, int i, int n, float *u, float *v, float *w) {
+  switch(p) {
+    case PATTERN_COHERENT: {
+      int side = 1;
+      while(side * side < n) side *= 2;
+      *u = (i % side + 0.5f) / side;
+      *v = (i / side + 0.5f) / side;
+      *w = 0.5f;
+      break;
+    }
+    case PATTERN_RANDOM:
+      *u = rng() * 4; *v = rng() * 4; *w = rng() * 4;
+      break;
+    case PATTERN_ZOOM: {
+      // frames of 64x64 pixels, each twice as wide as the one before: from 1/64 to 512 units
+      int frame = (i / 4096) % 16, j = i % 4096;
+      float extent = (float)(1 << frame) / 64;
+      *u = 0.5f + ((j % 64 + 0.5f) / 64 - 0.5f) * extent;
+      *v = 0.5f + ((j / 64 + 0.5f) / 64 - 0.5f) * extent;
+      *w = 0.5f;
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static worley_vec2 *pattern_points2(pattern p, int n) {
+  worley_vec2 *pts = malloc(sizeof(worley_vec2) * n);
+  for(int i = 0; pts && i < n; ++i) {
+    float w;
+    pattern_point(p, i, n, &pts[i].u, &pts[i].v, &w);
+  }
+  return pts;
+}
+
+static worley_vec3 *pattern_points3(pattern p, int n) {
+  worley_vec3 *pts = malloc(sizeof(worley_vec3) * n);
+  for(int i = 0; pts && i < n; ++i)
+    pattern_point(p, i, n, &pts[i].x, &pts[i].y, &pts[i].z);
+  return pts;
+}
+
+/************* Measurements *************/
+
+typedef struct bench_result {
+  double samples;
+  double seconds;
+  worley_cache_stats stats;
+} bench_result;
+
+static int selected(const bench_options *o, const char *name) {
+  return !o->filter || strstr(name, o->filter);
+}
+
+static void report(const char *name, const bench_result *r) {
+  const worley_cache_stats *s = &r->stats;
+  unsigned long long entered = s->cells_reused + s->cells_cached + s->cells_generated;
+  printf("%s\t%.2f\t%.1f\t%.3f\t%.3f\n", name, r->samples / r->seconds * 1e-6, r->seconds / r->samples * 1e9,
+         entered ? (double)s->cells_reused / entered : 0.0, worley_cell_cache_hit_rate(s));
+  fflush(stdout);
+}
+
+// runs body over the n points until the time is up. body is a statement using the loop index i.
+#define BENCH_LOOP(o, result, n, body) { \
+  double start = now(), elapsed; \
+  (result).samples = 0; \
+  do { \
+    for(int i = 0; i < (n); ++i) { body; } \
+    (result).samples += (n); \
+    elapsed = now() - start; \
+  } while(elapsed < (o)->time); \
+  (result).seconds = elapsed; \
+}
+
+static worley_context2 *context2_create(const bench_options *o) {
+  void *mem;
+  if(posix_memalign(&mem, 64, sizeof(worley_context2)) != 0)
+    return NULL;
+  worley_context2 *context = mem;
+  worley_context2_init(context);
+  context->cells = worley_cell_cache_create(BENCH_CELL_CACHE_SIZE, o->cells);
+  return context;
+}
+
+static worley_context3 *context3_create(const bench_options *o) {
+  void *mem;
+  if(posix_memalign(&mem, 64, sizeof(worley_context3)) != 0)
+    return NULL;
+  worley_context3 *context = mem;
+  worley_context3_init(context);
+  context->cells = worley_cell_cache_create(BENCH_CELL_CACHE_SIZE, o->cells);
+  return context;
+}
+
+static void context2_destroy(worley_context2 *context) {
+  worley_cell_cache_destroy(context->cells);
+  free(context);
+}
+
+static void context3_destroy(worley_context3 *context) {
+  worley_cell_cache_destroy(context->cells);
+  free(context);
+}
+
+static const char *measure_names[5] = { "linear", "linear_squared", "manhattan", "minkowski", "chebyshev" };
+
+static void bench_functions(const bench_options *o, worley_vec2 **pts2, worley_vec3 **pts3) {
+  int n = o->n;
+  char name[128];
+  bench_result r;
+  memset(&r, 0, sizeof(r));
+
+  float p = o->params.minkowski_p;
+  for(int m = DIST_LINEAR; m <= DIST_CHEBYSHEV; ++m) {
+    snprintf(name, sizeof(name), "distance/%s", measure_names[m]);
+    if(selected(o, name)) {
+      float acc = 0;
+      BENCH_LOOP(o, r, n - 1, acc += m == DIST_MINKOWSKI ? dist_minkowski(p, &pts2[PATTERN_RANDOM][i], &pts2[PATTERN_RANDOM][i + 1])
+                                    : distance((dist_measure)m, &pts2[PATTERN_RANDOM][i], &pts2[PATTERN_RANDOM][i + 1]))
+      sink = acc;
+      report(name, &r);
+    }
+    snprintf(name, sizeof(name), "distance3/%s", measure_names[m]);
+    if(selected(o, name)) {
+      float acc = 0;
+      BENCH_LOOP(o, r, n - 1, acc += m == DIST_MINKOWSKI ? dist_minkowski3(p, &pts3[PATTERN_RANDOM][i], &pts3[PATTERN_RANDOM][i + 1])
+                                    : distance3((dist_measure)m, &pts3[PATTERN_RANDOM][i], &pts3[PATTERN_RANDOM][i + 1]))
+      sink = acc;
+      report(name, &r);
+    }
+  }
+
+  if(selected(o, "scaling_function")) {
+    float acc = 0;
+    BENCH_LOOP(o, r, n, acc += scaling_function(pts2[PATTERN_RANDOM][i].u))
+    sink = acc;
+    report("scaling_function", &r);
+  }
+
+  worley_generator gen;
+  worley_generator_init(&gen, &o->params, worley_cube_dist(&o->params, 2));
+  for(int p = 0; p < PATTERN_COUNT; ++p) {
+    snprintf(name, sizeof(name), "update_cache/%s", pattern_names[p]);
+    if(selected(o, name)) {
+      worley_context2 *context = context2_create(o);
+      BENCH_LOOP(o, r, n, {
+        worley_cell2 cell = point_cell(&pts2[p][i], gen.cube_dist);
+        update_cache(context, &gen, &cell);
+      })
+      r.stats = context->stats;
+      context2_destroy(context);
+      report(name, &r);
+    }
+    snprintf(name, sizeof(name), "update_cache3/%s", pattern_names[p]);
+    if(selected(o, name)) {
+      worley_context3 *context = context3_create(o);
+      BENCH_LOOP(o, r, n, {
+        worley_cell3 cell = point_cell3(&pts3[p][i], gen.cube_dist);
+        update_cache3(context, &gen, &cell);
+      })
+      r.stats = context->stats;
+      context3_destroy(context);
+      report(name, &r);
+    }
+  }
+
+  for(int m = DIST_LINEAR; m <= DIST_CHEBYSHEV; ++m) {
+    worley_params params = o->params;
+    params.distance_measure = (dist_measure)m;
+    for(int p = 0; p < PATTERN_COUNT; ++p) {
+      snprintf(name, sizeof(name), "point_distances/%s/%s", measure_names[m], pattern_names[p]);
+      if(selected(o, name)) {
+        worley_context2 *context = context2_create(o);
+        float acc = 0;
+        BENCH_LOOP(o, r, n, {
+          worley_result2 res;
+          point_distances(context, &params, &pts2[p][i], &res);
+          acc += res.f1;
+        })
+        sink = acc;
+        r.stats = context->stats;
+        context2_destroy(context);
+        report(name, &r);
+      }
+      snprintf(name, sizeof(name), "point_distances3/%s/%s", measure_names[m], pattern_names[p]);
+      if(selected(o, name)) {
+        worley_context3 *context = context3_create(o);
+        float acc = 0;
+        BENCH_LOOP(o, r, n, {
+          worley_result3 res;
+          point_distances3(context, &params, &pts3[p][i], &res);
+          acc += res.f1;
+        })
+        sink = acc;
+        r.stats = context->stats;
+        context3_destroy(context);
+        report(name, &r);
+      }
+    }
+  }
+}
+
+static void bench_shaders(const bench_options *o, worley_vec2 **pts2, worley_vec3 **pts3) {
+  int n = o->n;
+  char name[128];
+  bench_result r;
+  memset(&r, 0, sizeof(r));
+
+  for(int dims = 2; dims <= 3; ++dims)
+  for(int m = DIST_LINEAR; m <= DIST_CHEBYSHEV; ++m)
+  for(int mode = DIST_F1; mode <= DIST_F1_P_F2_P_F3; ++mode)
+  for(int jagged = 0; jagged <= 1; ++jagged)
+  for(int p = 0; p < PATTERN_COUNT; ++p) {
+    snprintf(name, sizeof(name), "%s/%s/mode%d/%s/%s", dims == 2 ? "worleynoise" : "worleynoise3d",
+             measure_names[m], mode, jagged ? "jagged" : "smooth", pattern_names[p]);
+    if(!selected(o, name))
+      continue;
+
+    worley_params params = o->params;
+    params.distance_measure = (dist_measure)m;
+    params.distance_mode = (dist_mode)mode;
+    params.jagged_gap = jagged;
+    worley_evaluator *eval = worley_evaluator_create(&params, dims);
+    if(!eval) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    float acc = 0;
+    if(dims == 2) {
+      worley_context2 *context = context2_create(o);
+      BENCH_LOOP(o, r, n, acc += worley_evaluator_val(eval, context, &pts2[p][i]))
+      r.stats = context->stats;
+      context2_destroy(context);
+    }
+    else {
+      worley_context3 *context = context3_create(o);
+      BENCH_LOOP(o, r, n, acc += worley_evaluator_val3(eval, context, &pts3[p][i]))
+      r.stats = context->stats;
+      context3_destroy(context);
+    }
+    worley_evaluator_destroy(eval);
+    sink = acc;
+    report(name, &r);
+  }
+}
+
+// the packet interface, WORLEY_PACKET consecutive points of a pattern at a time
+static void bench_packets(const bench_options *o, worley_vec2 **pts2, worley_vec3 **pts3) {
+  int packets = o->n / WORLEY_PACKET;
+  char name[128];
+  bench_result r;
+  memset(&r, 0, sizeof(r));
+
+  for(int dims = 2; dims <= 3; ++dims)
+  for(int m = DIST_LINEAR; m <= DIST_CHEBYSHEV; ++m)
+  for(int jagged = 0; jagged <= 1; ++jagged)
+  for(int p = 0; p < PATTERN_COUNT; ++p) {
+    snprintf(name, sizeof(name), "%s/%s/%s/%s", dims == 2 ? "worleynoise_packet" : "worleynoise3d_packet",
+             measure_names[m], jagged ? "jagged" : "smooth", pattern_names[p]);
+    if(!selected(o, name))
+      continue;
+
+    worley_params params = o->params;
+    params.distance_measure = (dist_measure)m;
+    params.jagged_gap = jagged;
+    float values[WORLEY_PACKET], acc = 0;
+    if(dims == 2) {
+      worley_context2 *context = context2_create(o);
+      BENCH_LOOP(o, r, packets, worleynoise_packet(context, &params, &pts2[p][i * WORLEY_PACKET], WORLEY_PACKET, values);
+                                acc += values[0])
+      r.stats = context->stats;
+      context2_destroy(context);
+    }
+    else {
+      worley_context3 *context = context3_create(o);
+      BENCH_LOOP(o, r, packets, worleynoise3d_packet(context, &params, NULL, &pts3[p][i * WORLEY_PACKET], WORLEY_PACKET, values);
+                                acc += values[0])
+      r.stats = context->stats;
+      context3_destroy(context);
+    }
+    r.samples *= WORLEY_PACKET;
+    sink = acc;
+    report(name, &r);
+  }
+}
+
+// the compact cell cache against the float one, on the random pattern
+static void report_accuracy(const bench_options *o, worley_vec2 **pts2, worley_vec3 **pts3) {
+  bench_options exact = *o;
+  exact.cells = WORLEY_CELLS_FLOAT;
+  worley_context2 *c2 = context2_create(o), *e2 = context2_create(&exact);
+  worley_context3 *c3 = context3_create(o), *e3 = context3_create(&exact);
+  if(!c2 || !e2 || !c3 || !e3 || !c2->cells || !e2->cells || !c3->cells || !e3->cells) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  printf("# cell cache: %d cubes in %zu bytes (float: %zu)\n", (int)worley_cell_cache_capacity(c3->cells),
+         worley_cell_cache_bytes(c3->cells), worley_cell_cache_bytes(e3->cells));
+  printf("# accuracy\tmax error\tmean error\tgap flips\n");
+  char name[128];
+  for(int dims = 2; dims <= 3; ++dims)
+  for(int m = DIST_LINEAR; m <= DIST_CHEBYSHEV; ++m)
+  for(int mode = DIST_F1; mode <= DIST_F1_P_F2_P_F3; ++mode) {
+    worley_params params = o->params;
+    params.distance_measure = (dist_measure)m;
+    params.distance_mode = (dist_mode)mode;
+    double max = 0, sum = 0;
+    int flips = 0;
+    for(int i = 0; i < o->n; ++i) {
+      float a, b;
+      if(dims == 2) {
+        a = worleynoise_val(c2, &params, &pts2[PATTERN_RANDOM][i]);
+        b = worleynoise_val(e2, &params, &pts2[PATTERN_RANDOM][i]);
+      }
+      else {
+        a = worleynoise3d_val(c3, &params, &pts3[PATTERN_RANDOM][i]);
+        b = worleynoise3d_val(e3, &params, &pts3[PATTERN_RANDOM][i]);
+      }
+      if((a < 0) != (b < 0)) {
+        ++flips;
+        continue;
+      }
+      double err = fabs((double)a - b);
+      max = err > max ? err : max;
+      sum += err;
+    }
+    snprintf(name, sizeof(name), "%s/%s/mode%d", dims == 2 ? "worleynoise" : "worleynoise3d", measure_names[m], mode);
+    printf("# %s\t%.3g\t%.3g\t%.2g\n", name, max, sum / o->n, (double)flips / o->n);
+  }
+  context2_destroy(c2);
+  context2_destroy(e2);
+  context3_destroy(c3);
+  context3_destroy(e3);
+}
+
+static int parse_args(bench_options *o, int argc, char **argv) {
+  for(int i = 1; i < argc; ++i) {
+    char *eq = strchr(argv[i], '=');
+    if(!eq)
+      return 0;
+    *eq = '\0';
+    const char *value = eq + 1;
+    if(!strcmp(argv[i], "time")) o->time = atof(value);
+    else if(!strcmp(argv[i], "n")) o->n = atoi(value);
+    else if(!strcmp(argv[i], "filter")) o->filter = value;
+    else if(!strcmp(argv[i], "point_generator")) o->params.point_gen = (worley_point_gen)atoi(value);
+    else if(!strcmp(argv[i], "search")) o->params.search = (worley_search)atoi(value);
+    else if(!strcmp(argv[i], "scale")) o->params.scale = atof(value);
+    else if(!strcmp(argv[i], "minkowski_p")) o->params.minkowski_p = atof(value);
+    else if(!strcmp(argv[i], "cells")) {
+      if(!strcmp(value, "float")) o->cells = WORLEY_CELLS_FLOAT;
+      else if(!strcmp(value, "16")) o->cells = WORLEY_CELLS_16;
+      else if(!strcmp(value, "8")) o->cells = WORLEY_CELLS_8;
+      else return 0;
+    }
+    else return 0;
+  }
+  return o->time > 0 && o->n > 1 && o->params.scale > 0;
+}
+
+int main(int argc, char **argv) {
+  bench_options o;
+  o.time = 0.1;
+  o.n = 65536;
+  o.filter = NULL;
+  o.cells = WORLEY_CELLS_FLOAT;
+  worley_params_default(&o.params);
+  if(!parse_args(&o, argc, argv)) {
+    fprintf(stderr, "usage: worley_bench [time=seconds] [n=samples] [filter=substring] [point_generator=0|1] [search=0|1|2] [scale=s] [minkowski_p=p] [cells=float|16|8]\n");
+    return 1;
+  }
+
+  worley_vec2 *pts2[PATTERN_COUNT];
+  worley_vec3 *pts3[PATTERN_COUNT];
+  for(int p = 0; p < PATTERN_COUNT; ++p) {
+    pts2[p] = pattern_points2((pattern)p, o.n);
+    pts3[p] = pattern_points3((pattern)p, o.n);
+    if(!pts2[p] || !pts3[p]) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+  }
+
+  printf("# isa %s, point_generator %d, search %d, minkowski_p %g, %d samples per pattern\n", worley_isa(), o.params.point_gen,
+         o.params.search, o.params.minkowski_p, o.n);
+  if(o.cells != WORLEY_CELLS_FLOAT)
+    report_accuracy(&o, pts2, pts3);
+  printf("# name\tMsamples/s\tns/sample\twindow reuse\tcell cache hit rate\n");
+  bench_functions(&o, pts2, pts3);
+  bench_shaders(&o, pts2, pts3);
+  bench_packets(&o, pts2, pts3);
+
+  for(int p = 0; p < PATTERN_COUNT; ++p) {
+    free(pts2[p]);
+    free(pts3[p]);
+  }
+  return 0;
+}
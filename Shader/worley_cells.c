@@ -0,0 +1,263 @@
+/*
+ * Multi-entry cache of generated cubes, keyed on integer cube coordinates.
+ *
+ * The 3^DIMENSIONS window of a context only remembers the neighbourhood of the last sample.
+ * Ray traced reflections, refractions and bucket-order shading jump between regions,
+ * so a context can additionally keep recently generated cubes here (see worley_context3.cells).
+ * It is 4-way set associative with LRU replacement within a set.
+ * An entry is the cube's coordinates packed into one 64 bit key and its points; the LRU stamps are kept apart, a set's
+ * four next to each other. The compact formats (see worley_cell_format) store the coordinates of the points as fixed
+ * point offsets in their cube, so more cubes fit into the same memory. They are decoded on the way into the window,
+ * which stays in float: only the memory of the cell cache shrinks, not that of the window the searches run over.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "worley.h"
+#include "worley_cells.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+#define WAYS 4
+
+// bits per cube coordinate in the key. Cubes farther out than KEY_MAX from the origin are not cached.
+#define KEY_BITS 21
+#define KEY_MAX ((1 << (KEY_BITS - 1)) - 1)
+#define KEY_MASK ((1u << KEY_BITS) - 1)
+
+// followed by the points: 3 * PTS_PER_CUBE coordinates (xs, ys, zs) in the format of the cache
+struct worley_cell_entry {
+  uint64_t key; // the cube's coordinates, KEY_BITS each (see cell_key)
+};
+
+// bytes per coordinate and fixed point steps per cube, by worley_cell_format.
+// The compact formats have one code more than steps: it marks the empty slots, whose points are at infinity.
+static const size_t coord_bytes[] = { sizeof(float), sizeof(uint16_t), sizeof(uint8_t) };
+static const float coord_steps[] = { 0, 65535.0f, 255.0f };
+
+struct worley_cell_cache {
+  size_t sets; // power of two
+  size_t capacity;
+  size_t stride; // bytes per entry, a multiple of 8
+  worley_cell_format format;
+  uint32_t clock;
+  // what the cached points were generated with. If it changes, the cache is flushed.
+  int valid;
+  worley_generator gen;
+  uint32_t *stamps; // last use of every entry; 0 for empty entries
+  unsigned char *entries; // capacity entries, then one for the cubes out of the keys' range, which never hits
+};
+
+static worley_cell_entry *entry_at(const worley_cell_cache *cache, size_t i) {
+  return (worley_cell_entry *)(cache->entries + i * cache->stride);
+}
+
+static size_t format_stride(worley_cell_format format) {
+  return (sizeof(worley_cell_entry) + 3 * PTS_PER_CUBE * coord_bytes[format] + 7) / 8 * 8;
+}
+
+void *worley_aligned_alloc(size_t size) {
+  size = (size + WORLEY_LINE_PAIR - 1) / WORLEY_LINE_PAIR * WORLEY_LINE_PAIR;
+#ifdef _MSC_VER
+  return _aligned_malloc(size, WORLEY_LINE_PAIR);
+#else
+  void *mem;
+  return posix_memalign(&mem, WORLEY_LINE_PAIR, size) == 0 ? mem : NULL;
+#endif
+}
+
+void worley_aligned_free(void *mem) {
+#ifdef _MSC_VER
+  _aligned_free(mem);
+#else
+  free(mem);
+#endif
+}
+
+// the header and the entries are aligned, so the caches of different threads never share a cache line
+worley_cell_cache *worley_cell_cache_create(size_t capacity, worley_cell_format format) {
+  if(format < WORLEY_CELLS_FLOAT || format > WORLEY_CELLS_8)
+    return NULL;
+  worley_cell_cache *cache = worley_aligned_alloc(sizeof(worley_cell_cache));
+  if(!cache)
+    return NULL;
+  size_t sets = 1;
+  while(sets * WAYS < capacity)
+    sets *= 2;
+  cache->sets = sets;
+  cache->capacity = sets * WAYS;
+  cache->stride = format_stride(format);
+  cache->format = format;
+  cache->clock = 0;
+  cache->valid = 0;
+  cache->stamps = worley_aligned_alloc(cache->capacity * sizeof(uint32_t));
+  cache->entries = worley_aligned_alloc((cache->capacity + 1) * cache->stride);
+  if(!cache->stamps || !cache->entries) {
+    worley_aligned_free(cache->stamps);
+    worley_aligned_free(cache->entries);
+    worley_aligned_free(cache);
+    return NULL;
+  }
+  worley_cell_cache_clear(cache);
+  return cache;
+}
+
+void worley_cell_cache_destroy(worley_cell_cache *cache) {
+  if(cache) {
+    worley_aligned_free(cache->stamps);
+    worley_aligned_free(cache->entries);
+    worley_aligned_free(cache);
+  }
+}
+
+size_t worley_cell_cache_capacity(const worley_cell_cache *cache) {
+  return cache->capacity;
+}
+
+size_t worley_cell_cache_bytes(const worley_cell_cache *cache) {
+  return sizeof(worley_cell_cache) + cache->capacity * (cache->stride + sizeof(uint32_t)) + cache->stride;
+}
+
+size_t worley_cell_format_bytes(worley_cell_format format) {
+  return format_stride(format) + sizeof(uint32_t);
+}
+
+void worley_cell_cache_clear(worley_cell_cache *cache) {
+  memset(cache->stamps, 0, cache->capacity * sizeof(uint32_t));
+}
+
+// the key of cube (x, y, z); 0 if it is out of range
+static int cell_key(int x, int y, int z, uint64_t *key) {
+  if(x < -KEY_MAX || x > KEY_MAX || y < -KEY_MAX || y > KEY_MAX || z < -KEY_MAX || z > KEY_MAX)
+    return 0;
+  *key = (uint64_t)((uint32_t)x & KEY_MASK) | (uint64_t)((uint32_t)y & KEY_MASK) << KEY_BITS
+       | (uint64_t)((uint32_t)z & KEY_MASK) << 2 * KEY_BITS;
+  return 1;
+}
+
+// coordinate a of a key
+static int key_coord(uint64_t key, int a) {
+  int c = (int)(key >> a * KEY_BITS & KEY_MASK);
+  return c > KEY_MAX ? c - (1 << KEY_BITS) : c;
+}
+
+static uint32_t cell_hash(int x, int y, int z) {
+  uint32_t h = (uint32_t)x * 0x8da6b343U ^ (uint32_t)y * 0xd8163841U ^ (uint32_t)z * 0xcb1ab31fU;
+  h ^= h >> 16; h *= 0x7feb352dU;
+  h ^= h >> 15;
+  return h;
+}
+
+worley_cell_entry *worley_cell_cache_lookup(worley_cell_cache *cache, const worley_generator *gen,
+                                            int x, int y, int z, int *hit) {
+  if(!cache->valid || !worley_generator_equal(&cache->gen, gen)) {
+    worley_cell_cache_clear(cache);
+    cache->gen = *gen;
+    cache->valid = 1;
+  }
+
+  uint64_t key;
+  if(!cell_key(x, y, z, &key)) {
+    *hit = 0;
+    return entry_at(cache, cache->capacity);
+  }
+  // once the clock wraps, the stamps start over
+  if(++cache->clock == 0) {
+    worley_cell_cache_clear(cache);
+    cache->clock = 1;
+  }
+  size_t set = (cell_hash(x, y, z) & (cache->sets - 1)) * WAYS, victim = set;
+  uint32_t *stamps = cache->stamps;
+  for(size_t w = set; w < set + WAYS; ++w) {
+    worley_cell_entry *e = entry_at(cache, w);
+    if(stamps[w] && e->key == key) {
+      stamps[w] = cache->clock;
+      *hit = 1;
+      return e;
+    }
+    if(stamps[w] < stamps[victim])
+      victim = w;
+  }
+
+  stamps[victim] = cache->clock;
+  entry_at(cache, victim)->key = key;
+  *hit = 0;
+  return entry_at(cache, victim);
+}
+
+// Fixed point offsets: coordinate q of a cube stands for the middle of its step, origin + (q + 0.5) * step,
+// so no coordinate is off by more than half a step. The cubes out of the keys' range keep their points as generated.
+void worley_cell_cache_store(const worley_cell_cache *cache, worley_cell_entry *entry, float *pts, int dims) {
+  if(entry == entry_at(cache, cache->capacity))
+    return;
+  if(cache->format == WORLEY_CELLS_FLOAT) {
+    memcpy(entry + 1, pts, sizeof(float) * 3 * PTS_PER_CUBE);
+    return;
+  }
+  // the slots at infinity are empty in every coordinate
+  int present[PTS_PER_CUBE];
+  for(int k = 0; k < PTS_PER_CUBE; ++k)
+    present[k] = pts[k] < INFINITY;
+
+  float cube_dist = cache->gen.cube_dist, steps = coord_steps[cache->format];
+  float to_steps = steps / cube_dist, step = cube_dist / steps;
+  uint16_t *q16 = (uint16_t *)(entry + 1);
+  uint8_t *q8 = (uint8_t *)(entry + 1);
+  // clamped without branches, so the loops vectorize
+  float last = steps - 1;
+  for(int a = 0; a < dims; ++a) {
+    float origin = key_coord(entry->key, a) * cube_dist;
+    float *p = pts + a * PTS_PER_CUBE;
+    int q[PTS_PER_CUBE];
+    for(int k = 0; k < PTS_PER_CUBE; ++k) {
+      float o = (p[k] - origin) * to_steps;
+      o = o > 0 ? o : 0;
+      q[k] = present[k] ? (int)(o < last ? o : last) : (int)steps;
+    }
+    if(cache->format == WORLEY_CELLS_16)
+      for(int k = 0; k < PTS_PER_CUBE; ++k)
+        q16[a * PTS_PER_CUBE + k] = (uint16_t)q[k];
+    else
+      for(int k = 0; k < PTS_PER_CUBE; ++k)
+        q8[a * PTS_PER_CUBE + k] = (uint8_t)q[k];
+    // decoded like worley_cell_cache_load
+    for(int k = 0; k < PTS_PER_CUBE; ++k)
+      p[k] = present[k] ? origin + (q[k] + 0.5f) * step : INFINITY;
+  }
+}
+
+void worley_cell_cache_load(const worley_cell_cache *cache, const worley_cell_entry *entry, int points,
+                            float *xs, float *ys, float *zs) {
+  float *out[3] = { xs, ys, zs };
+  int dims = zs ? 3 : 2;
+  if(cache->format == WORLEY_CELLS_FLOAT) {
+    const float *pts = (const float *)(entry + 1);
+    for(int a = 0; a < dims; ++a)
+      for(int k = 0; k < points; ++k)
+        out[a][k] = pts[a * PTS_PER_CUBE + k];
+    return;
+  }
+
+  float cube_dist = cache->gen.cube_dist, steps = coord_steps[cache->format], step = cube_dist / steps;
+  int empty = (int)steps;
+  const uint16_t *q16 = (const uint16_t *)(entry + 1);
+  const uint8_t *q8 = (const uint8_t *)(entry + 1);
+  for(int a = 0; a < dims; ++a) {
+    float origin = key_coord(entry->key, a) * cube_dist, *o = out[a];
+    const uint16_t *a16 = q16 + a * PTS_PER_CUBE;
+    const uint8_t *a8 = q8 + a * PTS_PER_CUBE;
+    if(cache->format == WORLEY_CELLS_16)
+      for(int k = 0; k < points; ++k)
+        o[k] = a16[k] == empty ? INFINITY : origin + (a16[k] + 0.5f) * step;
+    else
+      for(int k = 0; k < points; ++k)
+        o[k] = a8[k] == empty ? INFINITY : origin + (a8[k] + 0.5f) * step;
+  }
+}
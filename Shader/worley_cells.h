@@ -0,0 +1,32 @@
+/*
+ * Multi-entry cube cache (internal to the core). See worley_cells.c.
+ */
+
+#ifndef WORLEY_CELLS_H
+#define WORLEY_CELLS_H
+
+#include "worley.h"
+
+typedef struct worley_cell_entry worley_cell_entry;
+
+// Returns the entry of cube (x, y, z). On a hit (*hit = 1) it holds the cube's points, otherwise it was just claimed
+// for the cube (evicting the least recently used cube of its set) and the caller has to fill it with worley_cell_cache_store.
+worley_cell_entry *worley_cell_cache_lookup(worley_cell_cache *cache, const worley_generator *gen,
+                                            int x, int y, int z, int *hit);
+
+// pts: 3 * PTS_PER_CUBE floats as generate_cell3 writes them, first the xs, then ys, then zs (2D: us, vs, the rest unused).
+// In the compact formats, pts is replaced by the points as worley_cell_cache_load would decode them, so the caller
+// can take them from there instead of reading back the entry it just wrote.
+void worley_cell_cache_store(const worley_cell_cache *cache, worley_cell_entry *entry, float *pts, int dims);
+
+// the first `points` points of the entry, decoded into xs, ys (and zs in 3D, NULL in 2D)
+void worley_cell_cache_load(const worley_cell_cache *cache, const worley_cell_entry *entry, int points,
+                            float *xs, float *ys, float *zs);
+
+// storage that starts on its own pair of cache lines (the adjacent line prefetcher fetches lines in pairs),
+// for state that one thread writes while others write their own copies
+#define WORLEY_LINE_PAIR 128
+void *worley_aligned_alloc(size_t size);
+void worley_aligned_free(void *mem);
+
+#endif
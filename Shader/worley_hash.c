@@ -0,0 +1,76 @@
+/*
+ * Feature points from an integer hash of the cube coordinates (WORLEY_GEN_HASH).
+ *
+ * In contrast to the noise-seeded points of generate_cell, each coordinate costs one PCG hash
+ * (a few multiplies, shifts and xors), points are uniformly distributed in their cube,
+ * and the loops have no data-dependent branches, so the compiler can vectorize them.
+ * Optionally, the number of points per cube is Poisson distributed as in Worley's paper.
+ */
+
+#include "worley.h"
+
+#include <math.h>
+#include <stdint.h>
+
+// PCG-RXS-M-XS 32 bit output permutation of one LCG step
+static inline uint32_t pcg_hash(uint32_t v) {
+  uint32_t state = v * 747796405U + 2891336453U;
+  uint32_t word = ((state >> ((state >> 28U) + 4U)) ^ state) * 277803737U;
+  return (word >> 22U) ^ word;
+}
+
+// uniform in [0,1)
+static inline float unit_float(uint32_t h) {
+  return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// number of points in a cube for a Poisson distribution with the given mean, clamped to [1, max]
+// (max is the generator's points per cube, see worley_poisson_valid; Worley clamps to at least one point as well)
+static inline int poisson_count(float mean, float u, int max) {
+  if(mean <= 0)
+    return max;
+  float p = expf(-mean), cdf = p;
+  int n = 0;
+  while(u > cdf && n < max) {
+    ++n;
+    p *= mean / n;
+    cdf += p;
+  }
+  return n < 1 ? 1 : n;
+}
+
+void worley_hash_cells(const worley_cell2 *cells, int n, const worley_generator *gen, float *us, float *vs) {
+  float cube_dist = gen->cube_dist;
+  for(int j = 0; j < n; ++j) {
+    // with a period, cubes are hashed by their copy in [0, period)
+    uint32_t wu = worley_wrap_cell(cells[j].u, gen->period), wv = worley_wrap_cell(cells[j].v, gen->period);
+    uint32_t h = pcg_hash(wu ^ pcg_hash(wv ^ gen->seed));
+    int count = poisson_count(gen->poisson_mean, unit_float(pcg_hash(h)), gen->points);
+    float cu = cells[j].u * cube_dist, cv = cells[j].v * cube_dist;
+    for(int k = 0; k < PTS_PER_CUBE; ++k) {
+      float u = cu + unit_float(pcg_hash(h + 2 * k + 1)) * cube_dist;
+      float v = cv + unit_float(pcg_hash(h + 2 * k + 2)) * cube_dist;
+      us[j * PTS_PER_CUBE + k] = k < count ? u : INFINITY;
+      vs[j * PTS_PER_CUBE + k] = k < count ? v : INFINITY;
+    }
+  }
+}
+
+void worley_hash_cells3(const worley_cell3 *cells, int n, const worley_generator *gen, float *xs, float *ys, float *zs) {
+  float cube_dist = gen->cube_dist;
+  for(int j = 0; j < n; ++j) {
+    uint32_t wx = worley_wrap_cell(cells[j].x, gen->period), wy = worley_wrap_cell(cells[j].y, gen->period);
+    uint32_t wz = worley_wrap_cell(cells[j].z, gen->period);
+    uint32_t h = pcg_hash(wx ^ pcg_hash(wy ^ pcg_hash(wz ^ gen->seed)));
+    int count = poisson_count(gen->poisson_mean, unit_float(pcg_hash(h)), gen->points);
+    float cx = cells[j].x * cube_dist, cy = cells[j].y * cube_dist, cz = cells[j].z * cube_dist;
+    for(int k = 0; k < PTS_PER_CUBE; ++k) {
+      float x = cx + unit_float(pcg_hash(h + 3 * k + 1)) * cube_dist;
+      float y = cy + unit_float(pcg_hash(h + 3 * k + 2)) * cube_dist;
+      float z = cz + unit_float(pcg_hash(h + 3 * k + 3)) * cube_dist;
+      xs[j * PTS_PER_CUBE + k] = k < count ? x : INFINITY;
+      ys[j * PTS_PER_CUBE + k] = k < count ? y : INFINITY;
+      zs[j * PTS_PER_CUBE + k] = k < count ? z : INFINITY;
+    }
+  }
+}
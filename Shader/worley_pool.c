@@ -0,0 +1,115 @@
+/*
+ * Per-thread contexts for a known number of threads (see worley_context_pool_create in worley.h).
+ *
+ * All slots live in one block, allocated up front. Every slot starts on a fresh pair of cache lines,
+ * and so do the cell caches, so threads working on neighbouring slots never write to the same line.
+ */
+
+#include "worley.h"
+#include "worley_cells.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct worley_context_pool {
+  int slots;
+  int dims;
+  int contexts; // per slot
+  size_t stride; // bytes per slot, a multiple of WORLEY_LINE_PAIR
+  char *block;
+  worley_cell_cache **cells; // one per slot, or NULL
+  volatile long claimed; // slots handed out by worley_context_pool_claim
+};
+
+worley_context_pool *worley_context_pool_create(int slots, int dims, int contexts, size_t cell_cache_size,
+                                                worley_cell_format cell_format) {
+  if(slots < 1 || (dims != 2 && dims != 3) || contexts < 1)
+    return NULL;
+  worley_context_pool *pool = calloc(1, sizeof(worley_context_pool));
+  if(!pool)
+    return NULL;
+  pool->slots = slots;
+  pool->dims = dims;
+  pool->contexts = contexts;
+  size_t bytes = (size_t)contexts * (dims == 2 ? sizeof(worley_context2) : sizeof(worley_context3));
+  pool->stride = (bytes + WORLEY_LINE_PAIR - 1) / WORLEY_LINE_PAIR * WORLEY_LINE_PAIR;
+  pool->block = worley_aligned_alloc(pool->stride * slots);
+  pool->cells = calloc(slots, sizeof(worley_cell_cache *));
+  if(!pool->block || !pool->cells) {
+    worley_context_pool_destroy(pool);
+    return NULL;
+  }
+  memset(pool->block, 0, pool->stride * slots);
+
+  for(int s = 0; s < slots; ++s) {
+    if(cell_cache_size > 0 && !(pool->cells[s] = worley_cell_cache_create(cell_cache_size, cell_format))) {
+      worley_context_pool_destroy(pool);
+      return NULL;
+    }
+    for(int c = 0; c < contexts; ++c) {
+      if(dims == 2) {
+        worley_context2 *context = (worley_context2 *)(pool->block + s * pool->stride) + c;
+        worley_context2_init(context);
+        context->cells = pool->cells[s];
+      }
+      else {
+        worley_context3 *context = (worley_context3 *)(pool->block + s * pool->stride) + c;
+        worley_context3_init(context);
+        context->cells = pool->cells[s];
+      }
+    }
+  }
+  return pool;
+}
+
+void worley_context_pool_destroy(worley_context_pool *pool) {
+  if(!pool)
+    return;
+  if(pool->cells)
+    for(int s = 0; s < pool->slots; ++s)
+      worley_cell_cache_destroy(pool->cells[s]);
+  free(pool->cells);
+  if(pool->block)
+    worley_aligned_free(pool->block);
+  free(pool);
+}
+
+int worley_context_pool_slots(const worley_context_pool *pool) {
+  return pool->slots;
+}
+
+worley_context2 *worley_context_pool_get2(worley_context_pool *pool, int slot) {
+  if(pool->dims != 2 || slot < 0 || slot >= pool->slots)
+    return NULL;
+  return (worley_context2 *)(pool->block + slot * pool->stride);
+}
+
+worley_context3 *worley_context_pool_get3(worley_context_pool *pool, int slot) {
+  if(pool->dims != 3 || slot < 0 || slot >= pool->slots)
+    return NULL;
+  return (worley_context3 *)(pool->block + slot * pool->stride);
+}
+
+int worley_context_pool_claim(worley_context_pool *pool) {
+#ifdef _MSC_VER
+  long slot = _InterlockedExchangeAdd(&pool->claimed, 1);
+#else
+  long slot = __atomic_fetch_add(&pool->claimed, 1, __ATOMIC_RELAXED);
+#endif
+  return slot < pool->slots ? (int)slot : -1;
+}
+
+void worley_context_pool_stats(const worley_context_pool *pool, worley_cache_stats *total) {
+  memset(total, 0, sizeof(*total));
+  for(int s = 0; s < pool->slots; ++s) {
+    for(int c = 0; c < pool->contexts; ++c) {
+      worley_cache_stats_add(total, pool->dims == 2
+        ? &((const worley_context2 *)(pool->block + s * pool->stride) + c)->stats
+        : &((const worley_context3 *)(pool->block + s * pool->stride) + c)->stats);
+    }
+  }
+}
@@ -0,0 +1,51 @@
+/*
+ * Instrumentation of the hot paths (internal to the core).
+ *
+ * Only compiled in with -DWORLEY_PROFILE (make PROFILE=1). Without it, every macro below expands to nothing,
+ * so the counters it feeds (see worley_cache_stats) stay 0 and production builds don't pay for them.
+ */
+
+#ifndef WORLEY_PROFILE_H
+#define WORLEY_PROFILE_H
+
+#include "worley.h"
+
+#ifdef WORLEY_PROFILE
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define WORLEY_CLOCK "tsc"
+static inline unsigned long long worley_clock(void) { return __rdtsc(); }
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define WORLEY_CLOCK "tsc"
+static inline unsigned long long worley_clock(void) { return __rdtsc(); }
+#elif (defined(__aarch64__) || defined(__arm64__)) && (defined(__GNUC__) || defined(__clang__))
+#define WORLEY_CLOCK "cntvct"
+static inline unsigned long long worley_clock(void) {
+  unsigned long long t;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+}
+#else
+#include <time.h>
+#define WORLEY_CLOCK "clock"
+static inline unsigned long long worley_clock(void) { return (unsigned long long)clock(); }
+#endif
+
+// adds n to a counter of worley_cache_stats
+#define PROFILE_COUNT(stats, field, n) ((stats).field += (n))
+// times the statements from PROFILE_START to PROFILE_STOP (in one scope) into a counter
+#define PROFILE_START(t) unsigned long long t = worley_clock()
+#define PROFILE_STOP(stats, field, t) ((stats).field += worley_clock() - (t))
+
+#else
+
+#define WORLEY_CLOCK "none"
+#define PROFILE_COUNT(stats, field, n) ((void)0)
+#define PROFILE_START(t) ((void)0)
+#define PROFILE_STOP(stats, field, t) ((void)0)
+
+#endif
+
+#endif
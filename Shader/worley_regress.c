@@ -0,0 +1,543 @@
+/*
+ * worley_regress: reference images and determinism checks for the noise core, as a safety net for performance changes.
+ *
+ * usage: worley_regress record|compare|check [dir] [name=value ...]
+ *   record dir   renders the reference tiles into dir, one .pfm per case
+ *   compare dir  renders them again and compares them with the ones in dir
+ *   check        renders every case in several ways that have to agree bit for bit (no references needed)
+ *   size         tile size in pixels (default 64)
+ *   tol          largest allowed difference of a value in compare (default 1e-5)
+ *   flips        pixels a case may move into or out of the gap in compare (default 0)
+ *   filter       only the cases whose name contains this string
+ *
+ * The cases are every combination of 2D/3D, distance measure, distance mode (named like the images in Voronoi/results:
+ * f1, f2-f1, 2f1+f2div3, 2f3-f2-f1div2, f1+f2+f3), jagged gap off/on and point generator, e.g 3d_manhattan_f2-f1_jagged_hash,
+ * plus a few for the other parameters (density, points per cube, period, minkowski p, axis weights, scaleX, seed,
+ * poisson mean, the exact gap test, filtered and fractal evaluation).
+ * A tile is the shader's value over a fixed region of the uv plane (3D: at a fixed z), negative in the gap.
+ * Filtered cases store the value faded to -1 over the gap coverage.
+ *
+ * compare prints one line per case that is off (largest and mean difference, pixels that moved into or out of the gap)
+ * and a summary. A case fails if its .pfm in dir is missing, if the magnitude of a value differs by more than tol,
+ * or if more than flips pixels moved into or out of the gap. The values go through expf, powf and the like,
+ * so another compiler or libm moves them by a few ulps; only check, which compares renderings of one build, is bit-exact.
+ * A change of the look shows as pixels off by far more than tol, or as many flips. The committed references are in
+ * worley_regress_ref/; after an intended change of the look, record into a scratch directory, look at the differences
+ * and commit the new tiles with the change. The 2D tiles of the original look (noise point generator; linear, linear
+ * squared and manhattan; every distance mode) were recorded from the core as it was first split out of the shaders,
+ * the 3D ones from the first core without seams at the cube borders.
+ *
+ * check renders every case scanline by scanline on one thread with a float cell cache, and then
+ *   reverse, shuffled  in reverse and in random pixel order
+ *   threads=2,3,8      rows interleaved over that many threads, each with its own slot of a worley_context_pool
+ *   no cell cache      contexts without a cell cache
+ *   pruned             with the other search (worley_search)
+ *   separate           jagged cases only: with a search of its own for the jagged gap point (WORLEY_SEARCH_SEPARATE),
+ *                      the way it was done before the sample and gap points shared one pass, in 2D and 3D
+ *   batch, packet      through worleynoise_batch and worleynoise_packet (value cases only)
+ * Every one has to equal the first rendering bit for bit.
+ *
+ * The exit code is 1 if any case fails.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "worley.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGRESS_CELL_CACHE_SIZE 4096
+#define REGRESS_MAX_CASES 256
+
+// the region of the tiles: REGRESS_EXTENT square from REGRESS_U0/V0, about 12 cubes across at scale 1
+#define REGRESS_U0 0.13f
+#define REGRESS_V0 0.07f
+#define REGRESS_Z 0.37f
+#define REGRESS_EXTENT 0.6f
+
+/************* Cases *************/
+
+typedef enum case_kind { CASE_VALUE, CASE_FILTERED, CASE_FRACTAL } case_kind;
+
+typedef struct regress_case {
+  char name[80];
+  int dims;
+  case_kind kind;
+  worley_params params;
+  worley_fractal fractal; // CASE_FRACTAL only
+} regress_case;
+
+static const char *measure_names[] = { "linear", "linear_squared", "manhattan", "minkowski", "chebyshev" };
+static const char *mode_names[] = { "f1", "f2-f1", "2f1+f2div3", "2f3-f2-f1div2", "f1+f2+f3" };
+static const char *gen_names[] = { "noise", "hash" };
+
+static regress_case *add_case(regress_case *cases, int *n, int dims, case_kind kind, const char *name) {
+  regress_case *c = &cases[(*n)++];
+  snprintf(c->name, sizeof(c->name), "%dd_%s", dims, name);
+  c->dims = dims;
+  c->kind = kind;
+  worley_params_default(&c->params);
+  worley_fractal_default(&c->fractal, c->params.distance_mode);
+  return c;
+}
+
+static int build_cases(regress_case *cases) {
+  int n = 0;
+  char name[64];
+  for(int dims = 2; dims <= 3; ++dims) {
+    for(int m = 0; m < 5; ++m)
+      for(int mode = 0; mode < 5; ++mode)
+        for(int jagged = 0; jagged < 2; ++jagged)
+          for(int gen = 0; gen < 2; ++gen) {
+            snprintf(name, sizeof(name), "%s_%s_%s_%s", measure_names[m], mode_names[mode], jagged ? "jagged" : "smooth",
+                     gen_names[gen]);
+            regress_case *c = add_case(cases, &n, dims, CASE_VALUE, name);
+            c->params.distance_measure = m;
+            c->params.distance_mode = mode;
+            c->params.jagged_gap = jagged;
+            c->params.point_gen = gen;
+          }
+
+    regress_case *c = add_case(cases, &n, dims, CASE_VALUE, "density2_points1");
+    c->params.density = 2;
+    c->params.points_per_cube = 1;
+    c = add_case(cases, &n, dims, CASE_VALUE, "points3_jagged");
+    c->params.points_per_cube = 3;
+    c->params.jagged_gap = 1;
+    c = add_case(cases, &n, dims, CASE_VALUE, "period4_jagged");
+    c->params.period = 4;
+    c->params.jagged_gap = 1;
+    c = add_case(cases, &n, dims, CASE_VALUE, "minkowski1.5_f2-f1");
+    c->params.distance_measure = DIST_MINKOWSKI;
+    c->params.minkowski_p = 1.5f;
+    c->params.distance_mode = DIST_F2_M_F1;
+    c = add_case(cases, &n, dims, CASE_VALUE, "weights_jagged");
+    c->params.axis_weights[0] = 2;
+    c->params.axis_weights[1] = 0.75f;
+    c->params.axis_weights[2] = 1.5f;
+    c->params.jagged_gap = 1;
+    c = add_case(cases, &n, dims, CASE_VALUE, "seed7_poisson2.5");
+    c->params.point_gen = WORLEY_GEN_HASH;
+    c->params.seed = 7;
+    c->params.poisson_mean = 2.5f;
+    for(int m = 0; m < 5; ++m)
+      for(int jagged = 0; jagged < 2; ++jagged) {
+        snprintf(name, sizeof(name), "exact_%s_%s", measure_names[m], jagged ? "jagged" : "smooth");
+        c = add_case(cases, &n, dims, CASE_VALUE, name);
+        c->params.gap_test = WORLEY_GAP_EXACT;
+        c->params.distance_measure = m;
+        c->params.jagged_gap = jagged;
+      }
+    c = add_case(cases, &n, dims, CASE_FILTERED, "filtered_exact_manhattan_jagged");
+    c->params.gap_test = WORLEY_GAP_EXACT;
+    c->params.distance_measure = DIST_MANHATTAN;
+    c->params.jagged_gap = 1;
+    c = add_case(cases, &n, dims, CASE_FILTERED, "filtered_jagged");
+    c->params.jagged_gap = 1;
+    c = add_case(cases, &n, dims, CASE_FILTERED, "filtered_manhattan_f2-f1");
+    c->params.distance_measure = DIST_MANHATTAN;
+    c->params.distance_mode = DIST_F2_M_F1;
+    c = add_case(cases, &n, dims, CASE_FRACTAL, "fractal4");
+    c->fractal.octaves = 4;
+    c = add_case(cases, &n, dims, CASE_FRACTAL, "fractal3_modes_jagged");
+    c->params.jagged_gap = 1;
+    c->fractal.octaves = 3;
+    c->fractal.lacunarity = 3;
+    c->fractal.modes[1] = DIST_F2_M_F1;
+    c->fractal.modes[2] = DIST_F1_P_F2_P_F3;
+  }
+  regress_case *c = add_case(cases, &n, 3, CASE_VALUE, "scaleX0.5_scale2");
+  c->params.scaleX = 0.5f;
+  c->params.scale = 2;
+  return n;
+}
+
+/************* Rendering *************/
+
+typedef enum render_order { ORDER_SCANLINE, ORDER_REVERSE, ORDER_SHUFFLED, ORDER_BATCH, ORDER_PACKET } render_order;
+
+typedef struct renderer {
+  const regress_case *c;
+  worley_params params;
+  int size;
+  worley_context_pool *pool;
+  int threads;
+  float *out;
+} renderer;
+
+static float pixel_u(const renderer *r, int x) { return REGRESS_U0 + (x + 0.5f) * REGRESS_EXTENT / r->size; }
+static float pixel_v(const renderer *r, int y) { return REGRESS_V0 + (y + 0.5f) * REGRESS_EXTENT / r->size; }
+
+static float eval_pixel(const renderer *r, int slot, int x, int y) {
+  const regress_case *c = r->c;
+  float fp = REGRESS_EXTENT / r->size;
+  if(c->dims == 2) {
+    worley_context2 *contexts = worley_context_pool_get2(r->pool, slot);
+    worley_vec2 pt = { pixel_u(r, x), pixel_v(r, y) };
+    if(c->kind == CASE_FILTERED) {
+      worley_footprint2 footprint = { { fp, 0 }, { 0, fp } };
+      worley_filtered2 f;
+      worleynoise_filtered(contexts, &r->params, &pt, &footprint, &f);
+      return f.value * (1 - f.gap_coverage) - f.gap_coverage;
+    }
+    if(c->kind == CASE_FRACTAL)
+      return worleynoise_fractal(contexts, &r->params, &c->fractal, &pt, fp);
+    return worleynoise_val(contexts, &r->params, &pt);
+  }
+  worley_context3 *contexts = worley_context_pool_get3(r->pool, slot);
+  worley_vec3 pt = { pixel_u(r, x), pixel_v(r, y), REGRESS_Z };
+  if(c->kind == CASE_FILTERED) {
+    worley_footprint3 footprint = { { fp, 0, 0 }, { 0, fp, 0 } };
+    worley_filtered3 f;
+    worleynoise3d_filtered(contexts, &r->params, &pt, &footprint, &f);
+    return f.value * (1 - f.gap_coverage) - f.gap_coverage;
+  }
+  if(c->kind == CASE_FRACTAL)
+    return worleynoise3d_fractal(contexts, &r->params, &c->fractal, &pt, fp);
+  return worleynoise3d_val(contexts, &r->params, &pt);
+}
+
+// one row through worleynoise_batch or worleynoise_packet
+static void eval_row(const renderer *r, render_order order, int y) {
+  float *values = r->out + (size_t)y * r->size;
+  worley_vec2 *pts2 = malloc(sizeof(worley_vec2) * r->size);
+  worley_vec3 *pts3 = malloc(sizeof(worley_vec3) * r->size);
+  for(int x = 0; x < r->size; ++x) {
+    pts2[x].u = pts3[x].x = pixel_u(r, x);
+    pts2[x].v = pts3[x].y = pixel_v(r, y);
+    pts3[x].z = REGRESS_Z;
+  }
+  if(order == ORDER_BATCH) {
+    worley_batch_out out;
+    memset(&out, 0, sizeof(out));
+    out.value = values;
+    if(r->c->dims == 2)
+      worleynoise_batch(worley_context_pool_get2(r->pool, 0), &r->params, NULL, pts2, r->size, &out);
+    else
+      worleynoise3d_batch(worley_context_pool_get3(r->pool, 0), &r->params, NULL, pts3, r->size, &out);
+  } else if(r->c->dims == 2)
+    worleynoise_packet(worley_context_pool_get2(r->pool, 0), &r->params, pts2, r->size, values);
+  else
+    worleynoise3d_packet(worley_context_pool_get3(r->pool, 0), &r->params, NULL, pts3, r->size, values);
+  free(pts2);
+  free(pts3);
+}
+
+typedef struct render_thread {
+  const renderer *r;
+  int slot;
+} render_thread;
+
+static void *render_rows(void *arg) {
+  render_thread *t = arg;
+  const renderer *r = t->r;
+  for(int y = t->slot; y < r->size; y += r->threads)
+    for(int x = 0; x < r->size; ++x)
+      r->out[(size_t)y * r->size + x] = eval_pixel(r, t->slot, x, y);
+  return NULL;
+}
+
+// renders a case into out (size * size values, row by row). Returns 0 when out of memory.
+static int render(const regress_case *c, const worley_params *params, int size, render_order order, int threads,
+                  size_t cell_cache_size, float *out) {
+  renderer r;
+  r.c = c;
+  r.params = *params;
+  r.size = size;
+  r.threads = threads;
+  r.out = out;
+  r.pool = worley_context_pool_create(threads, c->dims, WORLEY_MAX_OCTAVES, cell_cache_size, WORLEY_CELLS_FLOAT);
+  if(!r.pool)
+    return 0;
+
+  int n = size * size;
+  if(order == ORDER_BATCH || order == ORDER_PACKET) {
+    for(int y = 0; y < size; ++y)
+      eval_row(&r, order, y);
+  } else if(order == ORDER_REVERSE) {
+    for(int i = n - 1; i >= 0; --i)
+      out[i] = eval_pixel(&r, 0, i % size, i / size);
+  } else if(order == ORDER_SHUFFLED) {
+    int *perm = malloc(sizeof(int) * n);
+    if(!perm) {
+      worley_context_pool_destroy(r.pool);
+      return 0;
+    }
+    for(int i = 0; i < n; ++i)
+      perm[i] = i;
+    // Fisher-Yates with a fixed LCG, so every run uses the same order
+    unsigned int state = 12345;
+    for(int i = n - 1; i > 0; --i) {
+      state = state * 1664525u + 1013904223u;
+      int j = (int)((state >> 8) % (unsigned int)(i + 1));
+      int tmp = perm[i]; perm[i] = perm[j]; perm[j] = tmp;
+    }
+    for(int i = 0; i < n; ++i)
+      out[perm[i]] = eval_pixel(&r, 0, perm[i] % size, perm[i] / size);
+    free(perm);
+  } else {
+    render_thread *t = malloc(sizeof(render_thread) * threads);
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    if(!t || !ids) {
+      free(t);
+      free(ids);
+      worley_context_pool_destroy(r.pool);
+      return 0;
+    }
+    for(int i = 0; i < threads; ++i) {
+      t[i].r = &r;
+      t[i].slot = i;
+      pthread_create(&ids[i], NULL, render_rows, &t[i]);
+    }
+    for(int i = 0; i < threads; ++i)
+      pthread_join(ids[i], NULL);
+    free(t);
+    free(ids);
+  }
+  worley_context_pool_destroy(r.pool);
+  return 1;
+}
+
+/************* Reference files *************/
+
+// single channel .pfm, little endian, rows bottom-up
+static int write_pfm(const char *path, const float *values, int size) {
+  FILE *f = fopen(path, "wb");
+  if(!f)
+    return 0;
+  fprintf(f, "Pf\n%d %d\n-1.0\n", size, size);
+  for(int y = size - 1; y >= 0; --y)
+    fwrite(values + (size_t)y * size, sizeof(float), size, f);
+  return fclose(f) == 0;
+}
+
+static int read_pfm(const char *path, float *values, int size) {
+  FILE *f = fopen(path, "rb");
+  if(!f)
+    return 0;
+  int w, h;
+  float endian;
+  int ok = fscanf(f, "Pf %d %d %f", &w, &h, &endian) == 3 && fgetc(f) == '\n' && w == size && h == size && endian < 0;
+  for(int y = size - 1; ok && y >= 0; --y)
+    ok = fread(values + (size_t)y * size, sizeof(float), size, f) == (size_t)size;
+  fclose(f);
+  return ok;
+}
+
+/************* Commands *************/
+
+typedef struct regress_options {
+  const char *command;
+  const char *dir;
+  int size;
+  float tol;
+  int flips;
+  const char *filter;
+} regress_options;
+
+static void usage(void) {
+  fprintf(stderr, "usage: worley_regress record|compare|check [dir] [size=64] [tol=1e-5] [flips=0] [filter=name]\n");
+}
+
+static int parse_args(regress_options *o, int argc, char **argv) {
+  o->command = NULL;
+  o->dir = NULL;
+  o->size = 64;
+  o->tol = 1e-5f;
+  o->flips = 0;
+  o->filter = NULL;
+  for(int i = 1; i < argc; ++i) {
+    const char *eq = strchr(argv[i], '=');
+    if(!eq) {
+      if(!o->command)
+        o->command = argv[i];
+      else if(!o->dir)
+        o->dir = argv[i];
+      else {
+        usage();
+        return 0;
+      }
+      continue;
+    }
+    const char *value = eq + 1;
+    size_t len = eq - argv[i];
+    char *end;
+    if(len == 4 && !strncmp(argv[i], "size", 4)) {
+      long v = strtol(value, &end, 10);
+      if(end == value || *end || v < 1 || v > 4096) {
+        fprintf(stderr, "bad size: %s\n", value);
+        return 0;
+      }
+      o->size = (int)v;
+    } else if(len == 3 && !strncmp(argv[i], "tol", 3)) {
+      o->tol = strtof(value, &end);
+      if(end == value || *end || !(o->tol >= 0)) {
+        fprintf(stderr, "bad tol: %s\n", value);
+        return 0;
+      }
+    } else if(len == 5 && !strncmp(argv[i], "flips", 5)) {
+      long v = strtol(value, &end, 10);
+      if(end == value || *end || v < 0 || v > 4096 * 4096) {
+        fprintf(stderr, "bad flips: %s\n", value);
+        return 0;
+      }
+      o->flips = (int)v;
+    } else if(len == 6 && !strncmp(argv[i], "filter", 6))
+      o->filter = value;
+    else {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      usage();
+      return 0;
+    }
+  }
+  int needs_dir = o->command && (!strcmp(o->command, "record") || !strcmp(o->command, "compare"));
+  if(!o->command || (needs_dir && !o->dir) || (!needs_dir && (strcmp(o->command, "check") || o->dir))) {
+    usage();
+    return 0;
+  }
+  return 1;
+}
+
+static void tile_path(char *path, size_t n, const regress_options *o, const regress_case *c) {
+  snprintf(path, n, "%s/%s.pfm", o->dir, c->name);
+}
+
+// returns the number of failed cases
+static int record(const regress_options *o, const regress_case *c, float *values) {
+  char path[1024];
+  tile_path(path, sizeof(path), o, c);
+  if(!render(c, &c->params, o->size, ORDER_SCANLINE, 1, REGRESS_CELL_CACHE_SIZE, values)) {
+    fprintf(stderr, "%s: out of memory\n", c->name);
+    return 1;
+  }
+  if(!write_pfm(path, values, o->size)) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+static int compare(const regress_options *o, const regress_case *c, float *values, float *reference) {
+  char path[1024];
+  tile_path(path, sizeof(path), o, c);
+  if(!read_pfm(path, reference, o->size)) {
+    printf("%s\tmissing or unreadable reference %s\n", c->name, path);
+    return 1;
+  }
+  if(!render(c, &c->params, o->size, ORDER_SCANLINE, 1, REGRESS_CELL_CACHE_SIZE, values)) {
+    fprintf(stderr, "%s: out of memory\n", c->name);
+    return 1;
+  }
+  // the magnitudes, as the sign only says whether the pixel is in the gap: that is counted as flips
+  int n = o->size * o->size, flips = 0;
+  double max = 0, sum = 0;
+  for(int i = 0; i < n; ++i) {
+    double d = fabs(fabs((double)values[i]) - fabs((double)reference[i]));
+    if(!(d <= max)) // NaNs count as the largest difference
+      max = isnan(d) ? INFINITY : d;
+    sum += isnan(d) ? 0 : d;
+    flips += (values[i] < 0) != (reference[i] < 0);
+  }
+  if(max == 0 && !flips)
+    return 0;
+  int failed = !(max <= o->tol) || flips > o->flips;
+  printf("%s\t%s\tmax %.3g\tmean %.3g\tgap flips %d\n", c->name, failed ? "FAIL" : "ok", max, sum / n, flips);
+  return failed;
+}
+
+static int check(const regress_options *o, const regress_case *c, float *values, float *reference) {
+  static const int thread_counts[] = { 2, 3, 8 };
+  if(!render(c, &c->params, o->size, ORDER_SCANLINE, 1, REGRESS_CELL_CACHE_SIZE, reference)) {
+    fprintf(stderr, "%s: out of memory\n", c->name);
+    return 1;
+  }
+  worley_params pruned = c->params, separate = c->params;
+  pruned.search = pruned.search == WORLEY_SEARCH_FULL ? WORLEY_SEARCH_PRUNED : WORLEY_SEARCH_FULL;
+  separate.search = WORLEY_SEARCH_SEPARATE;
+
+  int failed = 0;
+  for(int way = 0; way < 9; ++way) {
+    const char *name;
+    int ok;
+    size_t bytes = sizeof(float) * o->size * o->size;
+    memset(values, 0, bytes);
+    switch(way) {
+      case 0: name = "reverse"; ok = render(c, &c->params, o->size, ORDER_REVERSE, 1, REGRESS_CELL_CACHE_SIZE, values); break;
+      case 1: name = "shuffled"; ok = render(c, &c->params, o->size, ORDER_SHUFFLED, 1, REGRESS_CELL_CACHE_SIZE, values); break;
+      case 2: case 3: case 4: {
+        static char names[3][16];
+        snprintf(names[way - 2], sizeof(names[0]), "threads=%d", thread_counts[way - 2]);
+        name = names[way - 2];
+        ok = render(c, &c->params, o->size, ORDER_SCANLINE, thread_counts[way - 2], REGRESS_CELL_CACHE_SIZE, values);
+        break;
+      }
+      case 5: name = "no cell cache"; ok = render(c, &c->params, o->size, ORDER_SCANLINE, 1, 0, values); break;
+      case 6: name = "pruned"; ok = render(c, &pruned, o->size, ORDER_SCANLINE, 1, REGRESS_CELL_CACHE_SIZE, values); break;
+      case 7:
+        if(!c->params.jagged_gap)
+          continue;
+        name = "separate";
+        ok = render(c, &separate, o->size, ORDER_SCANLINE, 1, REGRESS_CELL_CACHE_SIZE, values);
+        break;
+      default:
+        if(c->kind != CASE_VALUE)
+          continue;
+        // batch, then packet
+        name = "batch";
+        ok = render(c, &c->params, o->size, ORDER_BATCH, 1, REGRESS_CELL_CACHE_SIZE, values);
+        if(ok && !memcmp(values, reference, bytes)) {
+          name = "packet";
+          ok = render(c, &c->params, o->size, ORDER_PACKET, 1, REGRESS_CELL_CACHE_SIZE, values);
+        }
+        break;
+    }
+    if(!ok) {
+      fprintf(stderr, "%s: out of memory\n", c->name);
+      return 1;
+    }
+    if(!memcmp(values, reference, bytes))
+      continue;
+    int differ = 0;
+    for(int i = 0; i < o->size * o->size; ++i)
+      differ += memcmp(&values[i], &reference[i], sizeof(float)) != 0;
+    printf("%s\t%s\tFAIL\t%d pixels differ\n", c->name, name, differ);
+    failed = 1;
+  }
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  regress_options o;
+  if(!parse_args(&o, argc, argv))
+    return 1;
+
+  regress_case *cases = malloc(sizeof(regress_case) * REGRESS_MAX_CASES);
+  float *values = malloc(sizeof(float) * o.size * o.size);
+  float *reference = malloc(sizeof(float) * o.size * o.size);
+  if(!cases || !values || !reference) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  int n = build_cases(cases), run = 0, failed = 0;
+  for(int i = 0; i < n; ++i) {
+    const regress_case *c = &cases[i];
+    if(o.filter && !strstr(c->name, o.filter))
+      continue;
+    ++run;
+    if(!strcmp(o.command, "record"))
+      failed += record(&o, c, values);
+    else if(!strcmp(o.command, "compare"))
+      failed += compare(&o, c, values, reference);
+    else
+      failed += check(&o, c, values, reference);
+  }
+  printf("%s: %d cases, %d failed (%dx%d, isa %s)\n", o.command, run, failed, o.size, o.size, worley_isa());
+  free(cases);
+  free(values);
+  free(reference);
+  return failed > 0;
+}
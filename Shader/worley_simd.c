@@ -0,0 +1,266 @@
+/*
+ * Runtime selection of the F1/F2/F3 search kernels.
+ * The kernels themselves are generated from worley_simd_kernel.h.
+ */
+
+#include "worley_simd.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define WORLEY_X86 1
+#include <immintrin.h>
+#endif
+
+#define KSTR_(x) #x
+#define KSTR(x) KSTR_(x)
+
+/************* Scalar *************/
+
+#define ISA scalar
+#define KERNEL_ATTR
+#define V_WIDTH 1
+#define V_F float
+#define V_M int
+#define V_SET1(a) (a)
+#define V_LANES 0.0f
+#define V_LOAD(p) (*(p))
+#define V_STORE(p, a) (*(p) = (a))
+#define V_ADD(a, b) ((a) + (b))
+#define V_SUB(a, b) ((a) - (b))
+#define V_MUL(a, b) ((a) * (b))
+#define V_SQRT(a) sqrtf(a)
+#define V_ABS(a) fabsf(a)
+#define V_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define V_LT(a, b) ((a) < (b))
+#define V_SEL(m, a, b) ((m) ? (a) : (b))
+#define V_EQ(a, b) ((a) == (b))
+#define V_AND(a, b) ((a) && (b))
+#define V_HMIN(a) (a)
+#define V_FIRST(a) (a)
+#include "worley_simd_kernel.h"
+#undef ISA
+#undef KERNEL_ATTR
+#undef V_WIDTH
+#undef V_F
+#undef V_M
+#undef V_SET1
+#undef V_LANES
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_SQRT
+#undef V_ABS
+#undef V_MAX
+#undef V_LT
+#undef V_SEL
+#undef V_EQ
+#undef V_AND
+#undef V_HMIN
+#undef V_FIRST
+
+#ifdef WORLEY_X86
+
+/************* SSE4.1 *************/
+
+// the minimum of all lanes, in all lanes
+static __attribute__((target("sse4.1"))) __m128 sse_hmin(__m128 a) {
+  a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+#define ISA sse
+#define KERNEL_ATTR __attribute__((target("sse4.1")))
+#define V_WIDTH 4
+#define V_F __m128
+#define V_M __m128
+#define V_SET1(a) _mm_set1_ps(a)
+#define V_LANES _mm_setr_ps(0, 1, 2, 3)
+#define V_LOAD(p) _mm_loadu_ps(p)
+#define V_STORE(p, a) _mm_storeu_ps(p, a)
+#define V_ADD(a, b) _mm_add_ps(a, b)
+#define V_SUB(a, b) _mm_sub_ps(a, b)
+#define V_MUL(a, b) _mm_mul_ps(a, b)
+#define V_SQRT(a) _mm_sqrt_ps(a)
+#define V_ABS(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define V_MAX(a, b) _mm_max_ps(a, b)
+#define V_LT(a, b) _mm_cmplt_ps(a, b)
+#define V_SEL(m, a, b) _mm_blendv_ps(b, a, m)
+#define V_EQ(a, b) _mm_cmpeq_ps(a, b)
+#define V_AND(a, b) _mm_and_ps(a, b)
+#define V_HMIN(a) sse_hmin(a)
+#define V_FIRST(a) _mm_cvtss_f32(a)
+#include "worley_simd_kernel.h"
+#undef ISA
+#undef KERNEL_ATTR
+#undef V_WIDTH
+#undef V_F
+#undef V_M
+#undef V_SET1
+#undef V_LANES
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_SQRT
+#undef V_ABS
+#undef V_MAX
+#undef V_LT
+#undef V_SEL
+#undef V_EQ
+#undef V_AND
+#undef V_HMIN
+#undef V_FIRST
+
+/************* AVX2 *************/
+
+static __attribute__((target("avx2"))) __m256 avx2_hmin(__m256 a) {
+  a = _mm256_min_ps(a, _mm256_permute2f128_ps(a, a, 1));
+  a = _mm256_min_ps(a, _mm256_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm256_min_ps(a, _mm256_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+#define ISA avx2
+#define KERNEL_ATTR __attribute__((target("avx2")))
+#define V_WIDTH 8
+#define V_F __m256
+#define V_M __m256
+#define V_SET1(a) _mm256_set1_ps(a)
+#define V_LANES _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)
+#define V_LOAD(p) _mm256_loadu_ps(p)
+#define V_STORE(p, a) _mm256_storeu_ps(p, a)
+#define V_ADD(a, b) _mm256_add_ps(a, b)
+#define V_SUB(a, b) _mm256_sub_ps(a, b)
+#define V_MUL(a, b) _mm256_mul_ps(a, b)
+#define V_SQRT(a) _mm256_sqrt_ps(a)
+#define V_ABS(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a)
+#define V_MAX(a, b) _mm256_max_ps(a, b)
+#define V_LT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define V_SEL(m, a, b) _mm256_blendv_ps(b, a, m)
+#define V_EQ(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define V_AND(a, b) _mm256_and_ps(a, b)
+#define V_HMIN(a) avx2_hmin(a)
+#define V_FIRST(a) _mm256_cvtss_f32(a)
+#include "worley_simd_kernel.h"
+#undef ISA
+#undef KERNEL_ATTR
+#undef V_WIDTH
+#undef V_F
+#undef V_M
+#undef V_SET1
+#undef V_LANES
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_SQRT
+#undef V_ABS
+#undef V_MAX
+#undef V_LT
+#undef V_SEL
+#undef V_EQ
+#undef V_AND
+#undef V_HMIN
+#undef V_FIRST
+
+/************* AVX-512 *************/
+
+#define ISA avx512
+#define KERNEL_ATTR __attribute__((target("avx512f")))
+#define V_WIDTH 16
+#define V_F __m512
+#define V_M __mmask16
+#define V_SET1(a) _mm512_set1_ps(a)
+#define V_LANES _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+#define V_LOAD(p) _mm512_loadu_ps(p)
+#define V_STORE(p, a) _mm512_storeu_ps(p, a)
+#define V_ADD(a, b) _mm512_add_ps(a, b)
+#define V_SUB(a, b) _mm512_sub_ps(a, b)
+#define V_MUL(a, b) _mm512_mul_ps(a, b)
+#define V_SQRT(a) _mm512_sqrt_ps(a)
+#define V_ABS(a) _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x7fffffff)))
+#define V_MAX(a, b) _mm512_max_ps(a, b)
+#define V_LT(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#define V_SEL(m, a, b) _mm512_mask_blend_ps(m, b, a)
+#define V_EQ(a, b) _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ)
+#define V_AND(a, b) ((__mmask16)((a) & (b)))
+#define V_HMIN(a) _mm512_set1_ps(_mm512_reduce_min_ps(a))
+#define V_FIRST(a) _mm512_cvtss_f32(a)
+#include "worley_simd_kernel.h"
+#undef ISA
+#undef KERNEL_ATTR
+#undef V_WIDTH
+#undef V_F
+#undef V_M
+#undef V_SET1
+#undef V_LANES
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_SQRT
+#undef V_ABS
+#undef V_MAX
+#undef V_LT
+#undef V_SEL
+#undef V_EQ
+#undef V_AND
+#undef V_HMIN
+#undef V_FIRST
+
+#endif
+
+/************* Dispatch *************/
+
+static int isa_supported(const worley_kernels *k) {
+#ifdef WORLEY_X86
+  __builtin_cpu_init();
+  if(k == &kernels_avx512) return __builtin_cpu_supports("avx512f");
+  if(k == &kernels_avx2) return __builtin_cpu_supports("avx2");
+  if(k == &kernels_sse) return __builtin_cpu_supports("sse4.1");
+#endif
+  return k == &kernels_scalar;
+}
+
+static const worley_kernels *all_kernels[] = {
+#ifdef WORLEY_X86
+  &kernels_avx512, &kernels_avx2, &kernels_sse,
+#endif
+  &kernels_scalar
+};
+
+#define NUM_KERNELS (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static const worley_kernels *selected_kernels = NULL;
+
+int worley_set_isa(const char *isa) {
+  for(size_t k = 0; k < NUM_KERNELS; ++k) {
+    if((isa == NULL || strcmp(isa, all_kernels[k]->isa) == 0) && isa_supported(all_kernels[k])) {
+      selected_kernels = all_kernels[k];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const worley_kernels *worley_get_kernels(void) {
+  // concurrent first calls all select the same kernels, so this doesn't need a lock
+  if(!selected_kernels) {
+    const char *isa = getenv("WORLEY_ISA");
+    if(!isa || !worley_set_isa(isa))
+      worley_set_isa(NULL);
+  }
+  return selected_kernels;
+}
+
+const char *worley_isa(void) {
+  return worley_get_kernels()->isa;
+}
@@ -0,0 +1,60 @@
+/*
+ * Vectorized F1/F2/F3 search kernels (internal to the core).
+ * The kernel set is picked once at runtime from the instruction sets the CPU supports.
+ */
+
+#ifndef WORLEY_SIMD_H
+#define WORLEY_SIMD_H
+
+#include "worley.h"
+
+// the three smallest distances and the indices of their points (-1 if there was no point)
+typedef struct worley_top3 {
+  float f[3];
+  int i[3];
+} worley_top3;
+
+// the distances the kernels compute. A dist_measure maps to one of them (see kernel_of in worley.c);
+// the power kernels rank by the sum of |d|^power over the axes, without the root.
+typedef enum worley_kernel_measure {
+  KERNEL_LINEAR,
+  KERNEL_LINEAR_SQUARED,
+  KERNEL_MANHATTAN,
+  KERNEL_CHEBYSHEV,
+  KERNEL_POWER_INT, // power is an integer, by multiplications
+  KERNEL_POWER, // any power, by powf
+  KERNEL_MEASURES
+} worley_kernel_measure;
+
+// n has to be a multiple of 16; pad with points at infinity. power is only used by the power kernels.
+typedef void (*worley_search2_fn)(const float *us, const float *vs, int n, float power, float pu, float pv, worley_top3 *out);
+typedef void (*worley_search3_fn)(const float *xs, const float *ys, const float *zs, int n, float power,
+                                  float px, float py, float pz, worley_top3 *out);
+// the same for two query points p and q at once; out[0] is for p, out[1] for q
+typedef void (*worley_search2_pair_fn)(const float *us, const float *vs, int n, float power, float pu, float pv,
+                                       float qu, float qv, worley_top3 *out);
+typedef void (*worley_search3_pair_fn)(const float *xs, const float *ys, const float *zs, int n, float power,
+                                       float px, float py, float pz, float qx, float qy, float qz, worley_top3 *out);
+
+// count query points (at most WORLEY_PACKET_LANES) against n points at once, one query point per lane;
+// out[j] is for query point j. n needs no padding, but pu/pv (px/py/pz) need room for WORLEY_PACKET_LANES values.
+#define WORLEY_PACKET_LANES 16
+typedef void (*worley_search2_packet_fn)(const float *us, const float *vs, int n, float power, const float *pu, const float *pv, int count,
+                                         worley_top3 *out);
+typedef void (*worley_search3_packet_fn)(const float *xs, const float *ys, const float *zs, int n, float power,
+                                         const float *px, const float *py, const float *pz, int count, worley_top3 *out);
+
+// one search function per worley_kernel_measure
+typedef struct worley_kernels {
+  const char *isa;
+  worley_search2_fn search2[KERNEL_MEASURES];
+  worley_search3_fn search3[KERNEL_MEASURES];
+  worley_search2_pair_fn search2_pair[KERNEL_MEASURES];
+  worley_search3_pair_fn search3_pair[KERNEL_MEASURES];
+  worley_search2_packet_fn search2_packet[KERNEL_MEASURES];
+  worley_search3_packet_fn search3_packet[KERNEL_MEASURES];
+} worley_kernels;
+
+const worley_kernels *worley_get_kernels(void);
+
+#endif
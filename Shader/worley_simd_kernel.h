@@ -0,0 +1,269 @@
+/*
+ * F1/F2/F3 search kernels over a structure-of-arrays point cache.
+ *
+ * This file is included by worley_simd.c once per instruction set, with the V_* macros,
+ * ISA (the name suffix) and KERNEL_ATTR defined. The scalar "instruction set" has a width of 1.
+ *
+ * Each lane keeps its own sorted f1 <= f2 <= f3 and the indices of the points;
+ * new distances are inserted without branches, and the lanes are combined at the end by smallest (distance, index).
+ * Distances are computed exactly like in dist_linear3 & co (the power kernels like kernel_dist2 / kernel_dist3 in worley.c),
+ * so all instruction sets give identical results.
+ */
+
+#define KCAT_(a, b) a ## _ ## b
+#define KCAT(a, b) KCAT_(a, b)
+#define KNAME(n) KCAT(n, ISA)
+
+// the per-lane top 3 of one query point; a names the variables, so a kernel can keep several
+#define TOP3_BEGIN(a) \
+  V_F a##v1 = V_SET1(FLT_MAX), a##v2 = V_SET1(FLT_MAX), a##v3 = V_SET1(FLT_MAX); \
+  V_F a##i1 = V_SET1(FLT_MAX), a##i2 = V_SET1(FLT_MAX), a##i3 = V_SET1(FLT_MAX); /* FLT_MAX: no point */
+
+// strict comparisons, so earlier points win ties (like the scalar insertion in the original point_distances)
+#define TOP3_INSERT(a, d, idx) { \
+  V_M lt3 = V_LT(d, a##v3), lt2 = V_LT(d, a##v2), lt1 = V_LT(d, a##v1); \
+  a##v3 = V_SEL(lt2, a##v2, V_SEL(lt3, d, a##v3)); a##i3 = V_SEL(lt2, a##i2, V_SEL(lt3, idx, a##i3)); \
+  a##v2 = V_SEL(lt1, a##v1, V_SEL(lt2, d, a##v2)); a##i2 = V_SEL(lt1, a##i1, V_SEL(lt2, idx, a##i2)); \
+  a##v1 = V_SEL(lt1, d, a##v1);                    a##i1 = V_SEL(lt1, idx, a##i1); \
+}
+
+// horizontal reduction: three times, take the smallest (distance, index) over all lanes
+// and move up the remaining entries of the lane it came from.
+#define TOP3_END(a, out) { \
+  for(int k = 0; k < 3; ++k) { \
+    V_F m = V_HMIN(a##v1); \
+    V_M eq = V_EQ(a##v1, m); \
+    V_F mi = V_HMIN(V_SEL(eq, a##i1, V_SET1(FLT_MAX))); \
+    V_M take = V_AND(eq, V_EQ(a##i1, mi)); \
+    (out)->f[k] = V_FIRST(m); \
+    (out)->i[k] = V_FIRST(mi) == FLT_MAX ? -1 : (int)V_FIRST(mi); \
+    a##v1 = V_SEL(take, a##v2, a##v1); a##i1 = V_SEL(take, a##i2, a##i1); \
+    a##v2 = V_SEL(take, a##v3, a##v2); a##i2 = V_SEL(take, a##i3, a##i2); \
+    a##v3 = V_SEL(take, V_SET1(FLT_MAX), a##v3); a##i3 = V_SEL(take, V_SET1(FLT_MAX), a##i3); \
+  } \
+}
+
+// the per-lane top 3 of count query points (one per lane) into out[0] to out[count - 1]
+#define TOP3_STORE(a, out, count) { \
+  float f_[3][V_WIDTH], i_[3][V_WIDTH]; \
+  V_STORE(f_[0], a##v1); V_STORE(f_[1], a##v2); V_STORE(f_[2], a##v3); \
+  V_STORE(i_[0], a##i1); V_STORE(i_[1], a##i2); V_STORE(i_[2], a##i3); \
+  for(int l = 0; l < V_WIDTH && l < (count); ++l) \
+    for(int k = 0; k < 3; ++k) { \
+      (out)[l].f[k] = f_[k][l]; \
+      (out)[l].i[k] = i_[k][l] == FLT_MAX ? -1 : (int)i_[k][l]; \
+    } \
+}
+
+// |a|^n for an integer n >= 1, by squaring; the scalar pow_int in worley.c multiplies in the same order
+static KERNEL_ATTR inline V_F KNAME(pow_int)(V_F a, int n) {
+  V_F r = V_SET1(1.0f);
+  for(;;) {
+    if(n & 1) r = V_MUL(r, a);
+    n >>= 1;
+    if(!n) return r;
+    a = V_MUL(a, a);
+  }
+}
+
+// a^power for every lane; there is no vector powf, so this goes through memory
+static KERNEL_ATTR inline V_F KNAME(pow_lanes)(V_F a, float power) {
+  float t[V_WIDTH];
+  V_STORE(t, a);
+  for(int l = 0; l < V_WIDTH; ++l) t[l] = powf(t[l], power);
+  return V_LOAD(t);
+}
+
+#define DIST_LINEAR_SQUARED2 V_ADD(V_MUL(dx, dx), V_MUL(dy, dy))
+#define DIST_LINEAR2 V_SQRT(DIST_LINEAR_SQUARED2)
+#define DIST_MANHATTAN2 V_ADD(V_ABS(dx), V_ABS(dy))
+#define DIST_CHEBYSHEV2 V_MAX(V_ABS(dx), V_ABS(dy))
+#define DIST_POWER_INT2 V_ADD(KNAME(pow_int)(V_ABS(dx), (int)power), KNAME(pow_int)(V_ABS(dy), (int)power))
+#define DIST_POWER2 V_ADD(KNAME(pow_lanes)(V_ABS(dx), power), KNAME(pow_lanes)(V_ABS(dy), power))
+
+#define DIST_LINEAR_SQUARED3 V_ADD(V_ADD(V_MUL(dx, dx), V_MUL(dy, dy)), V_MUL(dz, dz))
+#define DIST_LINEAR3 V_SQRT(DIST_LINEAR_SQUARED3)
+#define DIST_MANHATTAN3 V_ADD(V_ADD(V_ABS(dx), V_ABS(dy)), V_ABS(dz))
+#define DIST_CHEBYSHEV3 V_MAX(V_MAX(V_ABS(dx), V_ABS(dy)), V_ABS(dz))
+#define DIST_POWER_INT3 V_ADD(V_ADD(KNAME(pow_int)(V_ABS(dx), (int)power), KNAME(pow_int)(V_ABS(dy), (int)power)), \
+                              KNAME(pow_int)(V_ABS(dz), (int)power))
+#define DIST_POWER3 V_ADD(V_ADD(KNAME(pow_lanes)(V_ABS(dx), power), KNAME(pow_lanes)(V_ABS(dy), power)), \
+                          KNAME(pow_lanes)(V_ABS(dz), power))
+
+#define SEARCH2(NAME, DIST) \
+static KERNEL_ATTR void KNAME(NAME)(const float *us, const float *vs, int n, float power, float pu, float pv, worley_top3 *out) { \
+  V_F pu_ = V_SET1(pu), pv_ = V_SET1(pv); \
+  V_F lane = V_LANES; \
+  TOP3_BEGIN(a) \
+  for(int i = 0; i < n; i += V_WIDTH) { \
+    V_F qu = V_LOAD(us + i), qv = V_LOAD(vs + i); \
+    V_F idx = V_ADD(V_SET1((float)i), lane); \
+    { V_F dx = V_SUB(pu_, qu), dy = V_SUB(pv_, qv); V_F d = DIST; TOP3_INSERT(a, d, idx) } \
+  } \
+  TOP3_END(a, out) \
+}
+
+// two query points in one pass over the points; out[0] for p, out[1] for q
+#define SEARCH2_PAIR(NAME, DIST) \
+static KERNEL_ATTR void KNAME(NAME)(const float *us, const float *vs, int n, float power, float pu, float pv, float qu, float qv, \
+                                    worley_top3 *out) { \
+  V_F pu_ = V_SET1(pu), pv_ = V_SET1(pv), qu_ = V_SET1(qu), qv_ = V_SET1(qv); \
+  V_F lane = V_LANES; \
+  TOP3_BEGIN(a) \
+  TOP3_BEGIN(b) \
+  for(int i = 0; i < n; i += V_WIDTH) { \
+    V_F xu = V_LOAD(us + i), xv = V_LOAD(vs + i); \
+    V_F idx = V_ADD(V_SET1((float)i), lane); \
+    { V_F dx = V_SUB(pu_, xu), dy = V_SUB(pv_, xv); V_F d = DIST; TOP3_INSERT(a, d, idx) } \
+    { V_F dx = V_SUB(qu_, xu), dy = V_SUB(qv_, xv); V_F d = DIST; TOP3_INSERT(b, d, idx) } \
+  } \
+  TOP3_END(a, &out[0]) \
+  TOP3_END(b, &out[1]) \
+}
+
+#define SEARCH3(NAME, DIST) \
+static KERNEL_ATTR void KNAME(NAME)(const float *xs, const float *ys, const float *zs, int n, float power, float px, float py, float pz, worley_top3 *out) { \
+  V_F px_ = V_SET1(px), py_ = V_SET1(py), pz_ = V_SET1(pz); \
+  V_F lane = V_LANES; \
+  TOP3_BEGIN(a) \
+  for(int i = 0; i < n; i += V_WIDTH) { \
+    V_F cx = V_LOAD(xs + i), cy = V_LOAD(ys + i), cz = V_LOAD(zs + i); \
+    V_F idx = V_ADD(V_SET1((float)i), lane); \
+    { V_F dx = V_SUB(px_, cx), dy = V_SUB(py_, cy), dz = V_SUB(pz_, cz); V_F d = DIST; TOP3_INSERT(a, d, idx) } \
+  } \
+  TOP3_END(a, out) \
+}
+
+#define SEARCH3_PAIR(NAME, DIST) \
+static KERNEL_ATTR void KNAME(NAME)(const float *xs, const float *ys, const float *zs, int n, float power, float px, float py, float pz, \
+                                    float qx, float qy, float qz, worley_top3 *out) { \
+  V_F px_ = V_SET1(px), py_ = V_SET1(py), pz_ = V_SET1(pz); \
+  V_F qx_ = V_SET1(qx), qy_ = V_SET1(qy), qz_ = V_SET1(qz); \
+  V_F lane = V_LANES; \
+  TOP3_BEGIN(a) \
+  TOP3_BEGIN(b) \
+  for(int i = 0; i < n; i += V_WIDTH) { \
+    V_F cx = V_LOAD(xs + i), cy = V_LOAD(ys + i), cz = V_LOAD(zs + i); \
+    V_F idx = V_ADD(V_SET1((float)i), lane); \
+    { V_F dx = V_SUB(px_, cx), dy = V_SUB(py_, cy), dz = V_SUB(pz_, cz); V_F d = DIST; TOP3_INSERT(a, d, idx) } \
+    { V_F dx = V_SUB(qx_, cx), dy = V_SUB(qy_, cy), dz = V_SUB(qz_, cz); V_F d = DIST; TOP3_INSERT(b, d, idx) } \
+  } \
+  TOP3_END(a, &out[0]) \
+  TOP3_END(b, &out[1]) \
+}
+
+// count query points at once, one per lane: each of the n points is compared with all of them.
+// The points are visited in order and ties keep the earlier one, so the results equal those of SEARCH2 / SEARCH3.
+#define SEARCH2_PACKET(NAME, DIST) \
+static KERNEL_ATTR void KNAME(NAME)(const float *us, const float *vs, int n, float power, const float *pu, const float *pv, int count, \
+                                    worley_top3 *out) { \
+  for(int j = 0; j < count; j += V_WIDTH) { \
+    V_F pu_ = V_LOAD(pu + j), pv_ = V_LOAD(pv + j); \
+    TOP3_BEGIN(a) \
+    for(int i = 0; i < n; ++i) { \
+      V_F xu = V_SET1(us[i]), xv = V_SET1(vs[i]); \
+      V_F idx = V_SET1((float)i); \
+      { V_F dx = V_SUB(pu_, xu), dy = V_SUB(pv_, xv); V_F d = DIST; TOP3_INSERT(a, d, idx) } \
+    } \
+    TOP3_STORE(a, out + j, count - j) \
+  } \
+}
+
+#define SEARCH3_PACKET(NAME, DIST) \
+static KERNEL_ATTR void KNAME(NAME)(const float *xs, const float *ys, const float *zs, int n, float power, \
+                                    const float *px, const float *py, const float *pz, int count, worley_top3 *out) { \
+  for(int j = 0; j < count; j += V_WIDTH) { \
+    V_F px_ = V_LOAD(px + j), py_ = V_LOAD(py + j), pz_ = V_LOAD(pz + j); \
+    TOP3_BEGIN(a) \
+    for(int i = 0; i < n; ++i) { \
+      V_F cx = V_SET1(xs[i]), cy = V_SET1(ys[i]), cz = V_SET1(zs[i]); \
+      V_F idx = V_SET1((float)i); \
+      { V_F dx = V_SUB(px_, cx), dy = V_SUB(py_, cy), dz = V_SUB(pz_, cz); V_F d = DIST; TOP3_INSERT(a, d, idx) } \
+    } \
+    TOP3_STORE(a, out + j, count - j) \
+  } \
+}
+
+SEARCH2(search2_linear, DIST_LINEAR2)
+SEARCH2(search2_linear_squared, DIST_LINEAR_SQUARED2)
+SEARCH2(search2_manhattan, DIST_MANHATTAN2)
+SEARCH2(search2_chebyshev, DIST_CHEBYSHEV2)
+SEARCH2(search2_power_int, DIST_POWER_INT2)
+SEARCH2(search2_power, DIST_POWER2)
+
+SEARCH3(search3_linear, DIST_LINEAR3)
+SEARCH3(search3_linear_squared, DIST_LINEAR_SQUARED3)
+SEARCH3(search3_manhattan, DIST_MANHATTAN3)
+SEARCH3(search3_chebyshev, DIST_CHEBYSHEV3)
+SEARCH3(search3_power_int, DIST_POWER_INT3)
+SEARCH3(search3_power, DIST_POWER3)
+
+SEARCH2_PAIR(search2_pair_linear, DIST_LINEAR2)
+SEARCH2_PAIR(search2_pair_linear_squared, DIST_LINEAR_SQUARED2)
+SEARCH2_PAIR(search2_pair_manhattan, DIST_MANHATTAN2)
+SEARCH2_PAIR(search2_pair_chebyshev, DIST_CHEBYSHEV2)
+SEARCH2_PAIR(search2_pair_power_int, DIST_POWER_INT2)
+SEARCH2_PAIR(search2_pair_power, DIST_POWER2)
+
+SEARCH3_PAIR(search3_pair_linear, DIST_LINEAR3)
+SEARCH3_PAIR(search3_pair_linear_squared, DIST_LINEAR_SQUARED3)
+SEARCH3_PAIR(search3_pair_manhattan, DIST_MANHATTAN3)
+SEARCH3_PAIR(search3_pair_chebyshev, DIST_CHEBYSHEV3)
+SEARCH3_PAIR(search3_pair_power_int, DIST_POWER_INT3)
+SEARCH3_PAIR(search3_pair_power, DIST_POWER3)
+
+SEARCH2_PACKET(search2_packet_linear, DIST_LINEAR2)
+SEARCH2_PACKET(search2_packet_linear_squared, DIST_LINEAR_SQUARED2)
+SEARCH2_PACKET(search2_packet_manhattan, DIST_MANHATTAN2)
+SEARCH2_PACKET(search2_packet_chebyshev, DIST_CHEBYSHEV2)
+SEARCH2_PACKET(search2_packet_power_int, DIST_POWER_INT2)
+SEARCH2_PACKET(search2_packet_power, DIST_POWER2)
+
+SEARCH3_PACKET(search3_packet_linear, DIST_LINEAR3)
+SEARCH3_PACKET(search3_packet_linear_squared, DIST_LINEAR_SQUARED3)
+SEARCH3_PACKET(search3_packet_manhattan, DIST_MANHATTAN3)
+SEARCH3_PACKET(search3_packet_chebyshev, DIST_CHEBYSHEV3)
+SEARCH3_PACKET(search3_packet_power_int, DIST_POWER_INT3)
+SEARCH3_PACKET(search3_packet_power, DIST_POWER3)
+
+static const worley_kernels KNAME(kernels) = {
+  KSTR(ISA),
+  { KNAME(search2_linear), KNAME(search2_linear_squared), KNAME(search2_manhattan),
+    KNAME(search2_chebyshev), KNAME(search2_power_int), KNAME(search2_power) },
+  { KNAME(search3_linear), KNAME(search3_linear_squared), KNAME(search3_manhattan),
+    KNAME(search3_chebyshev), KNAME(search3_power_int), KNAME(search3_power) },
+  { KNAME(search2_pair_linear), KNAME(search2_pair_linear_squared), KNAME(search2_pair_manhattan),
+    KNAME(search2_pair_chebyshev), KNAME(search2_pair_power_int), KNAME(search2_pair_power) },
+  { KNAME(search3_pair_linear), KNAME(search3_pair_linear_squared), KNAME(search3_pair_manhattan),
+    KNAME(search3_pair_chebyshev), KNAME(search3_pair_power_int), KNAME(search3_pair_power) },
+  { KNAME(search2_packet_linear), KNAME(search2_packet_linear_squared), KNAME(search2_packet_manhattan),
+    KNAME(search2_packet_chebyshev), KNAME(search2_packet_power_int), KNAME(search2_packet_power) },
+  { KNAME(search3_packet_linear), KNAME(search3_packet_linear_squared), KNAME(search3_packet_manhattan),
+    KNAME(search3_packet_chebyshev), KNAME(search3_packet_power_int), KNAME(search3_packet_power) }
+};
+
+#undef SEARCH2
+#undef SEARCH3
+#undef SEARCH2_PAIR
+#undef SEARCH3_PAIR
+#undef SEARCH2_PACKET
+#undef SEARCH3_PACKET
+#undef DIST_LINEAR_SQUARED2
+#undef DIST_LINEAR2
+#undef DIST_MANHATTAN2
+#undef DIST_CHEBYSHEV2
+#undef DIST_POWER_INT2
+#undef DIST_POWER2
+#undef DIST_LINEAR_SQUARED3
+#undef DIST_LINEAR3
+#undef DIST_MANHATTAN3
+#undef DIST_CHEBYSHEV3
+#undef DIST_POWER_INT3
+#undef DIST_POWER3
+#undef TOP3_BEGIN
+#undef TOP3_INSERT
+#undef TOP3_END
+#undef TOP3_STORE
+#undef KNAME
+#undef KCAT
+#undef KCAT_
@@ -0,0 +1,440 @@
+/*
+ * On-disk cache of baked noise tiles, shared by all render processes of a machine (see worley_tile_cache_open).
+ *
+ * Every tile is one file in the cache directory, named after the key of the parameters and the tile coordinates.
+ * A file is a versioned header followed by a grid of (F1, F2, F3, gap edge) samples, including both borders,
+ * so lookups interpolate within one tile. Files are mapped read-only, so all processes share the same pages.
+ * New tiles are written to a temporary file and renamed into place, so readers never see partial tiles.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "worley.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TILES_SUPPORTED 1
+#endif
+
+// tile size in cubes per axis, and samples per axis (minus one)
+#define TILE_CELLS2 8
+#define TILE_RES2 256
+#define TILE_CELLS3 4
+#define TILE_RES3 64
+
+#define TILE_MAGIC "WRLYTILE"
+#define TILE_VERSION 1
+
+typedef struct tile_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dims;
+  uint64_t key;
+  int32_t tile[3];
+  uint32_t cells;
+  uint32_t res;
+  uint32_t reserved[3];
+} tile_header;
+
+typedef struct tile_entry {
+  int used;
+  uint64_t key;
+  int dims;
+  int tile[3];
+  const float *texels; // NULL if the tile isn't in the cache directory
+  void *map;
+  size_t map_len;
+  size_t last_use;
+} tile_entry;
+
+#define TILE_WAYS 4
+
+struct worley_tile_cache {
+  char *dir;
+  int write_back;
+  size_t capacity; // power of two, at least TILE_WAYS
+  size_t clock;
+  tile_entry *entries;
+  worley_tile_stats stats;
+  // the key of the last parameters looked up
+  int last_valid, last_dims;
+  worley_params last_params;
+  uint64_t last_key;
+};
+
+/************* Keys *************/
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t n) {
+  const unsigned char *p = data;
+  for(size_t i = 0; i < n; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t worley_tile_key(const worley_params *params, int dims) {
+  const worley_noise *noise = params->noise ? params->noise : &worley_default_noise;
+  const char *noise_name = noise->name ? noise->name : "";
+  uint64_t h = 14695981039346656037ULL;
+  uint32_t version = TILE_VERSION;
+  h = fnv1a(h, &version, sizeof(version));
+  h = fnv1a(h, &dims, sizeof(dims));
+  int32_t measure = params->distance_measure, jagged = params->jagged_gap != 0, gen = params->point_gen, period = params->period;
+  h = fnv1a(h, &measure, sizeof(measure));
+  h = fnv1a(h, &params->scale, sizeof(params->scale));
+  float scaleX = dims == 3 ? params->scaleX : 1.0f;
+  h = fnv1a(h, &scaleX, sizeof(scaleX));
+  h = fnv1a(h, &params->gap_size, sizeof(params->gap_size));
+  h = fnv1a(h, &jagged, sizeof(jagged));
+  h = fnv1a(h, &gen, sizeof(gen));
+  if(params->point_gen == WORLEY_GEN_HASH) {
+    h = fnv1a(h, &params->seed, sizeof(params->seed));
+    h = fnv1a(h, &params->poisson_mean, sizeof(params->poisson_mean));
+  }
+  else
+    h = fnv1a(h, noise_name, strlen(noise_name) + 1);
+  h = fnv1a(h, &period, sizeof(period));
+  // only a non-default grid goes into the key, so existing tiles stay valid
+  int32_t points = worley_cube_points(params);
+  if(params->density > 0 || points != PTS_PER_CUBE) {
+    h = fnv1a(h, &params->density, sizeof(params->density));
+    h = fnv1a(h, &points, sizeof(points));
+  }
+  if(params->distance_measure == DIST_MINKOWSKI)
+    h = fnv1a(h, &params->minkowski_p, sizeof(params->minkowski_p));
+  const float *w = params->axis_weights;
+  if(w[0] != 1 || w[1] != 1 || (dims == 3 && w[2] != 1))
+    h = fnv1a(h, w, sizeof(float) * dims);
+  int32_t gap_test = params->gap_test;
+  if(gap_test != WORLEY_GAP_CLASSIC)
+    h = fnv1a(h, &gap_test, sizeof(gap_test));
+  return h;
+}
+
+// the parameters that go into the key; the distance mode is applied at lookup
+static int same_key_params(const worley_params *a, const worley_params *b) {
+  return a->distance_measure == b->distance_measure && a->scale == b->scale && a->scaleX == b->scaleX
+      && a->gap_size == b->gap_size && a->jagged_gap == b->jagged_gap && a->noise == b->noise
+      && a->point_gen == b->point_gen && a->seed == b->seed && a->poisson_mean == b->poisson_mean
+      && a->period == b->period && a->density == b->density && a->points_per_cube == b->points_per_cube
+      && a->minkowski_p == b->minkowski_p && !memcmp(a->axis_weights, b->axis_weights, sizeof(a->axis_weights))
+      && a->gap_test == b->gap_test;
+}
+
+static uint64_t cached_key(worley_tile_cache *cache, const worley_params *params, int dims) {
+  if(!cache->last_valid || cache->last_dims != dims || !same_key_params(&cache->last_params, params)) {
+    cache->last_key = worley_tile_key(params, dims);
+    cache->last_params = *params;
+    cache->last_dims = dims;
+    cache->last_valid = 1;
+  }
+  return cache->last_key;
+}
+
+/************* Cache *************/
+
+worley_tile_cache *worley_tile_cache_open(const char *dir, size_t capacity, int write_back) {
+#ifdef TILES_SUPPORTED
+  if(!dir || !*dir)
+    return NULL;
+  mkdir(dir, 0777); // may exist already; other errors show up when the tiles are accessed
+  worley_tile_cache *cache = calloc(1, sizeof(worley_tile_cache));
+  if(!cache)
+    return NULL;
+  size_t cap = TILE_WAYS;
+  while(cap < capacity)
+    cap *= 2;
+  cache->capacity = cap;
+  cache->write_back = write_back;
+  cache->dir = malloc(strlen(dir) + 1);
+  cache->entries = calloc(cap, sizeof(tile_entry));
+  if(!cache->dir || !cache->entries) {
+    worley_tile_cache_close(cache);
+    return NULL;
+  }
+  strcpy(cache->dir, dir);
+  return cache;
+#else
+  (void)dir; (void)capacity; (void)write_back;
+  return NULL;
+#endif
+}
+
+static void entry_release(tile_entry *e) {
+#ifdef TILES_SUPPORTED
+  if(e->map)
+    munmap(e->map, e->map_len);
+#endif
+  memset(e, 0, sizeof(*e));
+}
+
+void worley_tile_cache_close(worley_tile_cache *cache) {
+  if(!cache)
+    return;
+  if(cache->entries)
+    for(size_t i = 0; i < cache->capacity; ++i)
+      entry_release(&cache->entries[i]);
+  free(cache->entries);
+  free(cache->dir);
+  free(cache);
+}
+
+const worley_tile_stats *worley_tile_cache_stats(const worley_tile_cache *cache) {
+  return &cache->stats;
+}
+
+static size_t tile_samples(int dims) {
+  size_t n = dims == 2 ? TILE_RES2 + 1 : TILE_RES3 + 1;
+  return dims == 2 ? n * n : n * n * n;
+}
+
+static size_t tile_file_size(int dims) {
+  return sizeof(tile_header) + tile_samples(dims) * 4 * sizeof(float);
+}
+
+static void tile_path(const worley_tile_cache *cache, uint64_t key, int dims, const int *tile, char *path, size_t n) {
+  snprintf(path, n, "%s/%016llx-%dd_%d_%d_%d.wtile", cache->dir, (unsigned long long)key, dims, tile[0], tile[1], tile[2]);
+}
+
+#ifdef TILES_SUPPORTED
+
+static int header_valid(const tile_header *h, uint64_t key, int dims, const int *tile) {
+  return !memcmp(h->magic, TILE_MAGIC, 8) && h->version == TILE_VERSION && h->dims == (uint32_t)dims && h->key == key
+      && h->tile[0] == tile[0] && h->tile[1] == tile[1] && h->tile[2] == tile[2]
+      && h->cells == (uint32_t)(dims == 2 ? TILE_CELLS2 : TILE_CELLS3) && h->res == (uint32_t)(dims == 2 ? TILE_RES2 : TILE_RES3);
+}
+
+// maps the tile's file, if there is a valid one
+static void entry_map(worley_tile_cache *cache, tile_entry *e) {
+  char path[4096];
+  tile_path(cache, e->key, e->dims, e->tile, path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return;
+  size_t len = tile_file_size(e->dims);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && (size_t)st.st_size == len)
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return;
+  if(!header_valid(map, e->key, e->dims, e->tile)) {
+    munmap(map, len);
+    return;
+  }
+  e->map = map;
+  e->map_len = len;
+  e->texels = (const float *)((const char *)map + sizeof(tile_header));
+  cache->stats.tiles_mapped++;
+}
+
+static int write_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while(n > 0) {
+    ssize_t w = write(fd, p, n);
+    if(w <= 0)
+      return 0;
+    p += w; n -= w;
+  }
+  return 1;
+}
+
+// evaluates the samples of a tile and stores them under the tile's name
+static void entry_bake(worley_tile_cache *cache, tile_entry *e, void *context, const worley_params *params) {
+  size_t len = tile_file_size(e->dims);
+  char *buf = malloc(len);
+  if(!buf)
+    return;
+  tile_header *h = (tile_header *)buf;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, TILE_MAGIC, 8);
+  h->version = TILE_VERSION;
+  h->dims = e->dims;
+  h->key = e->key;
+  memcpy(h->tile, e->tile, sizeof(h->tile));
+  h->cells = e->dims == 2 ? TILE_CELLS2 : TILE_CELLS3;
+  h->res = e->dims == 2 ? TILE_RES2 : TILE_RES3;
+
+  float *out = (float *)(buf + sizeof(tile_header));
+  float cube_dist = worley_cube_dist(params, e->dims);
+  float step = h->cells * cube_dist / h->res;
+  int n = h->res + 1;
+  if(e->dims == 2) {
+    worley_footprint2 none = { { 0, 0 }, { 0, 0 } };
+    for(int y = 0; y < n; ++y)
+      for(int x = 0; x < n; ++x, out += 4) {
+        worley_vec2 pt;
+        pt.u = e->tile[0] * (float)h->cells * cube_dist + x * step;
+        pt.v = e->tile[1] * (float)h->cells * cube_dist + y * step;
+        worley_filtered2 f;
+        worleynoise_filtered(context, params, &pt, &none, &f);
+        out[0] = f.f1; out[1] = f.f2; out[2] = f.f3; out[3] = f.gap_edge;
+      }
+  }
+  else {
+    worley_footprint3 none = { { 0, 0, 0 }, { 0, 0, 0 } };
+    for(int z = 0; z < n; ++z)
+      for(int y = 0; y < n; ++y)
+        for(int x = 0; x < n; ++x, out += 4) {
+          worley_vec3 pt;
+          pt.x = e->tile[0] * (float)h->cells * cube_dist + x * step;
+          pt.y = e->tile[1] * (float)h->cells * cube_dist + y * step;
+          pt.z = e->tile[2] * (float)h->cells * cube_dist + z * step;
+          worley_filtered3 f;
+          worleynoise3d_filtered(context, params, &pt, &none, &f);
+          out[0] = f.f1; out[1] = f.f2; out[2] = f.f3; out[3] = f.gap_edge;
+        }
+  }
+
+  // write to a file of our own, then rename: readers see either no tile or a complete one
+  char path[4096], tmp[4200];
+  tile_path(cache, e->key, e->dims, e->tile, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%p.tmp", path, (long)getpid(), (void *)cache);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int ok = fd >= 0 && write_all(fd, buf, len);
+  if(fd >= 0)
+    ok = (close(fd) == 0) && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if(!ok)
+    unlink(tmp);
+  else
+    cache->stats.tiles_written++;
+  free(buf);
+}
+
+#endif
+
+static uint32_t tile_hash(uint64_t key, const int *tile) {
+  uint32_t h = (uint32_t)(key ^ (key >> 32));
+  h ^= (uint32_t)tile[0] * 0x8da6b343U ^ (uint32_t)tile[1] * 0xd8163841U ^ (uint32_t)tile[2] * 0xcb1ab31fU;
+  h ^= h >> 16; h *= 0x7feb352dU;
+  h ^= h >> 15;
+  return h;
+}
+
+// the samples of a tile, or NULL if it isn't cached (and can't be written)
+static const float *tile_texels(worley_tile_cache *cache, uint64_t key, int dims, const int *tile,
+                                void *context, const worley_params *params) {
+  // set associative: the tile can be in any of the TILE_WAYS slots of its set
+  tile_entry *set = &cache->entries[tile_hash(key, tile) & (cache->capacity - TILE_WAYS)];
+  tile_entry *e = set;
+  cache->clock++;
+  for(int i = 0; i < TILE_WAYS; ++i) {
+    tile_entry *w = &set[i];
+    if(w->used && w->key == key && w->dims == dims && !memcmp(w->tile, tile, sizeof(w->tile))) {
+      w->last_use = cache->clock;
+      return w->texels;
+    }
+    if(w->last_use < e->last_use)
+      e = w;
+  }
+
+  // replace the least recently used slot
+  entry_release(e);
+  e->last_use = cache->clock;
+  e->used = 1;
+  e->key = key;
+  e->dims = dims;
+  memcpy(e->tile, tile, sizeof(e->tile));
+#ifdef TILES_SUPPORTED
+  entry_map(cache, e);
+  if(!e->texels && cache->write_back) {
+    entry_bake(cache, e, context, params);
+    entry_map(cache, e);
+  }
+#endif
+  if(!e->texels)
+    cache->stats.tiles_missing++;
+  return e->texels;
+}
+
+static float tile_value(const float *s, dist_mode mode) {
+  float value = scaling_function(worley_combine(mode, s[0], s[1], s[2]));
+  return s[3] < 0 ? -value : value;
+}
+
+static int tile_coord(float c, int cells, int res, int *tile, float *local) {
+  float t = floorf(c / cells);
+  if(!(fabsf(t) < 1e9f))
+    return 0;
+  *tile = (int)t;
+  float l = (c - t * cells) / cells * res;
+  *local = l < 0 ? 0 : (l > res ? res : l);
+  return 1;
+}
+
+int worley_tile_val(worley_tile_cache *cache, worley_context2 *context, const worley_params *params,
+                    const worley_vec2 *pt, float *val) {
+  // the 2D jagging noise is much finer than the tile grid; interpolating it loses most of the jagged gap
+  if(params->jagged_gap)
+    return 0;
+  uint64_t key = cached_key(cache, params, 2);
+  float cube_dist = worley_cube_dist(params, 2);
+  int tile[3] = { 0, 0, 0 };
+  float lu, lv;
+  if(!tile_coord(pt->u / cube_dist, TILE_CELLS2, TILE_RES2, &tile[0], &lu)
+     || !tile_coord(pt->v / cube_dist, TILE_CELLS2, TILE_RES2, &tile[1], &lv))
+    return 0;
+  const float *texels = tile_texels(cache, key, 2, tile, context, params);
+  if(!texels)
+    return 0;
+  cache->stats.lookups++;
+
+  int n = TILE_RES2 + 1;
+  int x = (int)lu, y = (int)lv;
+  if(x > TILE_RES2 - 1) x = TILE_RES2 - 1;
+  if(y > TILE_RES2 - 1) y = TILE_RES2 - 1;
+  float ax = lu - x, ay = lv - y;
+  const float *a = texels + 4 * (y * n + x), *b = a + 4, *c = a + 4 * n, *d = c + 4;
+  float s[4];
+  for(int k = 0; k < 4; ++k)
+    s[k] = (1 - ay) * ((1 - ax) * a[k] + ax * b[k]) + ay * ((1 - ax) * c[k] + ax * d[k]);
+  *val = tile_value(s, params->distance_mode);
+  return 1;
+}
+
+int worley_tile_val3(worley_tile_cache *cache, worley_context3 *context, const worley_params *params,
+                     const worley_vec3 *pt, float *val) {
+  uint64_t key = cached_key(cache, params, 3);
+  float cube_dist = worley_cube_dist(params, 3);
+  int tile[3];
+  float l[3];
+  const float p[3] = { pt->x, pt->y, pt->z };
+  for(int k = 0; k < 3; ++k)
+    if(!tile_coord(p[k] / cube_dist, TILE_CELLS3, TILE_RES3, &tile[k], &l[k]))
+      return 0;
+  const float *texels = tile_texels(cache, key, 3, tile, context, params);
+  if(!texels)
+    return 0;
+  cache->stats.lookups++;
+
+  int n = TILE_RES3 + 1;
+  int i[3];
+  float w[3];
+  for(int k = 0; k < 3; ++k) {
+    i[k] = (int)l[k];
+    if(i[k] > TILE_RES3 - 1) i[k] = TILE_RES3 - 1;
+    w[k] = l[k] - i[k];
+  }
+  float s[4] = { 0, 0, 0, 0 };
+  for(int corner = 0; corner < 8; ++corner) {
+    int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+    float weight = (dx ? w[0] : 1 - w[0]) * (dy ? w[1] : 1 - w[1]) * (dz ? w[2] : 1 - w[2]);
+    const float *t = texels + 4 * (((size_t)(i[2] + dz) * n + (i[1] + dy)) * n + (i[0] + dx));
+    for(int k = 0; k < 4; ++k)
+      s[k] += weight * t[k];
+  }
+  *val = tile_value(s, params->distance_mode);
+  return 1;
+}
@@ -0,0 +1,147 @@
+/*
+ * Dense voxel grids of the 3D noise, baked slab by slab (see worley_volume_bake in worley.h).
+ *
+ * A slab is a few z slices. Within a slab the voxels are visited column by column (all slices of a voxel,
+ * then the next voxel of the row), so consecutive points stay in the same cubes and the context's window moves rarely.
+ * The cell cache is sized for the cubes of two slabs: the cubes a slab shares with the previous one are still cached,
+ * so every cube is generated about once for the whole volume, while memory doesn't grow with nz.
+ */
+
+#include "worley.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// no more cubes than this are cached, whatever the volume covers (about 70MB)
+#define VOLUME_MAX_CELLS (1 << 20)
+
+// the steps between neighbouring voxels along x, y and z in noise space.
+// The points themselves are transformed one by one, in the shader's order of operations, so they match it exactly.
+typedef struct volume_grid {
+  worley_vec3 step[3];
+} volume_grid;
+
+static worley_vec3 transform_vector(const float *m, float x, float y, float z) {
+  worley_vec3 v = { x * m[0] + y * m[4] + z * m[8], x * m[1] + y * m[5] + z * m[9], x * m[2] + y * m[6] + z * m[10] };
+  return v;
+}
+
+static void volume_grid_init(volume_grid *grid, const worley_volume *volume) {
+  const float *m = volume->matrix;
+  int n[3] = { volume->nx, volume->ny, volume->nz };
+  float d[3];
+  for(int a = 0; a < 3; ++a)
+    d[a] = (volume->hi[a] - volume->lo[a]) / n[a];
+  grid->step[0] = transform_vector(m, d[0], 0, 0);
+  grid->step[1] = transform_vector(m, 0, d[1], 0);
+  grid->step[2] = transform_vector(m, 0, 0, d[2]);
+}
+
+// the center of voxel i along axis a, before the matrix
+static float voxel_center(const worley_volume *volume, int a, int n, int i) {
+  return volume->lo[a] + (volume->hi[a] - volume->lo[a]) * (i + 0.5f) / n;
+}
+
+static float vec3_len(const worley_vec3 *v) {
+  return sqrtf(v->x * v->x + v->y * v->y + v->z * v->z);
+}
+
+// the cubes the windows of all octaves touch while baking one slab of the grid
+static double slab_cells(const volume_grid *grid, const worley_volume *volume, int depth,
+                         float cube_dist, int radius, const worley_fractal *fractal) {
+  // the bounding box of the slab (a parallelepiped in noise space) is the sum of its edges
+  int n[3] = { volume->nx, volume->ny, depth };
+  float extent[3] = { 0, 0, 0 };
+  for(int a = 0; a < 3; ++a) {
+    extent[0] += fabsf(grid->step[a].x) * n[a];
+    extent[1] += fabsf(grid->step[a].y) * n[a];
+    extent[2] += fabsf(grid->step[a].z) * n[a];
+  }
+  int octaves = fractal ? fractal->octaves : 1;
+  double cells = 0, freq = 1;
+  for(int i = 0; i < octaves; ++i) {
+    // plus the window's neighbours on both sides
+    double c = 1;
+    for(int a = 0; a < 3; ++a)
+      c *= floor(extent[a] * freq / cube_dist) + 2 * radius + 1;
+    cells += c;
+    if(fractal)
+      freq *= fractal->lacunarity;
+  }
+  return cells;
+}
+
+int worley_volume_bake(const worley_volume *volume, const worley_params *params, const worley_fractal *fractal,
+                       int z0, int z1, worley_slab_fn fn, void *user, worley_cache_stats *stats) {
+  if(volume->nx < 1 || volume->ny < 1 || volume->nz < 1)
+    return 0;
+  if(z0 < 0) z0 = 0;
+  if(z1 > volume->nz) z1 = volume->nz;
+  if(fractal && fractal->octaves <= 1)
+    fractal = NULL;
+  int depth = volume->slab > 0 ? volume->slab : WORLEY_VOLUME_SLAB;
+  size_t nx = volume->nx, ny = volume->ny;
+
+  volume_grid grid;
+  volume_grid_init(&grid, volume);
+  float cube_dist = worley_cube_dist(params, 3);
+  int radius = worley_window_radius(worley_min_cube_points(params), 3, params->distance_measure);
+  double cells = 2 * slab_cells(&grid, volume, depth, cube_dist, radius, fractal);
+  size_t capacity = cells < VOLUME_MAX_CELLS ? (size_t)cells : VOLUME_MAX_CELLS;
+
+  // octaves finer than a voxel fade out
+  float footprint = 0;
+  for(int a = 0; a < 3; ++a)
+    footprint = fmaxf(footprint, vec3_len(&grid.step[a]));
+
+  worley_context_pool *pool = worley_context_pool_create(1, 3, fractal ? fractal->octaves : 1, capacity, WORLEY_CELLS_FLOAT);
+  float *slab = malloc(sizeof(float) * nx * ny * depth);
+  worley_vec3 *pts = malloc(sizeof(worley_vec3) * nx * depth);
+  float *column = malloc(sizeof(float) * nx * depth); // the values of pts
+  int ok = pool && slab && pts && column;
+  worley_context3 *contexts = ok ? worley_context_pool_get3(pool, 0) : NULL;
+
+  worley_batch_out out;
+  memset(&out, 0, sizeof(out));
+  out.value = column;
+  for(int zs = z0; ok && zs < z1; zs += depth) {
+    int n = z1 - zs < depth ? z1 - zs : depth;
+    const float *m = volume->matrix;
+    for(size_t j = 0; j < ny; ++j) {
+      // the row j of all slices of the slab, column by column
+      float y = voxel_center(volume, 1, volume->ny, (int)j);
+      for(size_t i = 0; i < nx; ++i) {
+        float x = voxel_center(volume, 0, volume->nx, (int)i);
+        for(int k = 0; k < n; ++k) {
+          float z = voxel_center(volume, 2, volume->nz, zs + k);
+          worley_vec3 *p = &pts[i * n + k];
+          p->x = x * m[0] + y * m[4] + z * m[8] + m[12];
+          p->y = x * m[1] + y * m[5] + z * m[9] + m[13];
+          p->z = x * m[2] + y * m[6] + z * m[10] + m[14];
+        }
+      }
+      if(fractal) {
+        for(size_t c = 0; c < nx * n; ++c)
+          column[c] = worleynoise3d_fractal(contexts, params, fractal, &pts[c], footprint);
+      }
+      else
+        worleynoise3d_batch(contexts, params, NULL, pts, nx * n, &out);
+      for(size_t i = 0; i < nx; ++i)
+        for(int k = 0; k < n; ++k)
+          slab[(k * ny + j) * nx + i] = column[i * n + k];
+    }
+    ok = fn(user, zs, n, slab);
+  }
+
+  if(stats && pool) {
+    worley_cache_stats s;
+    worley_context_pool_stats(pool, &s);
+    worley_cache_stats_add(stats, &s);
+  }
+  free(column);
+  free(pts);
+  free(slab);
+  worley_context_pool_destroy(pool);
+  return ok;
+}